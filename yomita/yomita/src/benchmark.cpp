@@ -21,7 +21,11 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cmath>
+#include <fstream>
+#include <iomanip>
 #include <sstream>
+#include <algorithm>
 
 #include "usi.h"
 #include "search.h"
@@ -34,23 +38,133 @@ namespace USI
     extern void position(Board& b, istringstream& up);
     extern void go(const Board& b, istringstream& ss_cmd);
     extern void setoption(istringstream& ss_cmd);
+    extern Move toMove(const Board& b, std::string str);
 }
 
-void benchmark(Board& b)
+namespace
 {
-    USI::isready();
+    // 探索中の出力を捨てるためのstreambuf
+    struct NullBuf : public streambuf
+    {
+        int overflow(int c) { return c; }
+    };
 
-    // ここに探索時の条件を追加
-    string options[] =
+    // bench suiteの1問。
+    struct SuiteEntry
     {
-        "name Threads value 1",
-        "name Hash value 128",
-        "name NetworkDelay value 0",
-        "name DrawScore value -50",
+        string id, position;
+
+        // bm : 正解手(どれか1つを指せば正解)、am : 指してはいけない手
+        vector<string> best_moves, avoid_moves;
+
+        // dm : この手数以内の詰みを見つければ正解。0なら詰みは問わない。
+        int mate_ply = 0;
     };
 
+    // EPD風の1行を読む。局面("sfen ..."または"startpos moves ...")の後に"bm", "am", "dm", "id"の命令を";"区切りで並べる。
+    // 例) sfen lr6+L/2P3gk1/4g4/4pppp1/p8/1Pnp+s1P2/P5SP1/LS7/K7R b BGS2NL6Pbgnp 100 dm 21; id "23銀";
+    bool parseSuiteLine(const string& line, SuiteEntry& e)
+    {
+        istringstream is(line);
+        string token, op;
+
+        while (is >> token)
+        {
+            if (token == "bm" || token == "am" || token == "dm" || token == "id")
+            {
+                op = token;
+                break;
+            }
+
+            e.position += token + " ";
+        }
+
+        while (is >> token)
+        {
+            bool end_op = token.back() == ';';
+
+            if (end_op)
+                token.pop_back();
+
+            if (token == "bm" || token == "am" || token == "dm" || token == "id")
+                op = token;
+
+            else if (!token.empty())
+            {
+                if (op == "bm")
+                    e.best_moves.push_back(token);
+                else if (op == "am")
+                    e.avoid_moves.push_back(token);
+                else if (op == "dm")
+                    e.mate_ply = atoi(token.c_str());
+                else if (op == "id")
+                    e.id += (e.id.empty() ? "" : " ") + token;
+            }
+
+            if (end_op)
+                op.clear();
+        }
+
+        e.id.erase(remove(e.id.begin(), e.id.end(), '"'), e.id.end());
+
+        return !e.position.empty() && (!e.best_moves.empty() || !e.avoid_moves.empty() || e.mate_ply);
+    }
+
+    // 反復の結果が正解の条件を満たしているか。
+    bool isSolved(const SuiteEntry& e, const MainThread::Iteration& it)
+    {
+        const string m = toUSI(it.best_move);
+
+        if (!e.best_moves.empty() && find(e.best_moves.begin(), e.best_moves.end(), m) == e.best_moves.end())
+            return false;
+
+        if (find(e.avoid_moves.begin(), e.avoid_moves.end(), m) != e.avoid_moves.end())
+            return false;
+
+        // USI::score()と同じく、詰みまでの手数はSCORE_MATE - score - 1
+        if (e.mate_ply && (it.score < SCORE_MATE_IN_MAX_PLY || SCORE_MATE - it.score - 1 > e.mate_ply))
+            return false;
+
+        return true;
+    }
+}
+
+// 探索速度の計測。"bench [hash N] [threads N] [depth N | nodes N | movetime N] [file <path>] [json]"
+// fileには1行に1局面を"position"コマンドの形式(先頭の"position"は省略可)で書く。bench suite用のファイルもそのまま読める。
+// jsonを指定すると、結果をJSONで出力する(探索中の出力は捨てる)。
+void benchmark(Board& b, istringstream& is)
+{
+    string token, file_name, str_go;
+    string hash = "128", threads = "1";
+    bool json = false;
+
+    while (is >> token)
+    {
+        if (token == "hash")
+            is >> hash;
+        else if (token == "threads")
+            is >> threads;
+        else if (token == "file")
+            is >> file_name;
+        else if (token == "json")
+            json = true;
+        else if (token == "depth" || token == "nodes" || token == "movetime")
+        {
+            string n;
+            is >> n;
+            str_go += " " + token + " " + n;
+        }
+    }
+
+    // ここに探索時の持ち時間など　探索深さでもいい
+    if (str_go.empty())
+        str_go =
+        //"go infinite";
+        " depth 18";
+        //" btime 0 wtime 0 byoyomi 10000";
+
     // ここに探索局面を追加
-    const vector<string> positions =
+    vector<string> positions =
     {
         // 5f4e
         "startpos moves 5g5f",
@@ -73,40 +187,287 @@ void benchmark(Board& b)
         //"sfen 1n2+B3K/l2k2s2/p2pg2+b1/1+rp2g3/5g3/9/1+p+n1+p2+p1/6+n1+p/1+r+p6 w 10p3ln3sg 187",
     };
 
-    // ここに探索時の持ち時間など　探索深さでもいい
-    string str_go =
-        //"go infinite";
-        " depth 18";
-        //" btime 0 wtime 0 byoyomi 10000";
+    if (!file_name.empty())
+    {
+        ifstream ifs(file_name);
+
+        if (!ifs)
+        {
+            cout << "info string can't open " << file_name << endl;
+            return;
+        }
+
+        positions.clear();
+
+        for (string line; getline(ifs, line);)
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            if (line.compare(0, 9, "position ") == 0)
+                line.erase(0, 9);
+
+            SuiteEntry e;
+
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            parseSuiteLine(line, e);
+            positions.push_back(e.position);
+        }
+    }
+
+    // 探索中の"info"や"bestmove"は表示しない
+    NullBuf null_buf;
+    streambuf* cout_buf = cout.rdbuf();
+
+    if (json)
+        cout.rdbuf(&null_buf);
+
+    TimePoint init_time = now();
+    USI::isready();
+
+    // ここに探索時の条件を追加
+    string options[] =
+    {
+        "name Threads value " + threads,
+        "name Hash value " + hash,
+        "name NetworkDelay value 0",
+        "name DrawScore value -50",
+#ifdef USE_DFPN
+        // 詰み探索スレッドが先に詰みを見つけるかどうかで結果が変わらないように
+        "name MateThreads value 0",
+#endif
+    };
 
     for (auto& str : options)
     {
-        istringstream is(str);
-        USI::setoption(is);
+        istringstream iss(str);
+        USI::setoption(iss);
     }
 
     Search::clear();
-    int64_t nodes = 0;
-    TimePoint elapsed = now();
+    init_time = now() - init_time;
+
+    // 局面ごとのノード数から作るチェックサム(FNV-1a)。Threads 1でdepthかnodesを指定したときは、探索の中身が変わらなければ同じ値になる。
+    uint64_t signature = 14695981039346656037ULL;
+    int64_t nodes = 0, search_time = 0, clear_time = 0;
+#ifdef USE_SEARCH_STATS
+    Search::Statistics stats;
+    stats.clear();
+#endif
+    ostringstream json_positions;
 
     for (size_t i = 0; i < positions.size(); ++i)
     {
-        istringstream is(positions[i]);
-        USI::position(b, is);
-        cout << b << endl;
-        is.clear(stringstream::goodbit);
-        is.str(str_go);
-        USI::go(b, is);
+        istringstream iss(positions[i]);
+        USI::position(b, iss);
+
+        if (!json)
+            cout << b << endl;
+
+        TimePoint elapsed = now();
+        iss.clear(stringstream::goodbit);
+        iss.str(str_go);
+        USI::go(b, iss);
         Threads.main()->join();
-        nodes += Threads.nodeSearched();
+        elapsed = now() - elapsed;
+
+        const uint64_t n = Threads.nodeSearched();
+        // 詰みを見つけて打ち切ったときなどは最後の要素の深さがDEPTH_MAXになるので、深さは最後の反復のものを使う。
+        const auto& its = Threads.main()->iterations;
+        const auto& last = its.back();
+        const Depth depth = its.size() > 1 ? its[its.size() - 2].depth : last.depth;
+        const int hashfull = GlobalTT.hashfull();
+        int seldepth = 0;
+
+        for (auto th : Threads)
+        {
+            seldepth = std::max(seldepth, th->max_ply);
+#ifdef USE_SEARCH_STATS
+            stats += th->search_stats;
+#endif
+        }
+
+        nodes += n;
+        search_time += elapsed;
+        signature = (signature ^ n) * 1099511628211ULL;
+
+        TimePoint clear = now();
         Search::clear();
+        clear_time += now() - clear;
+
+        if (json)
+        {
+            string pos = positions[i];
+            pos.erase(remove(pos.begin(), pos.end(), '"'), pos.end());
+
+            json_positions << (i ? "," : "") << "\n    {"
+                << " \"position\": \"" << pos << "\","
+                << " \"nodes\": " << n << ","
+                << " \"time_ms\": " << elapsed << ","
+                << " \"nps\": " << 1000 * n / std::max(elapsed, (TimePoint)1) << ","
+                << " \"depth\": " << depth / ONE_PLY << ","
+                << " \"seldepth\": " << seldepth << ","
+                << " \"hashfull\": " << hashfull << ","
+                << " \"bestmove\": \"" << toUSI(last.best_move) << "\","
+                << " \"score\": \"" << USI::score(last.score) << "\" }";
+        }
+        else
+            cout << "position " << i + 1 << " : nodes " << n << " time " << elapsed
+                 << " seldepth " << seldepth << " hashfull " << hashfull << endl;
     }
 
-    elapsed = now() - elapsed + 1;
+    cout.rdbuf(cout_buf);
+    const int64_t elapsed = std::max(search_time, (int64_t)1);
+
+    if (json)
+        cout << "{"
+             << "\n  \"go\": \"" << str_go.substr(1) << "\","
+             << "\n  \"threads\": " << threads << ","
+             << "\n  \"hash\": " << hash << ","
+             << "\n  \"nodes\": " << nodes << ","
+             << "\n  \"nps\": " << 1000 * nodes / elapsed << ","
+             << "\n  \"signature\": \"" << hex << setw(16) << setfill('0') << signature << dec << setfill(' ') << "\","
+             << "\n  \"init_ms\": " << init_time << ","
+             << "\n  \"search_ms\": " << search_time << ","
+             << "\n  \"clear_ms\": " << clear_time << ","
+#ifdef USE_SEARCH_STATS
+             << "\n  \"stats\": " << stats.toJSON() << ","
+#endif
+             << "\n  \"positions\": [" << json_positions.str()
+             << "\n  ]"
+             << "\n}" << endl;
+    else
+        cout << "\n==========================="
+             << "\nTotal time (ms) : " << elapsed
+             << "\nNodes searched  : " << nodes
+             << "\nNodes/second    : " << 1000 * nodes / elapsed
+             << "\nSignature       : " << hex << setw(16) << setfill('0') << signature << dec << setfill(' ')
+             << "\nInit time (ms)  : " << init_time
+             << "\nClear time (ms) : " << clear_time << endl;
+}
+
+// 正解付きの局面集を探索して、解けた問題数と解けるまでの時間、ノード数を表示する。
+// bench suite <file> [depth N | nodes N | movetime N] (省略時はmovetime 1000)
+void benchmarkSuite(Board& b, istringstream& is)
+{
+    string file_name, token, str_go;
+    is >> file_name;
+
+    while (is >> token)
+        if (token == "depth" || token == "nodes" || token == "movetime")
+        {
+            string n;
+            is >> n;
+            str_go += " " + token + " " + n;
+        }
+
+    if (str_go.empty())
+        str_go = " movetime 1000";
+
+    ifstream ifs(file_name);
+
+    if (!ifs)
+    {
+        cout << "info string can't open " << file_name << endl;
+        return;
+    }
+
+    vector<SuiteEntry> entries;
+
+    for (string line; getline(ifs, line);)
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        SuiteEntry e;
+
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        if (parseSuiteLine(line, e))
+            entries.push_back(e);
+        else
+            cout << "info string skip : " << line << endl;
+    }
+
+    USI::isready();
+
+    // 定跡で指してしまうと問題にならないので。終わったら元の設定に戻す。
+    const bool use_book = USI::Options["UseBook"];
+    istringstream is_book("name UseBook value false");
+    USI::setoption(is_book);
+
+    cout << "bench suite " << file_name << " :" << str_go << " , " << entries.size() << " positions" << endl;
+
+    int solved = 0;
+    int64_t nodes = 0, total_time = 0, solve_time = 0, score_time = 0;
+    double log_nodes = 0;
+
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const SuiteEntry& e = entries[i];
+
+        // 探索中の"info"や"bestmove"は表示しない
+        NullBuf null_buf;
+        streambuf* cout_buf = cout.rdbuf(&null_buf);
+
+        Search::clear();
+        istringstream is_pos(e.position);
+        USI::position(b, is_pos);
+        istringstream is_go(str_go);
+        USI::go(b, is_go);
+        Threads.main()->join();
+
+        cout.rdbuf(cout_buf);
+
+        const auto& its = Threads.main()->iterations;
+        const auto& last = its.back();
+        nodes += Threads.nodeSearched();
+        total_time += last.time;
+
+        cout << setw(4) << i + 1 << " " << (e.id.empty() ? e.position.substr(0, 40) : e.id)
+             << " : bestmove " << toUSI(last.best_move) << " score " << USI::score(last.score);
+
+        if (isSolved(e, last))
+        {
+            // 最後まで正解のままだった最初の反復を、解けた時点とする。
+            size_t first = its.size() - 1;
+
+            while (first > 0 && isSolved(e, its[first - 1]))
+                first--;
+
+            solved++;
+            solve_time += its[first].time;
+            score_time += its[first].time;
+            log_nodes += log((double)std::max(its[first].nodes, (uint64_t)1));
+
+            cout << " solved time " << its[first].time << " nodes " << its[first].nodes << endl;
+        }
+        else
+        {
+            score_time += last.time;
+            cout << " unsolved" << endl;
+        }
+    }
+
+    Search::clear();
+    istringstream is_restore_book(string("name UseBook value ") + (use_book ? "true" : "false"));
+    USI::setoption(is_restore_book);
 
     cout << "\n==========================="
-         << "\nTotal time (ms) : " << elapsed
+         << "\nPositions       : " << entries.size()
+         << "\nSolved          : " << solved
+         << "\nTotal time (ms) : " << total_time
          << "\nNodes searched  : " << nodes
-         << "\nNodes/second    : " << 1000 * nodes / elapsed << endl;
-}
+         << "\nNodes/second    : " << 1000 * nodes / std::max(total_time, (int64_t)1);
+
+    if (solved)
+        cout << "\nTime to solve   : " << solve_time / solved << " ms (mean)"
+             << "\nNodes to solve  : " << (uint64_t)exp(log_nodes / solved) << " (geometric mean)";
 
+    // 解けた問題は解けるまでの時間、解けなかった問題は探索した時間を合計して、1秒あたりに解けた問題数を総合点とする。
+    cout << "\nScore           : " << fixed << setprecision(2) << solved * 1000.0 / std::max(score_time, (int64_t)1)
+         << " solved/s" << defaultfloat << endl;
+}
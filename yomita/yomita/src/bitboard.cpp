@@ -26,6 +26,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifdef USE_BITBOARD
 
 #include <fstream>
+#include <cstring>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
 
 #include "bitboard.h"
 
@@ -75,6 +81,38 @@ const uint64_t PEXT_MASK_DIAG[SQ_MAX] =
     0x80808080808080ULL, 0x101010101010000ULL, 0x282020202000000ULL, 0x504440400000000ULL, 0xa08882000000000ULL, 0x1411004010000000ULL, 0x2802008020080000ULL, 0x1004010040100400ULL, 0x2008020080200802ULL,
 };
 
+bool UsePextSlider;
+uint64_t FILE_MAGIC[SQ_MAX];
+
+// 角の利きのmagic。Stockfishのmagic bitboardの初期化と同じ方法で、merge()したbitboardに対して探したもの。
+// 起動のたびに探すと0.5秒ほどかかるので、見つけたものを埋め込んである。
+const uint64_t BISHOP_MAGIC[SQ_MAX] =
+{
+    0x4002084280020059ULL, 0x8400502480080400ULL, 0x408810002a82000ULL, 0x8010c0804100132ULL, 0x8210091000042068ULL, 0x10082044a000020ULL, 0x240802204108840ULL, 0x21048012004008ULL, 0x81001020044008ULL,
+    0x10188a40042012ULL, 0x1228188912804ULL, 0x88012110018c00ULL, 0x2010282440400ULL, 0x1c84408210000000ULL, 0x1802804304004100ULL, 0x4001801100ca2028ULL, 0x42c1011040812008ULL, 0x201004804108ULL,
+    0xa0000c4400504e82ULL, 0x42100a0104042029ULL, 0x200050022200244ULL, 0x8401420024120011ULL, 0x1401401082080000ULL, 0x1000d8048502002ULL, 0x2020004002041080ULL, 0x10004080108920ULL, 0x4a003048842040ULL,
+    0x2009001c88442210ULL, 0x1024088928216001ULL, 0x8004020803000acULL, 0x808010004020000cULL, 0x81000044200200ULL, 0x20042040008010ULL, 0x400800001104228ULL, 0x500208102204004ULL, 0x90280002811c402ULL,
+    0x9008411900820910ULL, 0x44834000020a004ULL, 0x2100c0000202021ULL, 0x4002004000010082ULL, 0x5001002004008004ULL, 0x1002011000821080ULL, 0x8821404804104020ULL, 0x500208008102841ULL, 0x404422000008201ULL,
+    0x1906004415460108ULL, 0x40860102010202ULL, 0x600408090004810ULL, 0x1008010084002ULL, 0x2820004002004801ULL, 0x1002002001000024ULL, 0xb000240404001802ULL, 0xa0908040001401ULL, 0xa050201010020208ULL,
+    0x5400402086042040ULL, 0x200208902929130ULL, 0x8002445008800240ULL, 0x71044010810a0ULL, 0x8060380208400001ULL, 0x2860044084901002ULL, 0x120800970100082ULL, 0x22044100d0208002ULL, 0x800890002011807ULL,
+    0x2046012482110080ULL, 0x3320084081001420ULL, 0x402090805800ULL, 0x1040200902044000ULL, 0x34030b202011000ULL, 0x54101024410810ULL, 0x1080101100220ULL, 0x4002004640200082ULL, 0x20220040c0012084ULL,
+    0x10010084144a081ULL, 0x6008804260045008ULL, 0x380a002002400810ULL, 0x742000816249020ULL, 0x900000404010c18ULL, 0x10510200248044ULL, 0x2404108485002021ULL, 0x4018090018081048ULL, 0x2100a142060010bULL,
+};
+
+// 64 - 角が利きを調べる必要があるマスの数
+const int BISHOP_MAGIC_SHIFT[SQ_MAX] =
+{
+    57, 58, 58, 58, 58, 58, 58, 58, 57,
+    58, 58, 58, 58, 58, 58, 58, 58, 58,
+    58, 58, 56, 56, 56, 56, 56, 58, 58,
+    58, 58, 56, 54, 54, 54, 56, 58, 58,
+    58, 58, 56, 54, 52, 54, 56, 58, 58,
+    58, 58, 56, 54, 54, 54, 56, 58, 58,
+    58, 58, 56, 56, 56, 56, 56, 58, 58,
+    58, 58, 58, 58, 58, 58, 58, 58, 58,
+    57, 58, 58, 58, 58, 58, 58, 58, 57,
+};
+
 Bitboard BB_PAWN_ATTACKS  [TURN_MAX][SQ_MAX];
 Bitboard BB_KNIGHT_ATTACKS[TURN_MAX][SQ_MAX];
 Bitboard BB_SILVER_ATTACKS[TURN_MAX][SQ_MAX];
@@ -230,11 +268,25 @@ namespace
         return result;
     };
 
-    uint64_t occupiedToIndex(const Bitboard& block, const Bitboard& mask)
+    // 縦の利きのmagic。
+    // merge()したbitboardでは同じ筋の升は9bitおきに並んでいるので、f + 9k bit目(k = 0..6)を
+    // 57 - 8k - f bitずらしたものを足し合わせれば、57 + k bit目に集まる。k != jの項は重ならないので繰り上がりも起きない。
+    void initFileMagics()
     {
-        return pext(block.merge(), mask.merge());
+        uint64_t magic = 0;
+
+        for (int k = 0; k < 7; k++)
+            magic |= 1ULL << (57 - 8 * k);
+
+        for (auto sq : Squares)
+        {
+            FILE_MAGIC[sq] = magic >> fileOf(sq);
+
+            assert(((PEXT_MASK_FILE[sq] * FILE_MAGIC[sq]) >> 57) == 127);
+        }
     }
 
+    // 角の利きテーブルを、今の引き方(UsePextSlider)に合わせて作る。
     void initBishop()
     {
         // 各マスのbishopが利きを調べる必要があるマスの数
@@ -269,14 +321,52 @@ namespace
             for (int i = 0; i < (1 << num1s); ++i)
             {
                 const Bitboard occupied = indexToOccupied(i, num1s, block);
-                BISHOP_ATTACK[index + occupiedToIndex(occupied & block, block)] = attackCalc(sq, occupied);
+                BISHOP_ATTACK[index + bishopIndex(sq, (occupied & block).merge())] = attackCalc(sq, occupied);
             }
 
+            // magicで引くとき、違う利きが同じ場所に入っていないか。
+            for (int i = 0; i < (1 << num1s); ++i)
+                assert(bishopAttack(sq, indexToOccupied(i, num1s, block)) == attackCalc(sq, indexToOccupied(i, num1s, block)));
+
             index += 1 << BISHOP_BLOCK_BITS[sq];
         }
     }
 }
 
+void setSliderIndexing(bool use_pext)
+{
+    UsePextSlider = use_pext;
+    initBishop();
+}
+
+bool isPextSlow()
+{
+#ifdef HAVE_BMI2
+    // pextがマイクロコードで実装されているのはZen2以前(family 0x17以前)のAMDのCPU。
+    unsigned int regs[4];
+    char vendor[13] = {};
+#ifdef _MSC_VER
+    __cpuid(reinterpret_cast<int*>(regs), 0);
+#else
+    __cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    std::memcpy(vendor + 0, &regs[1], 4);
+    std::memcpy(vendor + 4, &regs[3], 4);
+    std::memcpy(vendor + 8, &regs[2], 4);
+#ifdef _MSC_VER
+    __cpuid(reinterpret_cast<int*>(regs), 1);
+#else
+    __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    const unsigned int family = ((regs[0] >> 8) & 0xf) + ((regs[0] >> 20) & 0xff);
+
+    return std::strcmp(vendor, "AuthenticAMD") == 0 && family < 0x19;
+#else
+    // BMI2を使わないビルドではpextは自前の実装なので遅い。
+    return true;
+#endif
+}
+
 // デバッグ用。ビットボードのレイアウトを見たいときに使う
 std::ostream& operator << (std::ostream& os, const Bitboard& b)
 {
@@ -804,7 +894,8 @@ void initChecks()
 // main()で一番最初に呼ばれなければならない。
 void initTables()
 {
-    initBishop();
+    initFileMagics();
+    setSliderIndexing(!isPextSlow());
     initRelation();
     initAttacks();
     initChecks();
@@ -236,6 +236,24 @@ extern Bitboard BB_OBSTACLE[SQ_MAX][SQ_MAX];
 extern const uint64_t PEXT_MASK_FILE[SQ_MAX];
 extern const uint64_t PEXT_MASK_DIAG[SQ_MAX];
 
+// 飛び駒の利きテーブルをpextで引くならtrue、magic(掛け算とシフト)で引くならfalse。
+// pextが遅いCPU(Zen2以前のAMD)やBMI2が使えないときはmagicを使う。setSliderIndexing()で切り替える。
+extern bool UsePextSlider;
+
+// 縦の利きのmagic。7bitの升の並びがちょうどbit57～63に集まるので、pextと同じindexになる。
+extern uint64_t FILE_MAGIC[SQ_MAX];
+
+// 角の利きのmagicとシフト量。
+extern const uint64_t BISHOP_MAGIC[SQ_MAX];
+extern const int      BISHOP_MAGIC_SHIFT[SQ_MAX];
+
+// 飛び駒の利きテーブルの引き方を切り替える。角の利きテーブルはindexの付け方が変わるので作り直す。
+// 探索中に呼んではならない。
+void setSliderIndexing(bool use_pext);
+
+// pextが遅いCPUならtrue。
+bool isPextSlow();
+
 // 何も邪魔な駒がないときの利き
 extern Bitboard BB_LANCE_ATTACKS[TURN_MAX][SQ_MAX]; 
 extern Bitboard BB_ROOK_ATTACKS[SQ_MAX];
@@ -300,6 +318,20 @@ inline Bitboard knightCheck(const Turn t, const Square sq) { return BB_KNIGHT_CH
 inline Bitboard silverCheck(const Turn t, const Square sq) { return BB_SILVER_CHECKS[t][sq]; }
 inline Bitboard   goldCheck(const Turn t, const Square sq) { return BB_GOLD_CHECKS  [t][sq]; }
 
+// occupied.merge()から、sqにある縦の利きテーブルのindexを求める。
+inline uint64_t fileIndex(const Square sq, const uint64_t merged)
+{
+    return UsePextSlider ? pext(merged, PEXT_MASK_FILE[sq])
+                         : ((merged & PEXT_MASK_FILE[sq]) * FILE_MAGIC[sq]) >> 57;
+}
+
+// occupied.merge()から、sqにある角の利きテーブルのindexを求める。
+inline uint64_t bishopIndex(const Square sq, const uint64_t merged)
+{
+    return UsePextSlider ? pext(merged, PEXT_MASK_DIAG[sq])
+                         : ((merged & PEXT_MASK_DIAG[sq]) * BISHOP_MAGIC[sq]) >> BISHOP_MAGIC_SHIFT[sq];
+}
+
 // 縦横斜めの利きを求める。
 template <RelationType RT> inline Bitboard attacks(const Square from, const Bitboard& occupied)
 {
@@ -315,11 +347,11 @@ template <RelationType RT> inline Bitboard attacks(const Square from, const Bitb
         return BB_RANK_ATTACKS[from][pat];
     }
     else
-        return BB_FILE_ATTACKS[from][pext(occupied.merge(), PEXT_MASK_FILE[from])];
+        return BB_FILE_ATTACKS[from][fileIndex(from, occupied.merge())];
 }
 
 inline Bitboard  lanceAttack(const Turn t, const Square sq, const Bitboard& occupied) { return attacks<DIRECT_FILE>(sq, occupied) & frontMask(t, sq); }
-inline Bitboard bishopAttack(const Square sq, const Bitboard& occupied) { return BISHOP_ATTACK[BISHOP_ATTACK_INDEX[sq] + pext(occupied.merge(), PEXT_MASK_DIAG[sq])]; }
+inline Bitboard bishopAttack(const Square sq, const Bitboard& occupied) { return BISHOP_ATTACK[BISHOP_ATTACK_INDEX[sq] + bishopIndex(sq, occupied.merge())]; }
 inline Bitboard   rookAttack(const Square sq, const Bitboard& occupied) { return attacks<DIRECT_FILE>(sq, occupied) | attacks<DIRECT_RANK>(sq, occupied); }
 inline Bitboard  horseAttack(const Square sq, const Bitboard& occupied) { return bishopAttack(sq, occupied) | kingAttack(sq); }
 inline Bitboard dragonAttack(const Square sq, const Bitboard& occupied) { return   rookAttack(sq, occupied) | kingAttack(sq); }
@@ -151,6 +151,7 @@ void Board::init(std::string sfen, Thread* th)
 
     // ハッシュ値と駒割の計算
     setState(st_);
+    repetitionFilter(st_->board_key)++;
     this_thread_ = th;
     assert(th != nullptr);
 #ifdef USE_EVAL
@@ -259,7 +260,8 @@ RepetitionType Board::repetitionType(int check_max_ply) const
     const int ply = std::min(st_->plies_from_null, check_max_ply);
 
     // 4手かけないと千日手には絶対にならない。
-    if (i <= ply)
+    // 同じboard_keyの局面が一つもなければ、千日手も優等・劣等局面もありえない。
+    if (i <= ply && repetitionFilter(st_->board_key) >= 2)
     {
         // 2手前を見る。
         StateInfo* stp = st_->previous->previous;
@@ -377,6 +379,61 @@ bool Board::existAttacker1(const Turn t, const Square sq) const { return existAt
 
 bool Board::inCheck1() const { return bbCheckers(); }
 
+#ifdef USE_ATTACK_MAP
+#ifdef HAVE_BMI2
+namespace
+{
+    // 32bitのビット列を、ビットが立っているところが0xffになる32バイトに展開する。
+    inline __m256i expandBits(const uint32_t x)
+    {
+        const __m256i shuffle = _mm256_setr_epi64x(0, 0x0101010101010101, 0x0202020202020202, 0x0303030303030303);
+        const __m256i bit = _mm256_set1_epi64x(0x8040201008040201);
+        const __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(x), shuffle);
+        return _mm256_cmpeq_epi8(_mm256_and_si256(v, bit), bit);
+    }
+
+    // countのbbで1になっている升に1を足す(Add == true)か、引く。
+    template <bool Add> inline void accumulate(uint8_t* count, const Bitboard& bb)
+    {
+        // b(1)の45～62ビット目がSQ_MAX - 18～SQ_MAX - 1に対応している。96bitに詰め直してから32升ずつ足す。
+        const uint64_t hi = bb.b(1) >> 45;
+        const uint64_t lo = (bb.b(0) & 0x7fffffffffffffffULL) | (hi << 63);
+        const uint32_t x[3] = { uint32_t(lo), uint32_t(lo >> 32), uint32_t(hi >> 1) };
+
+        for (int i = 0; i < 3; i++)
+        {
+            __m256i* p = reinterpret_cast<__m256i*>(count + i * 32);
+            const __m256i c = _mm256_loadu_si256(p);
+
+            // 0xffは-1なので、足すときは引き、引くときは足す。
+            _mm256_storeu_si256(p, Add ? _mm256_sub_epi8(c, expandBits(x[i])) : _mm256_add_epi8(c, expandBits(x[i])));
+        }
+    }
+}
+#endif
+
+template <bool Add> void Board::accumulateAttacks(StateInfo* si, Bitboard bb) const
+{
+    const Bitboard occ = bbOccupied();
+
+    while (bb)
+    {
+        const Square sq = bb.firstOne();
+        const Piece pc = piece(sq);
+        uint8_t* count = si->attack_count[turnOf(pc)];
+#ifdef HAVE_BMI2
+        accumulate<Add>(count, attackAll(pc, sq, occ));
+#else
+        for (auto s : attackAll(pc, sq, occ))
+            count[s] += Add ? 1 : -1;
+#endif
+    }
+}
+
+template void Board::accumulateAttacks<true >(StateInfo* si, Bitboard bb) const;
+template void Board::accumulateAttacks<false>(StateInfo* si, Bitboard bb) const;
+#endif
+
 void Board::xorBBs(const PieceType pt, const Square sq, const Turn t)
 {
     bb_type_[OCCUPIED] ^= sq;
@@ -416,7 +473,18 @@ bool Board::legal1(const Move move) const
 
     // 玉の移動先に相手の駒の利きがあれば、合法手ではないのでfalse
     if (typeOf(piece(from)) == KING)
+    {
+#ifdef USE_ATTACK_MAP
+        // 玉を取り除くと利きは増えることしかないので、今toに利きがあれば非合法。
+        // 今fromに利いている駒がなければ、玉の後ろから新たにtoに利いてくる駒もない。
+        if (attackCount(~self, toSq(move)))
+            return false;
+
+        if (!attackCount(~self, from))
+            return true;
+#endif
         return !(existAttacker(~self, toSq(move), bbOccupied() & ~mask(from)));
+    }
 
     // 玉以外の駒の移動 fromにある駒がtoに移動したとき自分の玉に王手がかかるかどうか。
     return !(isDiscoveredCheck(from, toSq(move), kingSquare(self), st_->blockers_for_king[self]));
@@ -528,7 +596,7 @@ bool Board::givesCheck1(Move m) const
     if (isDrop(m))
     {
         // 駒打ちなら打った駒が王手になるかを判定してそのまま帰る。
-        return st_->check_sq[movedPieceType(m)] & to;
+        return checkSquares(movedPieceType(m)) & to;
     }
     else
     {
@@ -536,7 +604,7 @@ bool Board::givesCheck1(Move m) const
         const PieceType pt = movedPieceTypeTo(m);
 
         // 直接王手
-        if (st_->check_sq[pt] & to)
+        if (checkSquares(pt) & to)
             return true;
 
         // fromにある駒を動かすと相手玉に対して王手になる
@@ -668,6 +736,12 @@ bool Board::seeGe1(const Move m, const Score s) const
     if (next_victim == KING)
         return true;
 
+#ifdef USE_ATTACK_MAP
+    // toに相手の利きがなく、fromの後ろから利いてくる相手の飛び駒もないなら取り返されない。
+    if (!attackCount(~turn(), toSq(m)) && (isDrop(m) || !attackCount(~turn(), fromSq(m))))
+        return true;
+#endif
+
     // next_victimを取り返す側の手番が相手ならtrue, 自分ならfalse。
     // trueであればbalance >= s、falseであればbalance < sでなければならない。
     bool relative_turn = true, promote;
@@ -882,6 +956,22 @@ void Board::setState(StateInfo* st) const
             st->material += (t == BLACK ? 1 : -1) * Score(count * pieceScore(hp));
             st->hand_key += Zobrist::hand[t][hp] * count;
         }
+
+#ifdef USE_ATTACK_MAP
+    std::memset(st->attack_count, 0, sizeof(st->attack_count));
+    accumulateAttacks<true>(st, bbOccupied());
+#endif
+}
+
+Key Board::mirrorKey() const
+{
+    Key k = turn() == BLACK ? Zobrist::zero : Zobrist::turn;
+
+    for (auto sq : Squares)
+        if (piece(sq))
+            k += Zobrist::psq[mirror(sq)][piece(sq)];
+
+    return k + st_->hand_key;
 }
 
 void Board::doMove(const Move move, StateInfo& new_st)
@@ -941,6 +1031,11 @@ void Board::doMove(const Move move, StateInfo& new_st, bool gives_check)
     Key h = st_->hand_key;
     Score material = st_->material;
 
+#ifdef USE_BITBOARD
+    // 王手をかける手なら、王手駒を求めるのに現局面のcheck_sqが必要になる。
+    if (gives_check)
+        checkSquares();
+#endif
     std::memcpy(&new_st, st_, offsetof(struct StateInfo, material));
     new_st.previous = st_;
     st_ = &new_st;
@@ -952,6 +1047,25 @@ void Board::doMove(const Move move, StateInfo& new_st, bool gives_check)
 
     assert(self == turnOf(pc));
 
+#ifdef USE_ATTACK_MAP
+    // 利きが変わるのは、動かす駒、取られる駒、fromかtoに利いている飛び駒だけである。
+    // 動かす前の盤面でそれらの利きを引いておき、動かした後の盤面で足し直す。
+    std::memcpy(st_->attack_count, st_->previous->attack_count, sizeof(st_->attack_count));
+    Bitboard attack_changed = isCapture(move) ? mask(to) : allZeroMask();
+    {
+        const Bitboard occ = bbOccupied();
+        const Bitboard rook_like = bbType(LANCE, ROOK, DRAGON), bishop_like = bbType(BISHOP, HORSE);
+
+        // 香の向きは区別していない。利きが変わらない駒が混ざっても、引いて足すだけなので問題ない。
+        attack_changed |= (rookAttack(to, occ) & rook_like) | (bishopAttack(to, occ) & bishop_like);
+
+        if (!isDrop(move))
+            attack_changed |= (rookAttack(fromSq(move), occ) & rook_like)
+                            | (bishopAttack(fromSq(move), occ) & bishop_like)
+                            | fromSq(move);
+    }
+    accumulateAttacks<false>(st_, attack_changed);
+#endif
 #ifdef USE_EVAL
     // 評価値の計算をまだ済ませていないフラグをセット。
     st_->sum.setNotEvaluated();
@@ -1140,12 +1254,20 @@ void Board::doMove(const Move move, StateInfo& new_st, bool gives_check)
 #ifdef USE_BITBOARD
     bb_gold_ = bbType(GOLD, PRO_PAWN, PRO_LANCE, PRO_KNIGHT, PRO_SILVER);
     assert(st_->checkers == attackers<true>(self, kingSquare(enemy)));
+#endif
+#ifdef USE_ATTACK_MAP
+    // fromにいた駒はtoに移り、取られた駒は盤上から消えている。
+    if (!isDrop(move))
+        attack_changed ^= fromSq(move);
+
+    accumulateAttacks<true>(st_, attack_changed | to);
 #endif
     st_->board_key = k;
     st_->hand_key = h;
     st_->material = material;
     st_->hand = hand(enemy);
     turn_ = enemy;
+    repetitionFilter(k)++;
 
     // increment ply counters.
     ++st_->plies_from_null;
@@ -1167,6 +1289,7 @@ void Board::undoMove(const Move move)
     const Square to = toSq(move);
 
     turn_ = self;
+    repetitionFilter(st_->board_key)--;
 
     assert(board_[to] == movedPieceTo(move));
 
@@ -1273,11 +1396,17 @@ void Board::doNullMove(StateInfo& new_st)
 {
     assert(!inCheck());
     assert(&new_st != st_);
+#ifdef USE_BITBOARD
+    // check_sqは手番が変わるので計算し直すことになる。コピーしなくてよい。
+    std::memcpy(&new_st, st_, offsetof(struct StateInfo, check_sq));
+#else
     std::memcpy(&new_st, st_, sizeof(StateInfo));
+#endif
     new_st.previous = st_;
     st_ = &new_st;
     st_->board_key ^= Zobrist::turn;
     st_->plies_from_null = 0;
+    repetitionFilter(st_->board_key)++;
     prefetch(GlobalTT.firstEntry(st_->key()));
     turn_ = ~turn_;
     st_->hand = hand(turn());
@@ -1289,6 +1418,7 @@ void Board::doNullMove(StateInfo& new_st)
 void Board::undoNullMove()
 {
     assert(!inCheck());
+    repetitionFilter(st_->board_key)--;
     st_ = st_->previous;
     turn_ = ~turn_;
 }
@@ -1315,6 +1445,10 @@ bool Board::canPieceCapture(const Turn t, const Square sq, const Square king_squ
 // bb_discoveredを遅延評価するバージョン
 bool Board::canPieceCapture1(const Turn t, const Square sq, const Square king_square) const
 {
+#ifdef USE_ATTACK_MAP
+    if (!attackCount(t, sq))
+        return false;
+#endif
     Bitboard bb_from = attackers<true>(t, sq);
 
     if (bb_from)
@@ -1416,6 +1550,16 @@ template <Turn T, Index TK> Move Board::mate1ply(const Square ksq)
     // 自分の駒でピンしている相手の駒
     const Bitboard dc_between_enemy = st_->blockers_for_king[enemy];
 
+    // 駒打ちを調べている間は盤面をいじらないので、差分更新している利きの数がそのまま使える。
+    // (駒移動のほうはxorBBsで動かす駒を消してから調べるので使えない。)
+#ifdef USE_ATTACK_MAP
+    auto selfAttacks = [&](Square to) { return attackCount(self, to) != 0; };
+    auto enemyCanCapture = [&](Square to) { return attackCount(enemy, to) != 0 && canPieceCapture(enemy, to, ksq, dc_between_enemy); };
+#else
+    auto selfAttacks = [&](Square to) { return existAttacker(self, to); };
+    auto enemyCanCapture = [&](Square to) { return canPieceCapture(enemy, to, ksq, dc_between_enemy); };
+#endif
+
     if (h.exists(ROOK))
     {
         // 飛車による近接王手なので、調べる範囲はTKでよい。
@@ -1428,9 +1572,9 @@ template <Turn T, Index TK> Move Board::mate1ply(const Square ksq)
             // 自分の駒の利きがあって
             // 相手玉では取れなくて
             // 他の駒でも取れないなら詰み！
-            if (existAttacker(self, to)
+            if (selfAttacks(to)
                 && !canKingEscape<TK>(ksq, self, to, rookAttackToEdge(to))
-                && !canPieceCapture(enemy, to, ksq, dc_between_enemy))
+                && !enemyCanCapture(to))
                 return makeDrop(self == BLACK ? B_ROOK : W_ROOK, to);
         }
     }
@@ -1440,9 +1584,9 @@ template <Turn T, Index TK> Move Board::mate1ply(const Square ksq)
         const Square to = ksq + tsouth;
 
         if (piece(to) == EMPTY
-            && existAttacker(self, to)
+            && selfAttacks(to)
             && !canKingEscape<TK>(ksq, self, to, lanceAttackToEdge(self, to))
-            && !canPieceCapture(enemy, to, ksq, dc_between_enemy))
+            && !enemyCanCapture(to))
             return makeDrop(self == BLACK ? B_LANCE : W_LANCE, to);
     }
 
@@ -1454,9 +1598,9 @@ template <Turn T, Index TK> Move Board::mate1ply(const Square ksq)
         {
             const Square to = firstOne<TK>(to64);
 
-            if (existAttacker(self, to)
+            if (selfAttacks(to)
                 && !canKingEscape<TK>(ksq, self, to, bishopAttackToEdge(to))
-                && !canPieceCapture(enemy, to, ksq, dc_between_enemy))
+                && !enemyCanCapture(to))
                 return makeDrop(self == BLACK ? B_BISHOP : W_BISHOP, to);
         }
     }
@@ -1475,9 +1619,9 @@ template <Turn T, Index TK> Move Board::mate1ply(const Square ksq)
         {
             const Square to = firstOne<TK>(to64);
 
-            if (existAttacker(self, to)
+            if (selfAttacks(to)
                 && !canKingEscape<TK>(ksq, self, to, goldAttack(self, to))
-                && !canPieceCapture(enemy, to, ksq, dc_between_enemy))
+                && !enemyCanCapture(to))
                 return makeDrop(self == BLACK ? B_GOLD : W_GOLD, to);
         }
     }
@@ -1508,9 +1652,9 @@ template <Turn T, Index TK> Move Board::mate1ply(const Square ksq)
         {
             const Square to = firstOne<TK>(to64);
 
-            if (existAttacker(self, to)
+            if (selfAttacks(to)
                 && !canKingEscape<TK>(ksq, self, to, silverAttack(self, to))
-                && !canPieceCapture(enemy, to, ksq, dc_between_enemy))
+                && !enemyCanCapture(to))
                 return makeDrop(self == BLACK ? B_SILVER : W_SILVER, to);
         }
     }
@@ -1526,7 +1670,7 @@ SilverDropEnd:
             const Square to = firstOne<TK>(to64);
 
             if (!canKingEscape<TK>(ksq, self, to, allZeroMask())
-                && !canPieceCapture(enemy, to, ksq, dc_between_enemy))
+                && !enemyCanCapture(to))
                 return makeDrop(self == BLACK ? B_KNIGHT : W_KNIGHT, to);
         }
     }
@@ -2099,6 +2243,129 @@ Move Board::mate1ply1() const
 
 #endif
 
+MoveStack* generateCheckMoves(const Board& b, MoveStack* mlist)
+{
+    MoveStack* last;
+
+    if (b.inCheck())
+        last = generate<EVASIONS>(mlist, b);
+    else
+    {
+        // 駒を取らない王手(歩の成りを除く) + 駒を取る手と歩の成り。後者は王手になるものだけを残す。
+        last = generate<QUIET_CHECKS>(mlist, b);
+        last = generate<CAPTURE_PLUS_PAWN_PROMOTE>(last, b);
+    }
+
+    return std::remove_if(mlist, last, [&](const MoveStack& m) { return !b.givesCheck(m) || !b.legal(m); });
+}
+
+MoveStack* generateLegalEvasions(const Board& b, MoveStack* mlist)
+{
+    MoveStack* last = generate<EVASIONS>(mlist, b);
+    return std::remove_if(mlist, last, [&](const MoveStack& m) { return !b.legal(m); });
+}
+
+// 1手詰めは、王手がかかっていなければ1手詰めルーチンで調べる。
+// 王手がかかっていれば1手詰めルーチンは使えないので、王手を回避しつつ王手をかける手を順に調べる。
+template <> Move Board::mateNplyOr<1>(int& nodes, int& mate_ply)
+{
+    mate_ply = 1;
+
+    if (!inCheck())
+        return mate1ply();
+
+    MoveStack checks[MAX_MOVES], evasions[MAX_MOVES];
+    MoveStack* last_check = generateCheckMoves(*this, checks);
+    StateInfo st;
+
+    for (MoveStack* check = checks; check != last_check && --nodes >= 0; ++check)
+    {
+        doMove(*check, st, true);
+        const bool mate = generateLegalEvasions(*this, evasions) == evasions;
+        undoMove(*check);
+
+        if (mate)
+            return *check;
+    }
+
+    return MOVE_NONE;
+}
+
+template <int N> Move Board::mateNplyOr(int& nodes, int& mate_ply)
+{
+    static_assert(N % 2 == 1, "");
+
+    // 1手詰めがあればそれを返す。
+    if (!inCheck())
+    {
+        const Move m = mate1ply();
+
+        if (m != MOVE_NONE)
+        {
+            mate_ply = 1;
+            return m;
+        }
+    }
+
+    MoveStack checks[MAX_MOVES], evasions[MAX_MOVES];
+    MoveStack* last_check = generateCheckMoves(*this, checks);
+    StateInfo st, st_evasion;
+
+    for (MoveStack* check = checks; check != last_check; ++check)
+    {
+        doMove(*check, st, true);
+
+        // すべての応手に対してN - 2手以内の詰みがあれば詰み。応手がなければこの王手で詰んでいる。
+        MoveStack* last_evasion = generateLegalEvasions(*this, evasions);
+        bool mate = true;
+        mate_ply = 1;
+
+        for (MoveStack* evasion = evasions; evasion != last_evasion && mate; ++evasion)
+        {
+            int child_ply;
+
+            if (--nodes < 0)
+                mate = false;
+            else
+            {
+                doMove(*evasion, st_evasion);
+                mate = mateNplyOr<N - 2>(nodes, child_ply) != MOVE_NONE;
+                undoMove(*evasion);
+                mate_ply = std::max(mate_ply, child_ply + 2);
+            }
+        }
+
+        undoMove(*check);
+
+        if (mate)
+            return *check;
+
+        if (nodes < 0)
+            break;
+    }
+
+    return MOVE_NONE;
+}
+
+template <int N> Move Board::mateNply(int* mate_ply, int node_limit)
+{
+    // 詰みチェック中のdoMoveは探索ノード数に数えない。(NPSやgo nodesの予算、benchのsignatureが変わらないように)
+    // ノード数に書き込むのはこのスレッドだけなので、元に戻せばよい。
+    const uint64_t searched = this_thread_->nodes.load(std::memory_order_relaxed);
+    int nodes = node_limit, ply = 0;
+    const Move m = mateNplyOr<N>(nodes, ply);
+    this_thread_->nodes.store(searched, std::memory_order_relaxed);
+    assert(verify());
+
+    if (mate_ply)
+        *mate_ply = ply;
+
+    return m;
+}
+
+template Move Board::mateNply<3>(int* mate_ply, int node_limit);
+template Move Board::mateNply<5>(int* mate_ply, int node_limit);
+
 // @see https://stackoverflow.com/questions/14274225/statement-goto-can-not-cross-pointer-definition
 #define GOTO_FAILED {std::cout << "error!" << " failed step is " << failed_step << *this << std::endl; return false;}
 
@@ -2309,6 +2576,14 @@ bool Board::verify() const
         GOTO_FAILED;
     }
 
+#ifdef USE_ATTACK_MAP
+    failed_step++;
+
+    // 差分更新した利きの数のチェック
+    if (std::memcmp(st.attack_count, st_->attack_count, sizeof(st.attack_count)))
+        GOTO_FAILED;
+#endif
+
 #ifdef USE_EVAL
     failed_step++;
 
@@ -47,6 +47,9 @@ enum RepetitionType
     NO_REPETITION, REPETITION_DRAW, REPETITION_WIN, REPETITION_LOSE, REPETITION_SUPERIOR, REPETITION_INFERIOR
 };
 
+// N手詰めルーチンで調べる局面数の上限のデフォルト値
+const int MATE_NPLY_NODES = 1000;
+
 #ifdef USE_EVAL
 // 評価値の差分計算の管理用
 // 前の局面から移動した駒番号を管理するための構造体
@@ -79,9 +82,25 @@ struct StateInfo
     uint16_t nifu_flags[TURN_MAX];
 
     // ******ここから下はdoMove時にコピーしない******
+    // doMoveのたびに書き込むものはなるべく前に詰めて、触るキャッシュラインを減らす。
+
     // この局面での評価関数の駒割
     Score material;
 
+#ifdef USE_BITBOARD
+    // check_sqを計算済みならtrue。
+    bool check_sq_ready;
+#endif
+    // この局面における手番側の持ち駒。優等局面の判定のために必要
+    Hand hand;
+
+    Key board_key;
+    Key hand_key;
+
+    // 一つ前の局面に遡るためのポインタ
+    // NULL MOVEなどでそこより遡って欲しくないときはnullptrを設定しておく
+    StateInfo* previous;
+
 #ifdef USE_BITBOARD
     // 現局面で手番側に対して王手をしている駒のbitboard。doMove()で更新される
     Bitboard checkers;
@@ -91,16 +110,6 @@ struct StateInfo
 
     // Turn玉をピンしている、Turn側ではない駒
     Bitboard pinners_for_king[TURN_MAX];
-
-    // 自駒の駒種Xによって敵玉が王手となる升のbitboard
-    Bitboard check_sq[PIECETYPE_MAX];
-#endif
-
-#ifdef USE_BYTEBOARD
-    __m256i king_neighbor[TURN_MAX], king_ray[TURN_MAX];
-    __m256i checker_knights, checker_no_knights;
-    uint32_t slider_blockers[TURN_MAX];
-    __m256i reach_sliders;
 #endif
 #ifdef USE_EVAL
     // 評価値。(次の局面で評価値を差分計算するときに用いる)
@@ -113,15 +122,25 @@ struct StateInfo
     Progress::ProgressSum progress;
 #endif
 #endif
-    // この局面における手番側の持ち駒。優等局面の判定のために必要
-    Hand hand;
-
-    Key board_key;
-    Key hand_key;
+#ifdef USE_BYTEBOARD
+    __m256i king_neighbor[TURN_MAX], king_ray[TURN_MAX];
+    __m256i checker_knights, checker_no_knights;
+    uint32_t slider_blockers[TURN_MAX];
+    __m256i reach_sliders;
+#endif
+#ifdef USE_ATTACK_MAP
+    // attack_count[t][sq] : sqに利いているt側の駒の数(玉の利きも含む)。doMoveで差分更新される。
+    // 直接触らずにBoard::attackCount()を使うこと。AVX2で32升ずつ足せるように96升分確保している。
+    uint8_t attack_count[TURN_MAX][96];
+#endif
 
-    // 一つ前の局面に遡るためのポインタ
-    // NULL MOVEなどでそこより遡って欲しくないときはnullptrを設定しておく
-    StateInfo* previous;
+    // ******ここから下は必要になるまで計算しない******
+#ifdef USE_BITBOARD
+    // 自駒の駒種Xによって敵玉が王手となる升のbitboard。
+    // 王手生成やgivesCheck()で初めて必要になったときにBoard::setCheckSquares()で計算する。
+    // 直接触らずにBoard::checkSquares()を使うこと。
+    Bitboard check_sq[PIECETYPE_MAX];
+#endif
 
     // この局面のハッシュキー。盤面のハッシュキー + 持ち駒のハッシュキー
     Key key() const { return board_key + hand_key; }
@@ -192,6 +211,11 @@ public:
     // 手番tのptの駒をsqに置いたときのbitboardの更新を行う。
     void xorBBs(const PieceType pt, const Square sq, const Turn t);
 
+#ifdef USE_ATTACK_MAP
+    // bbにいる駒の利きを、現在の盤面でsiのattack_countに足す(Add == true)か、引く。
+    template <bool Add> void accumulateAttacks(StateInfo* si, Bitboard bb) const;
+#endif
+
     // 指定したPieceTypeのbitboardを返す
     Bitboard bbType(const PieceType pt) const { assert(pt < PIECETYPE_MAX); return bb_type_[pt];}
     Bitboard bbType(const PieceType pt1, const PieceType pt2) const { return bbType(pt1) | bbType(pt2); }
@@ -230,6 +254,11 @@ public:
     // attackersの戻り値がboolになっているバージョン。ちょっとだけ早い（ことを目指している）
     bool existAttacker(const Turn t, const Square sq, const Bitboard& occ) const;
 
+#ifdef USE_ATTACK_MAP
+    // 現局面でsqに利いているt側の駒の数(玉の利きも含む)。
+    int attackCount(const Turn t, const Square sq) const { return st_->attack_count[t][sq]; }
+#endif
+
     // 敵玉と自分の駒の間にpinされている自分の駒を取得する。
     Bitboard discoveredCheckCandidates() const { return st_->blockers_for_king[~turn()] & bbTurn(turn()); }
 
@@ -237,7 +266,19 @@ public:
     Bitboard pinnedPieces(Turn t) const { return st_->blockers_for_king[t] & bbTurn(t); }
 
     // ptを打つと王手になる場所が1のbitboardを返す。
-    Bitboard checkSquares(const PieceType pt) const { return st_->check_sq[pt]; }
+    Bitboard checkSquares(const PieceType pt) const { return checkSquares()[pt]; }
+
+    // 駒種ごとの王手になる場所のテーブルを返す。まだ計算していなければここで計算する。
+    const Bitboard* checkSquares() const
+    {
+        if (!st_->check_sq_ready)
+            setCheckSquares(st_);
+
+        return st_->check_sq;
+    }
+
+    // stのcheck_sqを計算する。
+    void setCheckSquares(StateInfo* si) const;
 
     // fromにいる駒がpinされていると仮定して、fromからtoに移動したときking_squareにいる玉に王手がかかるかどうか
     // king_squareは自玉、敵玉どちらでもよいので自殺手かどうか調べるときも使える
@@ -286,6 +327,10 @@ public:
     Move mate1ply2() const;
     Move mate1ply() const;
 
+    // N手詰めルーチン(Nは奇数)。王手とその応手をN手まで読み、末端では1手詰めルーチンを呼ぶ。
+    // 詰みがあれば初手を返し、mate_plyに詰みまでの手数を入れる。調べた局面の数がnode_limitを超えたら打ち切る。
+    template <int N> Move mateNply(int* mate_ply = nullptr, int node_limit = MATE_NPLY_NODES);
+
     // 王手されている局面かどうかを返す。
     bool inCheck1() const;
     bool inCheck2() const;
@@ -331,6 +376,9 @@ public:
     bool existAttacker2(const Turn t, const Square sq) const;
     bool existAttacker(const Turn t, const Square sq) const;
 
+    // N手詰めルーチン本体。
+    template <int N> Move mateNplyOr(int& nodes, int& mate_ply);
+
 #ifdef USE_BYTEBOARD
     template <Turn T> Move mate1ply2(const Square ksq) const;
     bool canPieceCapture2(const Turn t, const Square sq, const Square ksq, uint32_t slider_blockers) const;
@@ -365,14 +413,16 @@ public:
     Key key() const { return st_->key(); }
     Key afterKey(const Move m) const;
 
+    // 盤面を左右反転した局面のハッシュキー
+    Key mirrorKey() const;
+
     bool operator == (const Board& b) const;
     Board& operator = (const Board& b);
     std::string sfen() const;
 
-#if defined LEARN
+    // mirrorならば盤面を左右反転した局面をpackする。
     void setFromPackedSfen(uint8_t data[32]);
-    void sfenPack(uint8_t data[32]) const;
-#endif
+    void sfenPack(uint8_t data[32], bool mirror = false) const;
     // 画面出力用
     friend std::ostream& operator << (std::ostream& os, const Board& b);
 
@@ -418,6 +468,13 @@ private:
     // start_state_ はst_が初期状態で指しているStateInfo
     StateInfo start_state_, *st_;
 
+    // StateInfoを遡って辿れる局面のboard_keyを、上位bitで振り分けて数えたもの。
+    // 現局面の分も数えているので、2未満なら同一盤面の局面は存在せず、千日手判定で遡る必要がない。
+    static const int REPETITION_FILTER_BITS = 12;
+    uint8_t repetition_filter_[1 << REPETITION_FILTER_BITS];
+    uint8_t& repetitionFilter(Key board_key) { return repetition_filter_[board_key >> (64 - REPETITION_FILTER_BITS)]; }
+    uint8_t repetitionFilter(Key board_key) const { return repetition_filter_[board_key >> (64 - REPETITION_FILTER_BITS)]; }
+
     Thread* this_thread_;
 
 #ifdef USE_EVAL
@@ -23,10 +23,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 #include "usi.h"
 #include "book.h"
 #include "common.h"
+#include "thread.h"
+#include "search.h"
+#include "tt.h"
 
 // bookはグローバルに用意。
 MemoryBook Book;
@@ -59,10 +65,15 @@ std::string removeSfen(std::string sfen)
 }
 
 // sfen文字列から末尾の手数を取り除く。
+// MemoryBook::write()は手数を書かないので、手数がなければそのまま返す。
 std::string removePly(std::string sfen)
 {
     int i;
-    for (i = sfen.size() - 1; isdigit(sfen[i]); i--);
+    for (i = sfen.size() - 1; i >= 0 && isdigit(sfen[i]); i--);
+
+    if (i == (int)sfen.size() - 1)
+        return sfen;
+
     sfen = sfen.substr(0, i);
     return sfen;
 }
@@ -111,23 +122,146 @@ namespace USI
     }
 }
 
+// 指し手に欠落している情報があるかもしれないので補う
+Move completeMove(const Board& b, Move m)
+{
+    if (!isDrop(m))
+        return makeMove(fromSq(m), toSq(m), b.piece(fromSq(m)), b.piece(toSq(m)), isPromote(m));
+    else
+        return makeDrop(movedPieceType(m) | b.turn(), toSq(m));
+}
+
+uint16_t BookFile::packMove(Move m)
+{
+    if (!isOK(m))
+        return 0;
+
+    if (isDrop(m))
+        return uint16_t(toSq(m) | (movedPieceType(m) << FROM_SHIFT) | DROP_MASK);
+
+    return uint16_t(m & (TO_MASK | FROM_MASK | PROMOTE_MASK));
+}
+
+Move BookFile::unpackMove(uint16_t m)
+{
+    if (m == 0)
+        return MOVE_NONE;
+
+    if (m & DROP_MASK)
+        return makeDrop(Piece((m & FROM_MASK) >> FROM_SHIFT), Square(m & TO_MASK));
+
+    return Move(m);
+}
+
+int BookFile::compile(const std::string& text_file, const std::string& book_file)
+{
+    ifstream ifs(text_file);
+
+    if (!ifs)
+        return 1;
+
+    // 局面の設定にはスレッドが要るので、メインスレッドの盤面を借りる。
+    Board b;
+    vector<Entry> table;
+    Key key = 0;
+    bool has_sfen = false;
+    string line;
+
+    while (getline(ifs, line))
+    {
+        if (line.length() && line.back() == '\r')
+            line.pop_back();
+
+        if (line.empty() || line[0] == '#' || (line.length() >= 2 && line.substr(0, 2) == "//"))
+            continue;
+
+        if (line.length() >= 5 && line.substr(0, 5) == "sfen ")
+        {
+            b.init(removeSfen(line), Threads.main());
+            key = b.key();
+            has_sfen = true;
+            continue;
+        }
+
+        if (!has_sfen)
+            continue;
+
+        BookEntry be;
+        istringstream is(line);
+        string best_move, ponder;
+        is >> best_move >> ponder >> be.score >> be.depth >> be.count;
+
+        auto conv = [](const std::string s) { return (s == "none" || s == "resign") ? MOVE_NONE : USI::toMove(s); };
+        Entry e;
+        e.key = key;
+        e.best = packMove(conv(best_move));
+        e.ponder = packMove(conv(ponder));
+        e.score = (int16_t)std::max(std::min(be.score, (int)INT16_MAX), (int)INT16_MIN);
+        e.depth = (int16_t)std::max(std::min(be.depth, (int)INT16_MAX), (int)INT16_MIN);
+        e.count = be.count;
+
+        if (e.best)
+            table.push_back(e);
+    }
+
+    // 同じ局面の中では元のファイルの順番を保つ。
+    std::stable_sort(table.begin(), table.end(), [](const Entry& a, const Entry& b) { return a.key < b.key; });
+
+    ofstream ofs(book_file, ios::binary);
+    Header h = { MAGIC, VERSION, table.size() };
+
+    if (!ofs.write((const char*)&h, sizeof(h)) || !ofs.write((const char*)table.data(), sizeof(Entry) * table.size()))
+        return 1;
+
+    cout << "compiled " << text_file << " -> " << book_file << " , " << table.size() << " moves" << endl;
+    return 0;
+}
+
+void MemoryBook::clear()
+{
+    book.clear();
+    mapping.unmap();
+    entries = nullptr;
+    entry_count = 0;
+    loaded = false;
+}
+
 // 定跡ファイルの読み込み(book.db)など。MemoryBookに読み出す
 int MemoryBook::read(const std::string filename)
 {
-    static bool allready = false;
-
-    if (allready)
+    if (loaded)
         return 0;
 
+    // コンパイル済みの定跡ファイルなら、マップするだけでよい。
+    if (mapping.map(filename) && mapping.size() >= sizeof(BookFile::Header))
+    {
+        const auto& h = *(const BookFile::Header*)mapping.data();
+
+        if (h.magic == BookFile::MAGIC)
+        {
+            if (h.version != BookFile::VERSION || mapping.size() != sizeof(h) + h.count * sizeof(BookFile::Entry))
+            {
+                mapping.unmap();
+                return 1;
+            }
+
+            entries = (const BookFile::Entry*)(mapping.data() + sizeof(h));
+            entry_count = h.count;
+            loaded = true;
+            return 0;
+        }
+    }
+
+    mapping.unmap();
     vector<string> lines;
 
     if (readAllLines(filename, lines))
         return 1; // 読み込み失敗
 
-    allready = true;
+    loaded = true;
 
-    uint64_t num_sum = 0;
-    string sfen;
+    Board b;
+    bool has_sfen = false;
 
     for (auto line : lines)
     {
@@ -142,11 +276,14 @@ int MemoryBook::read(const std::string filename)
         // "sfen "で始まる行は局面のデータであり、sfen文字列が格納されている。
         if (line.length() >= 5 && line.substr(0, 5) == "sfen ")
         {
-            sfen = removeSfen(line);
-            sfen = removePly(sfen);
+            b.init(removeSfen(line), Threads.main());
+            has_sfen = true;
             continue;
         }
 
+        if (!has_sfen)
+            continue;
+
         BookEntry be;
         istringstream is(line);
         string best_move, ponder;
@@ -155,7 +292,7 @@ int MemoryBook::read(const std::string filename)
         auto conv = [](const std::string s) { return (s == "none" || s == "resign") ? MOVE_NONE : USI::toMove(s); };
         be.best = conv(best_move);
         be.ponder = conv(ponder);
-        insert(sfen, be);
+        insert(b, be);
     }
 
     return 0;
@@ -169,11 +306,17 @@ int MemoryBook::write(const std::string filename)
     // バージョン識別用文字列
     fs << "#YANEURAOU-DB2016 1.00" << endl;
 
+    Board b(Threads.main());
+
     for (auto it = book.begin(); it != book.end(); ++it)
     {
-        fs << "sfen " << it->first << endl;
-        for (auto s : it->second)
-            fs << s.best << " " << s.ponder << " " << s.score << " " << s.depth << " " << s.count << endl;
+        uint8_t data[32];
+        std::memcpy(data, it->second.sfen, sizeof(data));
+        b.setFromPackedSfen(data);
+        fs << "sfen " << removePly(b.sfen()) << endl;
+
+        for (auto s : it->second.moves)
+            fs << s.best << " " << (s.ponder ? toUSI(s.ponder) : "none") << " " << s.score << " " << s.depth << " " << s.count << endl;
     }
 
     fs.close();
@@ -182,36 +325,538 @@ int MemoryBook::write(const std::string filename)
 }
 
 // bookに指し手を加える。
-void MemoryBook::insert(const std::string sfen, const BookEntry m)
+void MemoryBook::insert(const Board& b, BookEntry m)
 {
-    auto it = book.find(sfen);
+    // テキストの定跡から読んだ指し手には駒の情報がないので、ここで補っておく。
+    m.best = completeMove(b, m.best);
+
+    bool mirrored;
+    BookPosition* p = find(b, mirrored);
 
-    if (it == book.end()) // 存在しないので追加。
-        book[sfen] = std::vector<BookEntry>({ m });
+    if (p == nullptr) // 存在しないので追加。
+    {
+        BookPosition bp;
+        b.sfenPack(bp.sfen);
+        bp.moves.push_back(m);
+        book.emplace(b.key(), std::move(bp));
+    }
     else
-        it->second.push_back(m);
+    {
+        if (mirrored)
+            m.best = mirror(m.best), m.ponder = mirror(m.ponder);
+
+        p->moves.push_back(m);
+    }
+}
+
+const BookPosition* MemoryBook::find(const Board& b, bool& mirrored) const
+{
+    uint8_t sfen[32];
+    const Key key = b.key();
+
+    for (int i = 0; i < 2; i++)
+    {
+        mirrored = i == 1;
+        const Key k = mirrored ? b.mirrorKey() : key;
+
+        // 左右対称な局面は反転しても同じ。
+        if (mirrored && k == key)
+            break;
+
+        auto range = book.equal_range(k);
+
+        if (range.first == range.second)
+            continue;
+
+        b.sfenPack(sfen, mirrored);
+
+        for (auto it = range.first; it != range.second; ++it)
+            if (!std::memcmp(it->second.sfen, sfen, sizeof(sfen)))
+                return &it->second;
+    }
+
+    mirrored = false;
+    return nullptr;
 }
 
-Move MemoryBook::probe(const Board& b) const
+BookPosition* MemoryBook::find(const Board& b, bool& mirrored)
 {
-    auto it = book.find(removePly(b.sfen()));
+    return const_cast<BookPosition*>(static_cast<const MemoryBook*>(this)->find(b, mirrored));
+}
+
+void MemoryBook::setPolicy(const std::string& p, int t, int w)
+{
+    policy = p == "score" ? BOOK_SCORE : p == "random" ? BOOK_RANDOM : BOOK_COUNT;
+    temperature = t;
+    score_window = w;
+}
+
+// [first, last)の定跡手から、設定された選び方で一つ選ぶ。テキストの定跡とコンパイル済みの定跡で共通。
+template <typename T>
+const T* MemoryBook::select(const T* first, const T* last) const
+{
+    if (first == last)
+        return nullptr;
+
+    int best_score = first->score;
+
+    for (auto e = first; e != last; ++e)
+        best_score = std::max(best_score, (int)e->score);
+
+    auto in_window = [&](const T* e) { return (int)e->score >= best_score - score_window; };
+    const T* best = nullptr;
+
+    if (policy == BOOK_RANDOM && temperature > 0)
+    {
+        const double exponent = 100.0 / temperature;
+        double sum = 0;
+
+        for (auto e = first; e != last; ++e)
+            if (in_window(e))
+                sum += std::pow((double)e->count, exponent);
+
+        // 採択回数がすべて0なら、候補から一様に選ぶ。
+        const bool uniform = sum <= 0;
+
+        if (uniform)
+            for (auto e = first; e != last; ++e)
+                sum += in_window(e);
+
+        double r = (prng.rand<uint64_t>() >> 11) * (1.0 / (1ULL << 53)) * sum;
+
+        for (auto e = first; e != last; ++e)
+        {
+            if (!in_window(e))
+                continue;
+
+            best = e;
+            r -= uniform ? 1.0 : std::pow((double)e->count, exponent);
+
+            if (r < 0)
+                break;
+        }
+
+        return best;
+    }
 
-    if (it != book.end() && it->second.size())
+    for (auto e = first; e != last; ++e)
     {
-        // 採択回数が一番多いエントリーを選ぶ。
-        auto entry = it->second;
-        auto be = std::max_element(entry.begin(), entry.end());
+        if (!in_window(e))
+            continue;
+
+        if (best == nullptr
+            || (policy == BOOK_SCORE ? e->score > best->score || (e->score == best->score && e->count > best->count)
+                                     : e->count > best->count))
+            best = e;
+    }
+
+    return best;
+}
+
+Move MemoryBook::probe(const Board& b, Move* ponder) const
+{
+    if (ponder)
+        *ponder = MOVE_NONE;
+
+    if (entries)
+    {
+        // 見つからなければ、左右反転した局面でも引いてみる。
+        for (int i = 0; i < 2; i++)
+        {
+            const bool mirrored = i == 1;
+            const Key key = mirrored ? b.mirrorKey() : b.key();
+
+            if (mirrored && key == b.key())
+                break;
+
+            auto first = std::lower_bound(entries, entries + entry_count, key,
+                                          [](const BookFile::Entry& e, Key k) { return e.key < k; });
+            auto last = first;
+
+            while (last != entries + entry_count && last->key == key)
+                ++last;
+
+            const BookFile::Entry* be = select(first, last);
+
+            if (be == nullptr)
+                continue;
+
+            Move m = BookFile::unpackMove(be->best);
+
+            if (ponder)
+                *ponder = mirrored ? mirror(BookFile::unpackMove(be->ponder)) : BookFile::unpackMove(be->ponder);
+
+            return completeMove(b, mirrored ? mirror(m) : m);
+        }
+
+        return MOVE_NONE;
+    }
+
+    bool mirrored;
+    const BookPosition* p = find(b, mirrored);
+
+    if (p && p->moves.size())
+    {
+        const BookEntry* be = select(p->moves.data(), p->moves.data() + p->moves.size());
         Move m = be->best;
         assert(m);
 
-        // 指し手に欠落している情報があるかもしれないので補う
-        if (!isDrop(m))
-            m = makeMove(fromSq(m), toSq(m), b.piece(fromSq(m)), b.piece(toSq(m)), isPromote(m));
-        else
-            m = makeDrop(movedPieceType(m) | b.turn(), toSq(m));
+        if (ponder)
+            *ponder = mirrored ? mirror(be->ponder) : be->ponder;
 
-        return m;
+        return completeMove(b, mirrored ? mirror(m) : m);
     }
 
     return MOVE_NONE;
 }
+
+namespace
+{
+    // 棋譜ファイルの各行("startpos moves ..."や"sfen ... moves ...")を読み、手数がmax_ply以下の局面で
+    // f(局面, 指された手, 次に指された手)を呼び出す。手数はsfenに書かれている手数から数える。読んだ棋譜の数を返す。ファイルが開けなければ-1。
+    // USIの盤面を書き換えないように、局面は自前の盤面で進める。
+    template <typename F>
+    int64_t readKifu(const string& file, int max_ply, F f)
+    {
+        const int MAX_PLY = 256;
+        StateInfo state[MAX_PLY];
+        Board b(Threads.main());
+        ifstream ifs(file);
+        string line, token;
+        int64_t games = 0;
+
+        if (!ifs)
+            return -1;
+
+        while (getline(ifs, line))
+        {
+            istringstream ss(line);
+            string sfen;
+            ss >> token;
+
+            if (token == "position")
+                ss >> token;
+
+            if (token == "startpos")
+            {
+                sfen = USI::START_POS;
+                ss >> token;
+            }
+            else if (token == "sfen")
+                while (ss >> token && token != "moves")
+                    sfen += token + " ";
+            else
+                continue;
+
+            b.init(sfen, Threads.main());
+            vector<string> moves;
+
+            while (ss >> token)
+                moves.push_back(token);
+
+            for (int ply = 0; ply < MAX_PLY && ply < (int)moves.size() && b.ply() <= max_ply; ply++)
+            {
+                Move m = USI::toMove(b, moves[ply]);
+
+                if (m == MOVE_NONE)
+                    break;
+
+                Move next = MOVE_NONE;
+
+                if (ply + 1 < (int)moves.size())
+                {
+                    b.doMove(m, state[ply]);
+                    next = USI::toMove(b, moves[ply + 1]);
+                    b.undoMove(m);
+                }
+
+                f(b, m, next);
+                b.doMove(m, state[ply]);
+            }
+
+            games++;
+        }
+
+        return games;
+    }
+
+    // 定跡ファイルを書き出す。途中で止まっても前回の内容が壊れないように、一時ファイルに書いてから置き換える。
+    void saveBook(MemoryBook& book, const string& file)
+    {
+        book.write(file + ".tmp");
+        std::remove(file.c_str());
+        std::rename((file + ".tmp").c_str(), file.c_str());
+    }
+}
+
+#ifdef LEARN
+namespace MakeBookSpace
+{
+    // 解析する局面のsfenと、棋譜に出てきた回数
+    std::vector<std::pair<std::string, uint64_t>> positions;
+    std::atomic<uint64_t> next_index, done;
+    MemoryBook book;
+    std::string book_file;
+    int search_depth;
+    int save_interval;
+    TimePoint start_time;
+    Mutex mutex;
+
+    void save()
+    {
+        {
+            std::unique_lock<Mutex> lk(mutex);
+            saveBook(book, book_file);
+        }
+
+        const double elapsed = (now() - start_time + 1) / 1000.0;
+        SYNC_COUT << "makebook : " << done << " / " << positions.size() << " positions , "
+                  << done / elapsed << " positions/s , " << (int)elapsed << "s , saved " << book_file << SYNC_ENDL;
+    }
+
+    // 1スレッドでの探索を局面ごとに並列に行い、結果を定跡に加えていく。
+    struct MakeBookThread : public WorkerThread
+    {
+        virtual void search()
+        {
+            Board& b = root_board;
+            tt = new TranspositionTable;
+            tt->resize(USI::Options["Hash"]);
+            tt->clear();
+            TimePoint last_save = now();
+
+            while (!Threads.stop)
+            {
+                const uint64_t i = next_index++;
+
+                if (i >= positions.size())
+                    break;
+
+                b.init(positions[i].first, this);
+                auto pv = Learn::search(b, search_depth * ONE_PLY);
+
+                // 中断されたときの探索結果は深さが足りないので登録しない。登録すると再開時に解析済みとして飛ばされてしまう。
+                if (Threads.stop)
+                    break;
+
+                if (pv.second.size())
+                {
+                    BookEntry be;
+                    be.best = pv.second[0];
+                    be.ponder = pv.second.size() > 1 ? pv.second[1] : MOVE_NONE;
+                    be.score = pv.first;
+                    be.depth = search_depth;
+                    be.count = 1;
+
+                    std::unique_lock<Mutex> lk(mutex);
+                    bool mirrored;
+                    auto p = book.find(b, mirrored);
+                    const Move best = mirrored ? mirror(be.best) : be.best;
+                    auto it = p ? std::find_if(p->moves.begin(), p->moves.end(), [&](const BookEntry& e) { return e.best == best; })
+                                : std::vector<BookEntry>::iterator();
+
+                    // 棋譜から作った指し手がすでにあれば、採択回数はそのままで評価値だけ書き換える。
+                    if (p && it != p->moves.end())
+                    {
+                        it->ponder = mirrored ? mirror(be.ponder) : be.ponder;
+                        it->score = be.score;
+                        it->depth = be.depth;
+                    }
+                    else
+                        book.insert(b, be);
+                }
+
+                done++;
+
+                if (isMain() && save_interval > 0 && now() - last_save >= save_interval * 1000)
+                {
+                    save();
+                    last_save = now();
+                }
+            }
+
+            if (isMain())
+            {
+                for (auto th : Threads.slaves)
+                    th->join();
+
+                save();
+                SYNC_COUT << "makebook think end." << SYNC_ENDL;
+            }
+
+            delete tt;
+            tt = &GlobalTT;
+        }
+    };
+} // namespace MakeBookSpace
+#endif
+
+void makeBook(Board& b, std::istringstream& is)
+{
+    string cmd;
+    is >> cmd;
+
+    if (cmd == "compile")
+    {
+        string text_file, book_file;
+        is >> text_file >> book_file;
+        USI::isready();
+
+        if (BookFile::compile(text_file, book_file))
+            cout << "Error! can't compile " << text_file << " to " << book_file << endl;
+    }
+    else if (cmd == "kifu" || cmd == "think")
+    {
+        string kifu_file, book_file, token;
+        int max_ply = 32, depth = 8, save_interval = 600;
+        uint64_t min_count = 1;
+        int thread_num = USI::Options["Threads"];
+        is >> kifu_file >> book_file;
+
+        while (is >> token)
+        {
+            if (token == "moves")
+                is >> max_ply;
+            else if (token == "depth")
+                is >> depth;
+            else if (token == "thread")
+                is >> thread_num;
+            else if (token == "save")
+                is >> save_interval;
+            else if (token == "min_count")
+                is >> min_count;
+        }
+
+        USI::isready();
+
+        // 既存の定跡ファイルがあれば、それに追加していく。thinkなら解析済みの局面から再開できる。
+        MemoryBook local;
+#ifdef LEARN
+        MemoryBook& book = cmd == "think" ? MakeBookSpace::book : local;
+
+        // 前回のmakebook thinkがまだ動いていれば、終わるのを待ってから定跡を入れ替える。
+        if (cmd == "think")
+            Threads.front()->join();
+#else
+        MemoryBook& book = local;
+#endif
+        // 前回のmakebook thinkの定跡が残っていると、それを今回の定跡ファイルに書き込んでしまう。
+        book.clear();
+        book.read(book_file);
+        const size_t book_size = book.size();
+        const TimePoint start = now();
+
+        if (cmd == "kifu")
+        {
+            // 棋譜に出てきた手を、採択回数を数えながら登録する。
+            auto games = readKifu(kifu_file, max_ply, [&](const Board& pos, Move m, Move next)
+            {
+                bool mirrored;
+                auto p = book.find(pos, mirrored);
+
+                if (p)
+                    for (auto& e : p->moves)
+                        if (e.best == (mirrored ? mirror(m) : m))
+                        {
+                            e.count++;
+
+                            if (!e.ponder)
+                                e.ponder = mirrored ? mirror(next) : next;
+
+                            return;
+                        }
+
+                BookEntry be;
+                be.best = m;
+                be.ponder = next;
+                be.count = 1;
+                book.insert(pos, be);
+            });
+
+            if (games < 0)
+            {
+                cout << "Error! can't open " << kifu_file << endl;
+                return;
+            }
+
+            saveBook(book, book_file);
+            cout << "makebook kifu : " << games << " games , " << book.size() - book_size << " new positions , "
+                 << book.size() << " positions in " << book_file << " (" << now() - start << "ms)" << endl;
+        }
+#ifdef LEARN
+        else
+        {
+            using namespace MakeBookSpace;
+
+            // 局面ごとに棋譜に出てきた回数を数え、解析済みでない局面だけを残す。
+            // 左右反転した局面は同じ局面として数える。ここでは数えるだけなので、キーの衝突は気にしない。
+            const size_t ANALYZED = SIZE_MAX;
+            std::unordered_map<Key, size_t> index;
+            positions.clear();
+
+            auto analyzed = [&](const Board& pos)
+            {
+                bool mirrored;
+                auto p = book.find(pos, mirrored);
+
+                if (p)
+                    for (auto& e : p->moves)
+                        if (e.depth >= depth)
+                            return true;
+
+                return false;
+            };
+
+            auto games = readKifu(kifu_file, max_ply, [&](const Board& pos, Move m, Move next)
+            {
+                const Key key = std::min(pos.key(), pos.mirrorKey());
+                auto it = index.find(key);
+
+                if (it == index.end())
+                {
+                    index[key] = analyzed(pos) ? ANALYZED : positions.size();
+
+                    if (index[key] != ANALYZED)
+                        positions.push_back({ pos.sfen(), 1 });
+                }
+                else if (it->second != ANALYZED)
+                    positions[it->second].second++;
+            });
+
+            if (games < 0)
+            {
+                cout << "Error! can't open " << kifu_file << endl;
+                return;
+            }
+
+            positions.erase(std::remove_if(positions.begin(), positions.end(),
+                                           [&](const std::pair<string, uint64_t>& p) { return p.second < min_count; }), positions.end());
+
+            // よく出てくる局面から解析しておけば、途中で止めてもその時点の定跡が役に立つ。
+            std::stable_sort(positions.begin(), positions.end(),
+                             [](const std::pair<string, uint64_t>& a, const std::pair<string, uint64_t>& b) { return a.second > b.second; });
+
+            cout << "\nkifu            : " << kifu_file << " (" << games << " games)"
+                 << "\nbook            : " << book_file << " (" << book_size << " positions)"
+                 << "\nmoves           : " << max_ply
+                 << "\nmin count       : " << min_count
+                 << "\ndepth           : " << depth
+                 << "\nthread          : " << thread_num
+                 << "\nsave interval   : " << save_interval << "s"
+                 << "\npositions       : " << positions.size() << endl;
+
+            MakeBookSpace::book_file = book_file;
+            search_depth = depth;
+            MakeBookSpace::save_interval = save_interval;
+            next_index = 0;
+            done = 0;
+            start_time = now();
+            Threads.startWorkers<MakeBookThread>(thread_num);
+        }
+#endif
+    }
+    else
+        cout << "usage : makebook compile <text book> <compiled book>" << endl
+             << "        makebook kifu <kifu file> <book> [moves N]" << endl
+             << "        makebook think <kifu file> <book> [moves N] [depth D] [thread N] [save seconds] [min_count N]" << endl;
+}
@@ -23,10 +23,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #pragma once
 
+#include <sstream>
 #include <unordered_map>
 
 #include "move.h"
 #include "board.h"
+#include "common.h"
 
 struct BookEntry {
     Move best, ponder;
@@ -35,26 +37,107 @@ struct BookEntry {
     BookEntry() : score(0), depth(0), count(0) {};
 };
 
+// 定跡に登録されている局面。ハッシュキーの衝突を検出するために、sfenPack()した局面も持っておく。
+struct BookPosition
+{
+    uint8_t sfen[32];
+    std::vector<BookEntry> moves;
+};
+
 // insertionSort() や std::sort() で必要
 inline bool operator < (const BookEntry& f, const BookEntry& s) { return f.count < s.count; }
 inline bool operator > (const BookEntry& f, const BookEntry& s) { return f.count > s.count; }
 
+// コンパイル済みの定跡ファイルの形式。Headerの後に、局面のハッシュキーの昇順にEntryが並ぶ。
+// 同じ局面の指し手はkeyが同じで連続しているので、メモリマップしたまま二分探索で引ける。
+namespace BookFile
+{
+    const uint32_t MAGIC = 0x314b4259; // "YBK1"
+    const uint32_t VERSION = 1;
+
+    struct Header { uint32_t magic, version; uint64_t count; };
+
+    // 指し手は移動先、移動元(駒打ちなら打つ駒の種類)、成りと駒打ちのフラグを16bitに詰める。
+    struct Entry
+    {
+        Key key;
+        uint16_t best, ponder;
+        int16_t score, depth;
+        uint64_t count;
+    };
+
+    uint16_t packMove(Move m);
+    Move unpackMove(uint16_t m);
+
+    // YANEURAOU-DB2016形式のテキストの定跡ファイルをコンパイルする。
+    int compile(const std::string& text_file, const std::string& book_file);
+}
+
+// 定跡手の選び方
+enum BookPolicy
+{
+    BOOK_COUNT,  // 採択回数が一番多い手
+    BOOK_SCORE,  // 評価値が一番高い手
+    BOOK_RANDOM, // 採択回数に応じた確率でランダムに選ぶ
+};
+
 // 定跡処理関係
 struct MemoryBook
 {
     // 定跡ファイルの読み込み、書き込み
+    // コンパイル済みの定跡ファイルならメモリマップして、そのまま引く。
     int read(const std::string filename);
     int write(const std::string filename);
 
-    // bookに指し手を加える。
-    void insert(const std::string sfen, const BookEntry m);
+    // 読み込んだ定跡を捨てて、別の定跡ファイルを読み込めるようにする。
+    void clear();
+
+    // bookに指し手を加える。左右反転した局面が登録されていれば、そちらに反転した指し手を加える。
+    void insert(const Board& b, BookEntry m);
 
-    // 局面のsfenをkeyとして定跡登録されていればmoveを返す。
+    // 局面bを引く。登録されていなければnullptr。
+    // 左右反転した局面として登録されていればmirroredがtrueになり、指し手はmirror()して使う必要がある。
+    BookPosition* find(const Board& b, bool& mirrored);
+    const BookPosition* find(const Board& b, bool& mirrored) const;
+    size_t size() const { return book.size(); }
+
+    // 局面のハッシュキーをkeyとして定跡登録されていればmoveを返す。左右反転した局面も引く。
     // 登録されていなければMOVE_NONEを返す。
-    Move probe(const Board& b) const;
+    // ponderを渡すと、選んだ手に対して定跡に書かれている予想手を返す。
+    // これは相手の局面での指し手なので、駒の情報はcompleteMove()で補う必要がある。
+    Move probe(const Board& b, Move* ponder = nullptr) const;
+
+    // 定跡手の選び方を設定する。
+    // temperatureは百分率で、BOOK_RANDOMのときに採択回数をtemperature / 100乗根して重みにする。
+    // 大きくするほど採択回数の少ない手も選ばれやすくなり、0なら採択回数が一番多い手を選ぶ。
+    // 評価値が一番高い手よりscore_windowより悪い手は、どの選び方でも候補から外す。
+    void setPolicy(const std::string& policy, int temperature, int score_window);
 
 private:
-    std::unordered_map<std::string, std::vector<BookEntry>> book;
+    template <typename T> const T* select(const T* first, const T* last) const;
+
+    // 局面のハッシュキーから引く。衝突しても別の局面として持てるようにmultimapにしておく。
+    std::unordered_multimap<Key, BookPosition> book;
+    bool loaded = false;
+
+    BookPolicy policy = BOOK_COUNT;
+    int temperature = 100;
+    int score_window = 32000;
+    mutable PRNG prng;
+
+    // コンパイル済みの定跡ファイルを読み込んだときのマップ
+    FileMapping mapping;
+    const BookFile::Entry* entries = nullptr;
+    uint64_t entry_count = 0;
 };
 
 extern MemoryBook Book;
+
+// 定跡の指し手に欠落している駒の情報を、局面から補う。
+Move completeMove(const Board& b, Move m);
+
+// 定跡の作成、変換
+// makebook compile テキストの定跡ファイル コンパイル済みの定跡ファイル
+// makebook kifu 棋譜ファイル 定跡ファイル [moves 手数]
+// makebook think 棋譜ファイル 定跡ファイル [moves 手数] [depth 深さ] [thread スレッド数] [save 秒] [min_count 回数]
+void makeBook(Board& b, std::istringstream& is);
@@ -3616,6 +3616,19 @@ tm.outResult(_count);
     //    }
     //});
 
+#ifdef USE_ATTACK_MAP
+    // 差分更新している利きの数を引くだけなら、どれくらい速いか。
+    BENCH(num1, "existAttacker vs attackCount",
+    {
+        for (auto sq : Squares)
+            dammy += b.existAttacker1(BLACK, sq);
+    },
+    {
+        for (auto sq : Squares)
+            dammy += b.attackCount(BLACK, sq) != 0;
+    });
+#endif
+
     BENCH(num, "mate1ply",
     {
         dammy += (uint64_t)b.mate1ply1();
@@ -3815,6 +3828,15 @@ void Board::setCheckInfo(StateInfo* si) const
     si->reach_sliders = strikeMask<RAY>(si->king_ray[~turn()], kingSquare(~turn()));
 #endif
 #ifdef USE_BITBOARD
+    // 王手になる升は必要になったときに計算する。
+    si->check_sq_ready = false;
+#endif
+}
+
+#ifdef USE_BITBOARD
+// 自駒の駒種ごとに、敵玉が王手となる升のbitboardを計算する。
+void Board::setCheckSquares(StateInfo* si) const
+{
     const Turn enemy = ~turn();
     Square ksq = kingSquare(enemy);
     Bitboard occ = bbOccupied();
@@ -3834,8 +3856,9 @@ void Board::setCheckInfo(StateInfo* si) const
     si->check_sq[HORSE] = si->check_sq[BISHOP] | kingAttack(ksq);
     si->check_sq[DRAGON] = si->check_sq[ROOK] | kingAttack(ksq);
     si->check_sq[PRO_PAWN] = si->check_sq[PRO_LANCE] = si->check_sq[PRO_KNIGHT] = si->check_sq[PRO_SILVER] = si->check_sq[GOLD];
-#endif
+    si->check_sq_ready = true;
 }
+#endif
 
 // CheckInfoのセットと、敵味方に関係なくpinされている駒のbitboardをセットする。
 template void Board::setCheckInfo<true >(StateInfo* si) const;
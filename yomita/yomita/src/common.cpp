@@ -51,6 +51,16 @@ extern "C"
 #include <sys/stat.h>
 #include <sys/types.h>
 #endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #include "common.h"
 #include "thread.h"
@@ -263,3 +273,75 @@ void _mkdir(std::string dir)
             std::cout << "パスが見つかりませんでした。" << std::endl;
     }
 }
+
+bool FileMapping::map(const std::string& file)
+{
+    unmap();
+#ifdef _WIN32
+    HANDLE h = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+
+    if (h == INVALID_HANDLE_VALUE || !GetFileSizeEx(h, &size) || size.QuadPart == 0)
+    {
+        if (h != INVALID_HANDLE_VALUE)
+            CloseHandle(h);
+
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMapping(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+    if (data == nullptr)
+    {
+        if (mapping)
+            CloseHandle(mapping);
+
+        CloseHandle(h);
+        return false;
+    }
+
+    file_ = h;
+    mapping_ = mapping;
+    size_ = (size_t)size.QuadPart;
+#else
+    int fd = ::open(file.c_str(), O_RDONLY);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        if (fd != -1)
+            ::close(fd);
+
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // マップしてしまえばファイルは閉じてよい。
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    size_ = (size_t)st.st_size;
+#endif
+    data_ = (const uint8_t*)data;
+    return true;
+}
+
+void FileMapping::unmap()
+{
+    if (data_ == nullptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+    file_ = mapping_ = nullptr;
+#else
+    munmap((void*)data_, size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
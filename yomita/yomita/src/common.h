@@ -26,6 +26,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 汎用的に使いそうな関数を定義する。
 
 #include <chrono>
+#include <string>
 #include <vector>
 #include <thread>
 
@@ -130,6 +131,30 @@ private:
 
 void _mkdir(std::string dir);
 
+// ファイルを読み出し専用でメモリにマップする。
+struct FileMapping
+{
+    FileMapping() {}
+    FileMapping(const FileMapping&) = delete;
+    FileMapping& operator = (const FileMapping&) = delete;
+    ~FileMapping() { unmap(); }
+
+    // 開けなかったときや空のファイルのときはfalseを返す。
+    bool map(const std::string& file);
+    void unmap();
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
+
 namespace WinProcGroup
 {
     void bindThisThread(size_t idx);
@@ -55,6 +55,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // bitboardを使用するときに定義
 #define USE_BITBOARD
 
+// 各升に何枚の駒が利いているかをdoMoveで差分更新して持っておくときに定義する。(bitboardが必要)
+// seeGeや1手詰め判定での利きの有無の問い合わせが表引きで済む代わりに、doMoveが重くなる。
+//#define USE_ATTACK_MAP
+
 // 縦型Squareで作られたハフマン化sfenを読み込みたいときに定義する。
 // 読み込み方が対応するだけで、生成には対応しない。
 //#define GENERATED_SFEN_BY_FILESQ
@@ -64,6 +68,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define USE_EVAL
 #endif
 
+#if defined USE_ATTACK_MAP && !defined USE_BITBOARD
+#undef USE_ATTACK_MAP
+#endif
+
+// df-pnによる詰み探索を使うときに定義する。(bitboardが必要)
+// 定義すると、go中に詰み探索用のスレッドを動かし、"go mate"にも応答する。
+#define USE_DFPN
+
+#if defined USE_DFPN && !defined USE_BITBOARD
+#undef USE_DFPN
+#endif
+
+// 探索の統計(置換表のヒット率、枝刈りの回数など)をスレッドごとに数えるときに定義する。
+// bestmoveを返す前に"info string stats"として出力し、benchのJSONにも含める。定義しなければカウンタ自体がなくなる。
+//#define USE_SEARCH_STATS
+
+// go, 反復深化の各反復、探索の停止、スレッドの終了待ち、bestmoveの出力などを時刻つきで記録するときに定義する。
+// "trace <file>"か、TraceFileを指定しておけばgameoverのときに、Chromeのtrace event形式で書き出す。
+#define USE_TRACE
+
 // 進行度を使うときに定義する。
 #if defined USE_EVAL
 #define USE_PROGRESS
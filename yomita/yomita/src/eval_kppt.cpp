@@ -26,6 +26,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifdef EVAL_KPPT
 
 #include <fstream>
+#include <functional>
+#include <mutex>
 
 #include "usi.h"
 #include "board.h"
@@ -616,9 +618,16 @@ namespace Eval
         KKP[k1][k2][p1] = value;
     }
 
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+    std::atomic_int Weight::grad_side;
+#endif
+
     // 勾配をdelta分増やす。
     void Weight::addGrad(WeightValue &delta)
     {
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+        auto& g = grad_side.load(std::memory_order_relaxed) ? g_back : this->g;
+#endif
         g[0] += delta[0];
         g[1] += delta[1];
     }
@@ -626,6 +635,10 @@ namespace Eval
     // 勾配を重みに反映させる。
     bool Weight::update(bool skip_update)
     { 
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+        // 加算先ではない側の勾配配列を反映させる。
+        auto& g = grad_side.load(std::memory_order_relaxed) ? this->g : g_back;
+#endif
         if (g[0] == 0 && g[1] == 0)
             return false;
 
@@ -653,148 +666,614 @@ namespace Eval
 #define KPPW (*kpp_w_)
 #define KKPW (*kkp_w_)
 
+    // KK, KKP, KPPの勾配配列を区別するための番号と、それぞれの要素数
+    enum GradTable { GRAD_KK, GRAD_KKP, GRAD_KPP, GRAD_TABLE_MAX };
+
+    const uint64_t GRAD_TABLE_SIZE[GRAD_TABLE_MAX] =
+    {
+        uint64_t(SQ_MAX) * uint64_t(SQ_MAX),
+        uint64_t(SQ_MAX) * uint64_t(SQ_MAX) * uint64_t(fe_end),
+        uint64_t(SQ_MAX) * uint64_t(fe_end) * uint64_t(fe_end),
+    };
+
+    // 3つのテーブルを通した番号にしたときの、各テーブルの先頭の番号。全部でも32bitに収まる。
+    const uint64_t GRAD_TABLE_OFFSET[GRAD_TABLE_MAX + 1] =
+    {
+        0,
+        GRAD_TABLE_SIZE[GRAD_KK],
+        GRAD_TABLE_SIZE[GRAD_KK] + GRAD_TABLE_SIZE[GRAD_KKP],
+        GRAD_TABLE_SIZE[GRAD_KK] + GRAD_TABLE_SIZE[GRAD_KKP] + GRAD_TABLE_SIZE[GRAD_KPP],
+    };
+
+    Weight* weightTable(int t)
+    {
+        return t == GRAD_KK ? (Weight*)kk_w_ : t == GRAD_KKP ? (Weight*)kkp_w_ : (Weight*)kpp_w_;
+    }
+
+    // addGradが加算する側の勾配配列の番号
+    int addSide()
+    {
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+        return Weight::grad_side.load(std::memory_order_relaxed);
+#else
+        return 0;
+#endif
+    }
+
+    // updateWeightsが反映させる側の勾配配列の番号
+    int updateSide()
+    {
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+        return addSide() ^ 1;
+#else
+        return 0;
+#endif
+    }
+
+    bool compact_learner = false;
+    bool deterministic_learner = false;
+
+    // 勾配をスレッドごとの疎なバッファに置くかどうか
+    bool useGradBuffer() { return compact_learner || deterministic_learner; }
+
+    // 省メモリな学習器のパラメーター1つ分。
+    // g2はbfloat16で持つ。fp16では勾配の2乗和がすぐに表現できる範囲を超えてしまう。
+    // wは評価関数のテーブルに書き込まれている整数部分と、ここに持つ1/256単位の端数から復元する。
+    // gは持たず、スレッドごとの疎な勾配バッファに置く。
+    struct CompactWeight
+    {
+        uint16_t g2[2];
+        int8_t frac[2];
+    };
+
+    CompactWeight* compact_w_[GRAD_TABLE_MAX];
+
+    // 端数の単位
+    const LearnFloatType FRAC_SCALE = 256.0f;
+
+    inline float bf16ToFloat(uint16_t h)
+    {
+        uint32_t u = uint32_t(h) << 16;
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+
+    // 最近接偶数丸め。g2は非負の有限値しか入らないのでNaNの扱いは考えなくてよい。
+    inline uint16_t floatToBf16(float f)
+    {
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        return uint16_t((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+    }
+
+    // スレッドごとの疎な勾配バッファ。パラメーターの通し番号をキーにしたopen addressingのハッシュ表を、
+    // 通し番号のハッシュ値の上位bitでGRAD_SHARD個に分割して持つ。
+    // updateWeightsでは同じ分割番号のものを全スレッド分集めて足し合わせるので、分割ごとに並列に処理できる。
+    const int GRAD_SHARD_BITS = 8;
+    const int GRAD_SHARD = 1 << GRAD_SHARD_BITS;
+    const uint32_t GRAD_EMPTY = UINT32_MAX;
+
+    inline uint32_t gradHash(uint32_t index) { return uint32_t((index * 0x9E3779B97F4A7C15ULL) >> 32); }
+    inline int gradShard(uint32_t index) { return gradHash(index) >> (32 - GRAD_SHARD_BITS); }
+
+    struct GradEntry
+    {
+        uint32_t index;
+        LearnFloatType g[2];
+    };
+
+    struct GradShard
+    {
+        void add(uint32_t index, LearnFloatType g0, LearnFloatType g1)
+        {
+            // 線形探索が長くならないよう、3/4が埋まったら広げる。
+            if ((count + 1) * 4 > entries.size() * 3)
+                grow();
+
+            const size_t mask = entries.size() - 1;
+
+            for (size_t i = gradHash(index) & mask;; i = (i + 1) & mask)
+            {
+                auto& e = entries[i];
+
+                if (e.index == index)
+                {
+                    e.g[0] += g0;
+                    e.g[1] += g1;
+                    return;
+                }
+
+                if (e.index == GRAD_EMPTY)
+                {
+                    e = GradEntry{ index, { g0, g1 } };
+                    count++;
+                    return;
+                }
+            }
+        }
+
+        // 確保した領域は次のmini batchでも使うので解放しない。
+        void clear()
+        {
+            if (count)
+            {
+                std::fill(entries.begin(), entries.end(), GradEntry{ GRAD_EMPTY, { 0, 0 } });
+                count = 0;
+            }
+        }
+
+        size_t bytes() const { return entries.size() * sizeof(GradEntry); }
+
+        std::vector<GradEntry> entries;
+        size_t count = 0;
+
+    private:
+        void grow()
+        {
+            std::vector<GradEntry> old(std::max(entries.size() * 2, (size_t)1024), GradEntry{ GRAD_EMPTY, { 0, 0 } });
+            old.swap(entries);
+            count = 0;
+
+            for (auto& e : old)
+                if (e.index != GRAD_EMPTY)
+                    add(e.index, e.g[0], e.g[1]);
+        }
+    };
+
+#ifdef USE_SPARSE_GRAD
+    // 勾配が加算されたパラメーターを、GRAD_BLOCK個ごとに1bitで覚えておくビット列。
+    // 1bitが受け持つ範囲を広げるとビット列は小さくなるが、更新時に余計なパラメーターを見ることになる。
+    const uint64_t GRAD_BLOCK = 16;
+
+    struct TouchedBits
+    {
+        void init(uint64_t size) { bits.assign((size + GRAD_BLOCK * 64 - 1) / (GRAD_BLOCK * 64), 0); }
+        void set(uint64_t i) { bits[i / (GRAD_BLOCK * 64)] |= 1ULL << (i / GRAD_BLOCK % 64); }
+        std::vector<uint64_t> bits;
+    };
+#endif
+
+    // スレッドごとに、勾配配列の表裏ごとに持つ勾配の情報。
+    // スレッド間で共有しないので、addGradでatomicな操作はいらない。
+    struct ThreadGrad
+    {
+#ifdef USE_SPARSE_GRAD
+        // float版の学習器で、勾配が加算されたパラメーターのビット列。省メモリ版では使わないので、初めて使うときに確保する。
+        TouchedBits touched[2][GRAD_TABLE_MAX];
+
+        void initTouched()
+        {
+            for (auto& side : touched)
+                for (int i = 0; i < GRAD_TABLE_MAX; i++)
+                    side[i].init(GRAD_TABLE_SIZE[i]);
+        }
+#endif
+        // 省メモリ版の学習器で勾配を置く場所
+        GradShard shard[2][GRAD_SHARD];
+
+        // いまどちら側の勾配バッファに書き込んでいるか。書き込んでいなければ-1。
+        // 更新スレッドは集計する側にworkerが書き込んでいないことをこれで確かめてから集計する。
+        std::atomic_int writing{ -1 };
+
+        // 勾配を足し合わせる順番。bindGradThreadで学習スレッドの番号を設定する。
+        int id = INT_MAX;
+    };
+
+    // addGradを呼んだことのあるスレッドの勾配の情報。updateWeightsでこれらをすべて集める。
+    std::vector<std::unique_ptr<ThreadGrad>> all_grads;
+    std::mutex grads_mutex;
+    thread_local ThreadGrad* this_grad = nullptr;
+
+    ThreadGrad* threadGrad()
+    {
+        if (this_grad == nullptr)
+        {
+            std::lock_guard<std::mutex> lk(grads_mutex);
+            all_grads.push_back(std::unique_ptr<ThreadGrad>(new ThreadGrad()));
+            this_grad = all_grads.back().get();
+        }
+
+        return this_grad;
+    }
+
+    void bindGradThread(int id)
+    {
+        threadGrad()->id = id;
+    }
+
+    // 勾配の情報をidの順に並べて返す。
+    std::vector<ThreadGrad*> threadGrads()
+    {
+        std::lock_guard<std::mutex> lk(grads_mutex);
+        std::vector<ThreadGrad*> v;
+
+        for (auto& th : all_grads)
+            v.push_back(th.get());
+
+        std::stable_sort(v.begin(), v.end(), [](ThreadGrad* a, ThreadGrad* b) { return a->id < b->id; });
+        return v;
+    }
+
+    size_t gradBufferBytes()
+    {
+        size_t bytes = 0;
+
+        for (auto th : threadGrads())
+            for (auto& side : th->shard)
+                for (auto& shard : side)
+                    bytes += shard.bytes();
+
+        return bytes;
+    }
+
     void initGrad()
     {
-        if (kk_w_ == nullptr)
+        const uint64_t size = GRAD_TABLE_OFFSET[GRAD_TABLE_MAX];
+
+        if (compact_learner)
         {
-            const auto sizekk  = uint64_t(SQ_MAX) * uint64_t(SQ_MAX);
-            const auto sizekpp = uint64_t(SQ_MAX) * uint64_t(fe_end) * uint64_t(fe_end);
-            const auto sizekkp = uint64_t(SQ_MAX) * uint64_t(SQ_MAX) * uint64_t(fe_end);
-            kk_w_  = (Weight(*)[SQ_MAX][SQ_MAX])        new Weight[sizekk];
-            kpp_w_ = (Weight(*)[SQ_MAX][fe_end][fe_end])new Weight[sizekpp];
-            kkp_w_ = (Weight(*)[SQ_MAX][SQ_MAX][fe_end])new Weight[sizekkp];
-            memset(kk_w_,  0, sizeof(Weight) * sizekk);
-            memset(kpp_w_, 0, sizeof(Weight) * sizekpp);
-            memset(kkp_w_, 0, sizeof(Weight) * sizekkp);
-
-            // 元の重みをコピー
-            for (auto k1 : Squares)
-                for (auto k2 : Squares)
+            if (compact_w_[GRAD_KK] == nullptr)
+                for (int t = 0; t < GRAD_TABLE_MAX; t++)
                 {
-                    KKW[k1][k2].w[0] = LearnFloatType(KK[k1][k2][0]);
-                    KKW[k1][k2].w[1] = LearnFloatType(KK[k1][k2][1]);
+                    compact_w_[t] = new CompactWeight[GRAD_TABLE_SIZE[t]];
+                    memset(compact_w_[t], 0, sizeof(CompactWeight) * GRAD_TABLE_SIZE[t]);
+                }
 
-                    for (auto p = BONA_PIECE_ZERO; p < fe_end; ++p)
+            std::cout << "\nlearner memory  : " << sizeof(CompactWeight) * size / (1024 * 1024) << "MB (compact)"
+                      << " + " << sizeof(GradShard) * GRAD_SHARD * 2 / 1024 << "KB and growing gradient buffers per thread";
+        }
+        else
+        {
+            if (kk_w_ == nullptr)
+            {
+                const auto sizekk  = uint64_t(SQ_MAX) * uint64_t(SQ_MAX);
+                const auto sizekpp = uint64_t(SQ_MAX) * uint64_t(fe_end) * uint64_t(fe_end);
+                const auto sizekkp = uint64_t(SQ_MAX) * uint64_t(SQ_MAX) * uint64_t(fe_end);
+                kk_w_  = (Weight(*)[SQ_MAX][SQ_MAX])        new Weight[sizekk];
+                kpp_w_ = (Weight(*)[SQ_MAX][fe_end][fe_end])new Weight[sizekpp];
+                kkp_w_ = (Weight(*)[SQ_MAX][SQ_MAX][fe_end])new Weight[sizekkp];
+                memset(kk_w_,  0, sizeof(Weight) * sizekk);
+                memset(kpp_w_, 0, sizeof(Weight) * sizekpp);
+                memset(kkp_w_, 0, sizeof(Weight) * sizekkp);
+
+                // 元の重みをコピー
+                for (auto k1 : Squares)
+                    for (auto k2 : Squares)
                     {
-                        KKPW[k1][k2][p].w[0] = LearnFloatType(KKP[k1][k2][p][0]);
-                        KKPW[k1][k2][p].w[1] = LearnFloatType(KKP[k1][k2][p][1]);
-                    }
-                };
+                        KKW[k1][k2].w[0] = LearnFloatType(KK[k1][k2][0]);
+                        KKW[k1][k2].w[1] = LearnFloatType(KK[k1][k2][1]);
 
-            for (auto k : Squares)
-                for (auto p1 = BONA_PIECE_ZERO; p1 < fe_end; ++p1)
-                    for (auto p2 = BONA_PIECE_ZERO; p2 < fe_end; ++p2)
-                    {
-                        KPPW[k][p1][p2].w[0] = LearnFloatType(KPP[k][p1][p2][0]);
-                        KPPW[k][p1][p2].w[1] = LearnFloatType(KPP[k][p1][p2][1]);
-                    }
-#if defined DIMENSION_DOWN_KPP
-            evalLearnInit();
+                        for (auto p = BONA_PIECE_ZERO; p < fe_end; ++p)
+                        {
+                            KKPW[k1][k2][p].w[0] = LearnFloatType(KKP[k1][k2][p][0]);
+                            KKPW[k1][k2][p].w[1] = LearnFloatType(KKP[k1][k2][p][1]);
+                        }
+                    };
+
+                for (auto k : Squares)
+                    for (auto p1 = BONA_PIECE_ZERO; p1 < fe_end; ++p1)
+                        for (auto p2 = BONA_PIECE_ZERO; p2 < fe_end; ++p2)
+                        {
+                            KPPW[k][p1][p2].w[0] = LearnFloatType(KPP[k][p1][p2][0]);
+                            KPPW[k][p1][p2].w[1] = LearnFloatType(KPP[k][p1][p2][1]);
+                        }
+            }
+
+            std::cout << "\nlearner memory  : " << sizeof(Weight) * size / (1024 * 1024) << "MB";
+
+            if (deterministic_learner)
+                std::cout << " + growing gradient buffers per thread";
+#ifdef USE_SPARSE_GRAD
+            else
+                std::cout << " + " << (size / GRAD_BLOCK / 8) * 2 / 1024 << "KB touched bits per thread";
 #endif
         }
+
+#if defined DIMENSION_DOWN_KPP
+        evalLearnInit();
+#endif
     }
 
-    // 現在の局面で出現している特徴すべてに対して、勾配値を勾配配列に加算する。
-    void addGrad(Board& b, Turn root_turn, double delta_grad)
+    // 現在の局面で出現している特徴すべてについて、テーブルの番号、テーブル内の番号、勾配を渡してfを呼び出す。
+    template <typename F>
+    void forEachFeature(Board& b, Turn root_turn, double delta_grad, F f)
     {
         auto sq_bk = b.kingSquare(BLACK);
         auto sq_wk = b.kingSquare(WHITE);
         auto sq_ik = inverse(sq_wk);
         auto list_fb = b.evalList()->pieceListFb();
         auto list_fw = b.evalList()->pieceListFw();
-        auto f = (root_turn == BLACK   ) ? LearnFloatType(delta_grad) : -LearnFloatType(delta_grad);
-        auto g = (root_turn == b.turn()) ? LearnFloatType(delta_grad) : -LearnFloatType(delta_grad);
+        auto fg = (root_turn == BLACK   ) ? LearnFloatType(delta_grad) : -LearnFloatType(delta_grad);
+        auto g  = (root_turn == b.turn()) ? LearnFloatType(delta_grad) : -LearnFloatType(delta_grad);
+        auto kk_index = uint64_t(sq_bk) * uint64_t(SQ_MAX) + uint64_t(sq_wk);
 
         for (int i = 0; i < PIECE_NO_KING; ++i)
         {
             auto k0 = list_fb[i];
             auto k1 = list_fw[i];
-            {
-                WeightValue delta{ f, g };
-                KKPW[sq_bk][sq_wk][k0].addGrad(delta);
-            }
+
+            f(GRAD_KKP, kk_index * uint64_t(fe_end) + uint64_t(k0), fg, g);
 
             for (int j = 0; j < i; ++j)
             {
                 auto l0 = list_fb[j];
                 auto l1 = list_fw[j];
-                {
-                    WeightValue delta{ +f, g };
-                    ((Weight*)kpp_w_)[getKppIndex(sq_bk, k0, l0)].addGrad(delta);
-                }
-                {
-                    WeightValue delta{ -f, g };
-                    ((Weight*)kpp_w_)[getKppIndex(sq_ik, k1, l1)].addGrad(delta);
-                }
+                f(GRAD_KPP, getKppIndex(sq_bk, k0, l0), +fg, g);
+                f(GRAD_KPP, getKppIndex(sq_ik, k1, l1), -fg, g);
             }
         }
+
+        f(GRAD_KK, kk_index, fg, g);
+    }
+
+    // 現在の局面で出現している特徴すべてに対して、勾配値を勾配配列に加算する。
+    void addGrad(Board& b, Turn root_turn, double delta_grad)
+    {
+        auto& tg = *threadGrad();
+
+        if (useGradBuffer())
+        {
+            // 入れ替えの直後に古い側へ書き込まないよう、書き込む側を宣言してから入れ替わっていないことを確かめる。
+            int side;
+
+            do {
+                side = addSide();
+                tg.writing = side;
+            } while (side != addSide());
+
+            auto shard = tg.shard[side];
+
+            forEachFeature(b, root_turn, delta_grad, [&](int t, uint64_t i, LearnFloatType f, LearnFloatType g)
+            {
+                auto index = uint32_t(GRAD_TABLE_OFFSET[t] + i);
+                shard[gradShard(index)].add(index, f, g);
+            });
+
+            tg.writing = -1;
+            return;
+        }
+
+#ifdef USE_SPARSE_GRAD
+        if (tg.touched[0][0].bits.empty())
+            tg.initTouched();
+
+        auto touched = tg.touched[addSide()];
+#endif
+        forEachFeature(b, root_turn, delta_grad, [&](int t, uint64_t i, LearnFloatType f, LearnFloatType g)
         {
             WeightValue delta{ f, g };
-            KKW[sq_bk][sq_wk].addGrad(delta);
+            weightTable(t)[i].addGrad(delta);
+#ifdef USE_SPARSE_GRAD
+            touched[t].set(i);
+#endif
+        });
+    }
+
+    // 評価関数のテーブルtのi番目の値
+    int32_t tableValue(int t, uint64_t i, int n)
+    {
+        return t == GRAD_KK  ? ((ValueKk*)KK)[i][n]
+             : t == GRAD_KKP ? ((ValueKkp*)KKP)[i][n]
+             :                 ((ValueKpp*)KPP)[i][n];
+    }
+
+    // 値を制限してから、評価関数のテーブルtのi番目に反映させる。
+    void writeTable(int t, uint64_t i, LearnFloatType* w)
+    {
+        if (t == GRAD_KK)
+        {
+            SET_A_LIMIT_TO(w, LearnFloatType((int32_t)INT16_MIN * 4), LearnFloatType((int32_t)INT16_MAX * 4));
+            ((ValueKk*)KK)[i] = { (int32_t)std::round(w[0]), (int32_t)std::round(w[1]) };
+        }
+        else if (t == GRAD_KKP)
+        {
+            SET_A_LIMIT_TO(w, (LearnFloatType)(INT16_MIN / 2), (LearnFloatType)(INT16_MAX / 2));
+            ((ValueKkp*)KKP)[i] = ValueKkp{ (int32_t)std::round(w[0]), (int32_t)std::round(w[1]) };
+        }
+        else
+        {
+            SET_A_LIMIT_TO(w, (LearnFloatType)(INT16_MIN / 2), (LearnFloatType)(INT16_MAX / 2));
+            auto k = Square(i / (uint64_t(fe_end) * uint64_t(fe_end)));
+            auto p1 = BonaPiece(i / fe_end % fe_end);
+            auto p2 = BonaPiece(i % fe_end);
+            writeKpp(k, p1, p2, ValueKpp{ (int16_t)std::round(w[0]), (int16_t)std::round(w[1]) });
         }
     }
 
+    // 省メモリ版の学習器で、テーブルtのi番目のパラメーターに勾配gを反映させる。Weight::updateと同じことをする。
+    void updateCompact(int t, uint64_t i, const LearnFloatType* g, bool skip_update)
+    {
+        if (g[0] == 0 && g[1] == 0)
+            return;
+
+        auto& c = compact_w_[t][i];
+        LearnFloatType g2[2], w[2];
+
+        for (int n = 0; n < 2; n++)
+        {
+            g2[n] = bf16ToFloat(c.g2[n]) + g[n] * g[n];
+            c.g2[n] = floatToBf16(g2[n]);
+        }
+
+        // 値が小さいうちはskipする
+        if (skip_update)
+            return;
+
+        for (int n = 0; n < 2; n++)
+        {
+            w[n] = LearnFloatType(tableValue(t, i, n)) + c.frac[n] / FRAC_SCALE;
+
+            if (g2[n] >= 0.1f)
+                w[n] = w[n] - Weight::eta * g[n] / sqrt(g2[n]);
+        }
+
+        writeTable(t, i, w);
+
+        for (int n = 0; n < 2; n++)
+            c.frac[n] = (int8_t)std::max(std::min(std::round((w[n] - std::round(w[n])) * FRAC_SCALE), 127.0f), -128.0f);
+    }
+
     void updateWeights(uint64_t epoch)
     {
         const bool skip_update = epoch <= (uint64_t)Eval::Weight::skip_count;
+        const int thread_num = std::max(Weight::update_thread_num, 1);
+        const int side = updateSide();
+        auto grads = threadGrads();
+
+        // 集計する側の勾配バッファに書き込み中のworkerがいれば、書き終わるのを待つ。
+        for (auto th : grads)
+            while (th->writing == side)
+                std::this_thread::yield();
 
         // KKPの一番大きな値を表示させることで学習が進んでいるかのチェックに用いる。
 #ifdef DISPLAY_STATS_IN_UPDATE_WEIGHTS
         WeightValue max_kkp{ 0.0f, 0.0f };
+
+        for (uint64_t i = 0; i < GRAD_TABLE_SIZE[GRAD_KK]; i++)
+            for (int n = 0; n < 2; n++)
+                max_kkp[n] = std::max(max_kkp[n], LearnFloatType(abs(tableValue(GRAD_KK, i, n))));
 #endif
-        // こういう処理ってopenmp使えば楽なのかな……
-        auto func = [&](size_t id)
+        // 仕事をcount個に切り出して、空いたスレッドから順に取っていく。
+        // 細かく切っておかないと、スレッド数が多いときに最後の数スレッドだけが働く時間が長くなる。
+        auto run = [&](uint64_t count, std::function<void(uint64_t)> unit_func)
         {
-            for (auto k1 = 9 * id; k1 < 9 * (id + 1); k1++)
-                for (auto k2 : Squares)
+            std::atomic<uint64_t> next(0);
+
+            auto func = [&]()
+            {
+                for (uint64_t u; (u = next++) < count;)
+                    unit_func(u);
+            };
+
+            std::vector<std::thread> th;
+
+            for (int i = 1; i < thread_num; i++)
+                th.push_back(std::thread(func));
+
+            func();
+
+            for (auto& t : th)
+                t.join();
+        };
+
+        if (useGradBuffer())
+        {
+            // 集計した勾配を反映させる。
+            auto apply = [&](int t, uint64_t i, const LearnFloatType* g)
+            {
+                if (compact_learner)
                 {
-                    auto& w = KKW[k1][k2];
-#ifdef DISPLAY_STATS_IN_UPDATE_WEIGHTS
-                    max_kkp[0] = std::max(max_kkp[0], abs(w.w[0]));
-                    max_kkp[1] = std::max(max_kkp[1], abs(w.w[1]));
-#endif
-                    // wの値にupdateがあったなら、値を制限して、かつ、KKに反映させる。
-                    if (w.update(skip_update))
-                    {
-                        SET_A_LIMIT_TO(w.w, LearnFloatType((int32_t)INT16_MIN * 4), LearnFloatType((int32_t)INT16_MAX * 4));
-                        KK[k1][k2] = { (int32_t)std::round(w.w[0]), (int32_t)std::round(w.w[1]) };
-                    }
+                    updateCompact(t, i, g, skip_update);
+                    return;
                 }
 
-            for (Square k = Square(9 * id); k < (Square)(9 * (id + 1)); k++)
-                for (auto p1 = BONA_PIECE_ZERO; p1 < fe_end; ++p1)
-                    for (auto p2 = BONA_PIECE_ZERO; p2 < fe_end; ++p2)
-                    {
-                        auto& w = KPPW[k][p1][p2];
+                auto& w = weightTable(t)[i];
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+                auto& wg = side ? w.g_back : w.g;
+#else
+                auto& wg = w.g;
+#endif
+                wg[0] += g[0];
+                wg[1] += g[1];
 
-                        if (w.update(skip_update))
-                        {
-                            SET_A_LIMIT_TO(w.w, (LearnFloatType)(INT16_MIN / 2), (LearnFloatType)(INT16_MAX / 2));
-                            writeKpp(k, p1, p2, ValueKpp{ (int16_t)std::round(w.w[0]), (int16_t)std::round(w.w[1]) });
-                        }
-                    }
+                if (w.update(skip_update))
+                    writeTable(t, i, w.w.data());
+            };
+
+            // 分割ごとに、全スレッドの勾配をidの順に最初のスレッドの分へ足し合わせてから反映させる。
+            // 足す順番が決まっているので、各スレッドが同じ局面を受け持つ限り結果は毎回同じになる。
+            if (grads.size())
+                run(GRAD_SHARD, [&](uint64_t s)
+                {
+                    auto& sum = grads[0]->shard[side][s];
 
-            for (auto k1 = 9 * id; k1 < 9 * (id + 1); k1++)
-                for (auto k2 : Squares)
-                    for (auto p = BONA_PIECE_ZERO; p < fe_end; ++p)
+                    for (size_t n = 1; n < grads.size(); n++)
                     {
-                        auto& w = KKPW[k1][k2][p];
+                        auto& shard = grads[n]->shard[side][s];
 
-                        if (w.update(skip_update))
+                        for (auto& e : shard.entries)
+                            if (e.index != GRAD_EMPTY)
+                                sum.add(e.index, e.g[0], e.g[1]);
+
+                        shard.clear();
+                    }
+
+                    for (auto& e : sum.entries)
+                        if (e.index != GRAD_EMPTY)
                         {
-                            SET_A_LIMIT_TO(w.w, (LearnFloatType)(INT16_MIN / 2), (LearnFloatType)(INT16_MAX / 2));
-                            KKP[k1][k2][p] = ValueKkp{ (int32_t)std::round(w.w[0]), (int32_t)std::round(w.w[1]) };
+                            int t = e.index < GRAD_TABLE_OFFSET[GRAD_KKP] ? GRAD_KK
+                                  : e.index < GRAD_TABLE_OFFSET[GRAD_KPP] ? GRAD_KKP : GRAD_KPP;
+                            apply(t, e.index - GRAD_TABLE_OFFSET[t], e.g);
                         }
-                    }
-        };
 
-        std::thread th[9];
+                    sum.clear();
+                });
+        }
+        else
+        {
+            // 1単位でUNIT個のパラメーターを扱う。
+            const uint64_t UNIT = 1024;
+            const uint64_t units[GRAD_TABLE_MAX + 1] =
+            {
+                0,
+                (GRAD_TABLE_SIZE[GRAD_KK] + UNIT - 1) / UNIT,
+                (GRAD_TABLE_SIZE[GRAD_KK] + UNIT - 1) / UNIT + (GRAD_TABLE_SIZE[GRAD_KKP] + UNIT - 1) / UNIT,
+                (GRAD_TABLE_SIZE[GRAD_KK] + UNIT - 1) / UNIT + (GRAD_TABLE_SIZE[GRAD_KKP] + UNIT - 1) / UNIT
+                    + (GRAD_TABLE_SIZE[GRAD_KPP] + UNIT - 1) / UNIT,
+            };
+
+            auto tableOf = [&](uint64_t u) { return u < units[GRAD_KKP] ? GRAD_KK : u < units[GRAD_KPP] ? GRAD_KKP : GRAD_KPP; };
+
+            // テーブルtのi番目のパラメーターを更新し、wの値にupdateがあったなら、評価関数のテーブルに反映させる。
+            auto apply = [&](int t, uint64_t i)
+            {
+                auto& w = weightTable(t)[i];
+
+                if (w.update(skip_update))
+                    writeTable(t, i, w.w.data());
+            };
+
+#ifdef USE_SPARSE_GRAD
+            static_assert(GRAD_BLOCK * 64 == UNIT, "");
 
-        for (int i = 0; i < 9; i++)
-            th[i] = std::thread(func, i);
+            // 各スレッドのビット列をORして、勾配が加算されたブロックだけを更新する。集めた側のビット列はクリアしておく。
+            run(units[GRAD_TABLE_MAX], [&](uint64_t unit)
+            {
+                const int t = tableOf(unit);
+                const uint64_t u = unit - units[t];
+                uint64_t merged = 0;
+
+                for (auto th : grads)
+                {
+                    if (th->touched[side][t].bits.empty())
+                        continue;
+
+                    auto& bits = th->touched[side][t].bits[u];
+                    merged |= bits;
+                    bits = 0;
+                }
+
+                for (; merged; merged &= merged - 1)
+                {
+                    auto begin = u * UNIT + uint64_t(bsf64(merged)) * GRAD_BLOCK;
+                    auto end = std::min(begin + GRAD_BLOCK, GRAD_TABLE_SIZE[t]);
 
-        for (int i = 0; i < 9; i++)
-            th[i].join();
+                    for (auto i = begin; i < end; i++)
+                        apply(t, i);
+                }
+            });
+#else
+            run(units[GRAD_TABLE_MAX], [&](uint64_t unit)
+            {
+                const int t = tableOf(unit);
+                const uint64_t u = unit - units[t];
+
+                for (auto i = u * UNIT; i < std::min((u + 1) * UNIT, GRAD_TABLE_SIZE[t]); i++)
+                    apply(t, i);
+            });
+#endif
+        }
 
 #ifdef DISPLAY_STATS_IN_UPDATE_WEIGHTS
         SYNC_COUT << " , max_kkp = " << max_kkp[0] << ", " << max_kkp[1] << SYNC_ENDL;
@@ -1271,7 +1271,7 @@ namespace
     {
         assert(!b.inCheck());
 
-        const StateInfo* st = b.state();
+        const Bitboard* check_sq = b.checkSquares();
 
         const Turn self = T;
         const Turn enemy = ~T;
@@ -1290,7 +1290,7 @@ namespace
 
             if (bb_from)
             {
-                Bitboard bb_target = target & st->check_sq[DRAGON];
+                Bitboard bb_target = target & check_sq[DRAGON];
 
                 do {
                     const Square from = bb_from.firstOne();
@@ -1313,7 +1313,7 @@ namespace
 
             if (from123)
             {
-                Bitboard rook_target = target & st->check_sq[DRAGON];
+                Bitboard rook_target = target & check_sq[DRAGON];
 
                 do {
                     const Square from = firstOne<T_HIGH>(from123);
@@ -1331,8 +1331,8 @@ namespace
             // 敵陣ではないところからの移動
             if (from4_9)
             {
-                uint64_t target_pro = st->check_sq[DRAGON].b(T_HIGH) & enemyMask(self).b(T_HIGH);
-                Bitboard bb_target = enemyMask(self).notThisAnd(st->check_sq[ROOK]);
+                uint64_t target_pro = check_sq[DRAGON].b(T_HIGH) & enemyMask(self).b(T_HIGH);
+                Bitboard bb_target = enemyMask(self).notThisAnd(check_sq[ROOK]);
 
                 do {
                     const Square from = firstOne<T_LOW>(from4_9);
@@ -1356,7 +1356,7 @@ namespace
 
             if (bb_from)
             {
-                Bitboard bb_target = target & st->check_sq[HORSE];
+                Bitboard bb_target = target & check_sq[HORSE];
 
                 do {
                     const Square from = bb_from.firstOne();
@@ -1378,7 +1378,7 @@ namespace
             if (from123)
             {
                 uint64_t target_pro = target.b(TK) & rookStepAttack(ksq).b(TK);
-                Bitboard bb_target = target & st->check_sq[BISHOP];
+                Bitboard bb_target = target & check_sq[BISHOP];
 
                 do {
                     const Square from = firstOne<T_HIGH>(from123);
@@ -1403,8 +1403,8 @@ namespace
 
             if (from4_9)
             {
-                Bitboard bb_target = enemyMask(self).notThisAnd(st->check_sq[BISHOP]);
-                uint64_t target_pro = st->check_sq[HORSE].b(T_HIGH) & enemyMask(self).b(T_HIGH);
+                Bitboard bb_target = enemyMask(self).notThisAnd(check_sq[BISHOP]);
+                uint64_t target_pro = check_sq[HORSE].b(T_HIGH) & enemyMask(self).b(T_HIGH);
 
                 do {
                     const Square from = firstOne<T_LOW>(from4_9);
@@ -1432,7 +1432,7 @@ namespace
 
             if (from64)
             {
-                uint64_t gold_target = target.b(TK) & st->check_sq[GOLD].b(TK);
+                uint64_t gold_target = target.b(TK) & check_sq[GOLD].b(TK);
 
                 do {
                     const Square from = firstOne<TK>(from64);
@@ -1451,10 +1451,10 @@ namespace
             if (from64)
             {
                 // 成らなくても王手になる場所
-                uint64_t chk = st->check_sq[SILVER].b(TK);
+                uint64_t chk = check_sq[SILVER].b(TK);
 
                 // 成って王手になる場所
-                uint64_t pro_chk = st->check_sq[GOLD].b(TK) & enemyMaskPlus1(self).b(TK);
+                uint64_t pro_chk = check_sq[GOLD].b(TK) & enemyMaskPlus1(self).b(TK);
 
                 do
                 {
@@ -1485,8 +1485,8 @@ namespace
 
             if (from64)
             {
-                uint64_t chk_pro = target64 & st->check_sq[GOLD].b(TK) & enemyMask(self).b(TK);
-                uint64_t chk = target64 & st->check_sq[KNIGHT].b(TK);
+                uint64_t chk_pro = target64 & check_sq[GOLD].b(TK) & enemyMask(self).b(TK);
+                uint64_t chk = target64 & check_sq[KNIGHT].b(TK);
 
                 do {
                     const Square from = firstOne<T_LOW>(from64);
@@ -1512,7 +1512,7 @@ namespace
             if (bb_from)
             {
                 // 香車を動かす手で駒を取らない王手は、成りしかない。
-                const uint64_t chk_pro = st->check_sq[GOLD].b(TK) & enemyMask(self).b(TK);
+                const uint64_t chk_pro = check_sq[GOLD].b(TK) & enemyMask(self).b(TK);
 
                 do {
                     const Square from = bb_from.firstOne();
@@ -1562,7 +1562,7 @@ namespace
                 if (canPromote(self, from))
                 {
                     // 成りで動ける場所
-                    uint64_t to64 = bb_to.b(T_HIGH) & ~st->check_sq[promotePieceType(pt)].b(T_HIGH);
+                    uint64_t to64 = bb_to.b(T_HIGH) & ~check_sq[promotePieceType(pt)].b(T_HIGH);
 
                     while (to64)
                     {
@@ -1573,7 +1573,7 @@ namespace
                 else
                 {
                     // 成りで動ける場所
-                    uint64_t to64 = bb_to.b(T_HIGH) & ~st->check_sq[promotePieceType(pt)].b(T_HIGH) & enemyMask(self).b(T_HIGH);
+                    uint64_t to64 = bb_to.b(T_HIGH) & ~check_sq[promotePieceType(pt)].b(T_HIGH) & enemyMask(self).b(T_HIGH);
 
                     while (to64)
                     {
@@ -1587,7 +1587,7 @@ namespace
                 if (canPromote(self, from))
                 {
                     // 成りで動ける場所
-                    Bitboard bb_to_promote = bb_to & ~st->check_sq[promotePieceType(pt)];
+                    Bitboard bb_to_promote = bb_to & ~check_sq[promotePieceType(pt)];
 
                     while (bb_to_promote)
                     {
@@ -1598,7 +1598,7 @@ namespace
                 else
                 {
                     // 成りで動ける場所
-                    Bitboard bb_to_promote = bb_to & ~st->check_sq[promotePieceType(pt)] & enemyMask(self);
+                    Bitboard bb_to_promote = bb_to & ~check_sq[promotePieceType(pt)] & enemyMask(self);
 
                     while (bb_to_promote)
                     {
@@ -1608,7 +1608,7 @@ namespace
                 }
             }
 
-            bb_to.andEqualNot(st->check_sq[pt]);
+            bb_to.andEqualNot(check_sq[pt]);
 
             // 成り以外
             while (bb_to)
@@ -1642,28 +1642,28 @@ namespace
         }
 
         if (h.exists(LANCE) && isBehind(enemy, RANK_1, ksq))
-            for (Bitboard bb_to = target & st->check_sq[LANCE]; bb_to;)
+            for (Bitboard bb_to = target & check_sq[LANCE]; bb_to;)
                 mlist++->move = makeDrop(self == BLACK ? B_LANCE : W_LANCE, bb_to.firstOne());
 
         if (h.exists(KNIGHT))
-            for (uint64_t to64 = target64 & st->check_sq[KNIGHT].b(TK); to64;)
+            for (uint64_t to64 = target64 & check_sq[KNIGHT].b(TK); to64;)
                 mlist++->move = makeDrop(self == BLACK ? B_KNIGHT : W_KNIGHT, firstOne<TK>(to64));
 
         if (h.exists(SILVER))
-            for (uint64_t to64 = target64 & st->check_sq[SILVER].b(TK); to64;)
+            for (uint64_t to64 = target64 & check_sq[SILVER].b(TK); to64;)
                 mlist++->move = makeDrop(self == BLACK ? B_SILVER : W_SILVER, firstOne<TK>(to64));
 
         if (h.exists(GOLD))
-            for (uint64_t to64 = target64 & st->check_sq[GOLD].b(TK); to64;)
+            for (uint64_t to64 = target64 & check_sq[GOLD].b(TK); to64;)
                 mlist++->move = makeDrop(self == BLACK ? B_GOLD : W_GOLD, firstOne<TK>(to64));
 
         // 飛び駒はいろいろなところから王手できるのでBBを使わざるを得ない。
         if (h.exists(BISHOP))
-            for (Bitboard bb_to = target & st->check_sq[BISHOP]; bb_to;)
+            for (Bitboard bb_to = target & check_sq[BISHOP]; bb_to;)
                 mlist++->move = makeDrop(self == BLACK ? B_BISHOP : W_BISHOP, bb_to.firstOne());
 
         if (h.exists(ROOK))
-            for (Bitboard bb_to = target & st->check_sq[ROOK]; bb_to;)
+            for (Bitboard bb_to = target & check_sq[ROOK]; bb_to;)
                 mlist++->move = makeDrop(self == BLACK ? B_ROOK : W_ROOK, bb_to.firstOne());
 
         return mlist;
@@ -23,8 +23,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "config.h"
 
-#if defined LEARN
-
 #include <sstream>
 #include <fstream>
 
@@ -42,6 +40,45 @@ const int huffman_table[][2] =
     { 0x0f, 5 }, // GOLD
 };
 
+// 次の8bitから、駒とその符号の長さ(成りと手番のbitを含む)を引く表。
+// 盤上の駒の符号は成りと手番を含めて8bit以下、駒台の駒は7bit以下なので、1回引けば1駒読める。
+struct HuffmanDecodeTable
+{
+    HuffmanDecodeTable(bool hand)
+    {
+        for (int x = 0; x < 256; x++)
+        {
+            piece[x] = EMPTY;
+            bits[x] = 0;
+
+            for (PieceType pr = hand ? BISHOP : NO_PIECE_TYPE; pr < KING; ++pr)
+            {
+                // 駒台の駒は、盤上の駒の符号の最後の1bitを除いたもの
+                int code = huffman_table[pr][0] >> (hand ? 1 : 0);
+                int len = huffman_table[pr][1] - (hand ? 1 : 0);
+
+                if ((x & ((1 << len) - 1)) != code)
+                    continue;
+
+                if (pr != NO_PIECE_TYPE)
+                {
+                    bool promote = pr != GOLD && ((x >> len++) & 1);
+                    Turn c = (Turn)((x >> len++) & 1);
+                    piece[x] = ((promote && !hand) ? promotePieceType(pr) : pr) | c;
+                }
+
+                bits[x] = (uint8_t)len;
+                break;
+            }
+        }
+    }
+
+    Piece piece[256];
+    uint8_t bits[256];
+};
+
+const HuffmanDecodeTable board_decode_table(false), hand_decode_table(true);
+
 struct SfenPacker
 {
     SfenPacker(uint8_t* d) : data(d), bit_cursor(0) {};
@@ -76,18 +113,18 @@ struct SfenPacker
         return result;
     }
 
-    void pack(const Board& b)
+    void pack(const Board& b, bool mirrored)
     {
         memset(data, 0, 32);
 
         write1bit(b.turn());
 
         for (auto c : Turns)
-            writeNbit(b.kingSquare(c), 7);
+            writeNbit(mirrored ? mirror(b.kingSquare(c)) : b.kingSquare(c), 7);
 
         for (auto sq : Squares)
         {
-            Piece pc = b.piece(sq);
+            Piece pc = b.piece(mirrored ? mirror(sq) : sq);
 
             if (typeOf(pc) == KING)
                 continue;
@@ -135,59 +172,27 @@ struct SfenPacker
         write1bit(turnOf(pc));
     }
 
-    Piece readBoard()
-    {
-        PieceType pr = NO_PIECE_TYPE;
-        int code = 0, bits = 0;
-        while (true)
-        {
-            code |= read1bit() << bits;
-            ++bits;
-
-            assert(bits <= 6);
+    // 表引きで1駒読む。
+    Piece readBoard() { return read(board_decode_table); }
+    Piece readHand() { return read(hand_decode_table); }
 
-            for (pr = NO_PIECE_TYPE; pr < KING; ++pr)
-                if (huffman_table[pr][0] == code
-                    && huffman_table[pr][1] == bits)
-                    goto Found;
-        }
-    Found:;
-        if (pr == NO_PIECE_TYPE)
-            return Piece(pr);
-
-        bool promote = (pr == GOLD) ? false : read1bit();
-        Turn c = (Turn)read1bit();
-        return (promote ? promotePieceType(pr) : pr) | c;
+private:
+    // 現在位置から8bitを読む。データの末尾を越える分は0になる。
+    int peek8() const
+    {
+        int i = bit_cursor / 8;
+        int w = data[i] | (i + 1 < 32 ? data[i + 1] << 8 : 0);
+        return (w >> (bit_cursor & 7)) & 0xff;
     }
 
-    Piece readHand()
+    Piece read(const HuffmanDecodeTable& table)
     {
-        PieceType pr = NO_PIECE_TYPE;
-        int code = 0, bits = 0;
-        while (true)
-        {
-            code |= read1bit() << bits;
-            ++bits;
-
-            assert(bits <= 6);
-
-            for (pr = BISHOP; pr < KING; ++pr)
-                if ((huffman_table[pr][0] >> 1) == code
-                    && (huffman_table[pr][1] - 1) == bits)
-                    goto Found;
-        }
-    Found:;
-        assert(pr != NO_PIECE_TYPE);
-
-        if (pr != GOLD)
-            read1bit();
-
-        Turn c = (Turn)read1bit();
-
-        return pr | c;
+        int x = peek8();
+        assert(table.bits[x]);
+        bit_cursor += table.bits[x];
+        return table.piece[x];
     }
 
-private:
     uint8_t *data;
     int bit_cursor;
 };
@@ -298,8 +303,12 @@ void Board::setFromPackedSfen(uint8_t data[32])
     }
 
     setState(st_);
+    repetitionFilter(st_->board_key)++;
 #ifdef USE_EVAL
     Eval::computeAll(*this);
+#ifdef USE_PROGRESS
+    Progress::computeAll(*this);
+#endif
 #endif
 
 #ifdef USE_BYTEBOARD
@@ -314,10 +323,8 @@ void Board::setFromPackedSfen(uint8_t data[32])
     assert(verify());
 }
 
-void Board::sfenPack(uint8_t data[32]) const
+void Board::sfenPack(uint8_t data[32], bool mirror) const
 {
     SfenPacker sp(data);
-    sp.pack(*this);
+    sp.pack(*this, mirror);
 }
-
-#endif
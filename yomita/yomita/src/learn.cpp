@@ -44,6 +44,7 @@ namespace Eval
 {
     LearnFloatType Weight::eta = 64.0f;
     int Weight::skip_count = 10;
+    int Weight::update_thread_num = 9;
 }
 
 namespace Learn
@@ -66,11 +67,25 @@ namespace Learn
 
     namespace LearnSpace
     {
-        // sfenの読み出し器
+        // sfenの読み出し器。普段はメモリマップするほうを使い、streamを指定したときだけ従来のものを使う。
         AsyncSfenRW sr;
+        MappedSfenReader mr;
+        bool use_stream = false;
 
-        // mse計算用のバッファ
-        std::vector<PackedSfenValue> sfen_for_mse;
+        bool readSfen(size_t thread_id, PackedSfenValue& ps)
+        {
+            return use_stream ? sr.read(thread_id, ps) : mr.read(thread_id, ps);
+        }
+
+        uint64_t readCount() { return use_stream ? sr.readCount() : mr.readCount(); }
+
+        // 決定的に学習するかどうか。
+        bool deterministic = false;
+
+        // 損失の計算に使う検証用の局面。val_fileを指定しなければ、学習に使う局面の先頭から取る。
+        std::vector<PackedSfenValue> val_sfens;
+        std::string val_file;
+        size_t val_size = 10000;
 
         // 学習の反復回数のカウンター
         uint64_t epoch = 0;
@@ -81,6 +96,36 @@ namespace Learn
         // updateWeightsしている途中であることを表すフラグ
         std::atomic_bool updating;
 
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+        // バックグラウンドでupdateWeightsを行うスレッド
+        std::thread update_thread;
+#endif
+        // 学習開始時刻と、updateWeightsに費やした時間の合計。
+        // update_stallはworkerが勾配計算を止めて更新を待っていた時間。
+        TimePoint learn_start;
+        std::atomic<TimePoint> update_time, update_stall;
+
+        // updateWeightsを行う。
+        void updateWeights()
+        {
+            auto start = now();
+            Eval::updateWeights(++epoch);
+            update_time += now() - start;
+        }
+
+        // バックグラウンドで行われている更新があれば、終わるまで待つ。
+        void waitUpdate()
+        {
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+            if (update_thread.joinable())
+            {
+                auto start = now();
+                update_thread.join();
+                update_stall += now() - start;
+            }
+#endif
+        }
+
         // mini batch何回ごとにrmseを計算するか。
         const int LEARN_RMSE_OUTPUT_INTERVAL = 10;
 
@@ -89,156 +134,459 @@ namespace Learn
 
         bool initMse()
         {
-            for (int i = 0; i < 10000; ++i)
+            MappedSfenReader val_reader;
+
+            if (val_file != "" && !val_reader.open(1, { val_file }, 1))
+            {
+                std::cout << "Error! can't read " << val_file << std::endl;
+                return false;
+            }
+
+            val_sfens.clear();
+
+            while (val_sfens.size() < val_size)
             {
                 PackedSfenValue ps;
 
-                if (!sr.read(0, ps))
+                if (val_file != "" ? !val_reader.read(0, ps) : !readSfen(0, ps))
                 {
+                    if (val_file != "" && val_sfens.size())
+                        break;
+
                     std::cout << "Error! read packed sfen , failed." << std::endl;
                     return false;
                 }
 
-                sfen_for_mse.push_back(ps);
+                val_sfens.push_back(ps);
             }
 
             return true;
         }
 
-        void calcRmse(Board& b)
+        // 検証用の局面に対する損失の集計
+        struct ValidationStats
         {
-            if (sfen_for_mse.size() == 0)
+            double sum_grad2 = 0, sum_error = 0, sum_cross_entropy = 0;
+            uint64_t count = 0, move_total = 0, move_match = 0;
+
+            void add(const ValidationStats& s)
             {
-                std::cout << "error! sfen_for_mse is empty." << std::endl;
-                return;
+                sum_grad2 += s.sum_grad2;
+                sum_error += s.sum_error;
+                sum_cross_entropy += s.sum_cross_entropy;
+                count += s.count;
+                move_total += s.move_total;
+                move_match += s.move_match;
             }
+        };
 
-            int i = 0;
-            double sum_error = 0;
-            double sum_error2 = 0;
+        // 損失の計算はVALIDATION_CHUNK局面ずつに分けて、スレッドプール全体で手分けして行う。
+        // 結果はチャンクごとに置いておき、チャンクの順に足し合わせるので、誰が計算しても合計は同じになる。
+        const size_t VALIDATION_CHUNK = 64;
+        std::vector<ValidationStats> val_chunks;
+        std::atomic<size_t> val_next, val_done;
+        std::atomic_bool validating;
+        TimePoint val_start, val_end;
+
+        void startValidation()
+        {
+            val_chunks.assign((val_sfens.size() + VALIDATION_CHUNK - 1) / VALIDATION_CHUNK, ValidationStats());
+            val_done = 0;
+            val_next = 0;
+            val_start = now();
+            validating = true;
+        }
+
+        void validateChunk(Board& b, size_t c)
+        {
+            ValidationStats s;
 
-            for (auto& ps : sfen_for_mse)
+            for (size_t i = c * VALIDATION_CHUNK; i < std::min((c + 1) * VALIDATION_CHUNK, val_sfens.size()); i++)
             {
+                auto& ps = val_sfens[i];
                 b.setFromPackedSfen(ps.data);
                 auto r = Learn::qsearch(b);
                 Score shallow_value = r.first;
                 Score deep_value = Score(ps.deep);
+
                 if ((deep_value >= EVAL_LIMIT && ps.win) || (deep_value <= -EVAL_LIMIT && !ps.win))
                     continue;
-#if 0
-                if ((i++ % 1000) == 0)
-                    SYNC_COUT << "shallow = " << std::setw(5) << shallow_value
-                    << " deep = " << std::setw(5) << deep_value
-                    << " grad = " << calcGrad(shallow_value, deep_value, ps.win) << SYNC_ENDL;
-#endif
+
                 // 誤差の計算
-                auto grad = calcGrad(deep_value, shallow_value, ps.win, Progress::evaluate(b));
-                sum_error += grad * grad;
-                sum_error2 += abs(shallow_value - deep_value);
+                auto progress = Progress::evaluate(b);
+                auto grad = calcGrad(deep_value, shallow_value, ps.win, progress);
+                s.sum_grad2 += grad * grad;
+                s.sum_error += abs(shallow_value - deep_value);
+                s.count++;
+
+                // calcGradが目標にしている勝率と、浅い探索の勝率との交差エントロピー
+                double p = winest(deep_value);
+                double t = p + LAMBDA * ((ps.win ? 1.0 : 0.0) - p) * progress;
+                double q = std::min(std::max(winest(shallow_value), 1e-12), 1.0 - 1e-12);
+                s.sum_cross_entropy -= t * std::log(q) + (1.0 - t) * std::log(1.0 - q);
+
+                // 教師の指し手が入っていれば、1手読みの最善手と一致するかを見る。
+                if (ps.m != MOVE_NONE)
+                {
+                    auto pv = Learn::search(b, ONE_PLY).second;
+                    s.move_total++;
+                    s.move_match += !pv.empty() && pv[0] == ps.m;
+                }
+            }
+
+            val_chunks[c] = s;
+
+            // 最後のチャンクを終えたスレッドが終了時刻を記録する。
+            if (++val_done == val_chunks.size())
+                val_end = now();
+        }
+
+        // 検証用の局面の損失の計算を手伝う。決定的に学習するときは、置換表の中身を再現させるために
+        // スレッドの番号で受け持つチャンクを固定し、そうでなければ空いているチャンクを順に取っていく。
+        void helpValidate(Board& b, size_t idx, size_t n)
+        {
+            const size_t chunks = val_chunks.size();
+
+            if (deterministic)
+                for (size_t c = chunks * idx / n; c < chunks * (idx + 1) / n; c++)
+                    validateChunk(b, c);
+            else
+                for (size_t c = val_next++; c < chunks; c = val_next++)
+                    validateChunk(b, c);
+        }
+
+        bool validationPending() { return validating && val_next < val_chunks.size(); }
+
+        // 全チャンクの計算が終わってから呼び出す。結果を表示してrmseを返す。
+        double finishValidation()
+        {
+            validating = false;
+
+            if (val_sfens.size() == 0)
+            {
+                std::cout << "error! val_sfens is empty." << std::endl;
+                return 0.0;
+            }
+
+            ValidationStats s;
+
+            for (auto& c : val_chunks)
+                s.add(c);
+
+            // rmseとmean_errorは以前からの値と比べられるように、除外した局面も含めた局面数で割る。
+            auto rmse = std::sqrt(s.sum_grad2 / val_sfens.size());
+            auto ame = s.sum_error / val_sfens.size();
+            std::cout << std::endl << "rmse = " << rmse << " , mean_error = " << ame
+                      << " , cross_entropy = " << s.sum_cross_entropy / std::max(s.count, (uint64_t)1)
+                      << " , move_match = ";
+
+            if (s.move_total)
+                std::cout << 100.0 * s.move_match / s.move_total << "%";
+            else
+                std::cout << "n/a";
+
+            std::cout << " (" << val_sfens.size() << " sfens , " << val_end - val_start << "ms)" << std::endl;
+            return rmse;
+        }
+
+        // 学習器の実装を変えたときに結果が変わっていないかを確かめるためのもの。
+        // loss_logを指定するとmini batchごとのrmseをファイルに書き出し、validateを指定すると
+        // 以前に書き出したrmseと比べる。同じ教師データ、同じmini batchサイズ、1スレッドで比べること。
+        std::ofstream loss_log;
+        std::vector<double> loss_reference;
+        double loss_diff_max, loss_diff_sum;
+
+        void recordLoss(double rmse)
+        {
+
+            if (loss_log)
+                loss_log << epoch << " " << std::setprecision(10) << rmse << std::endl;
+
+            if (epoch <= loss_reference.size())
+            {
+                auto diff = rmse - loss_reference[epoch - 1];
+                loss_diff_max = std::max(loss_diff_max, std::abs(diff));
+                loss_diff_sum += std::abs(diff);
+                std::cout << "reference rmse = " << loss_reference[epoch - 1] << " , diff = " << diff << std::endl;
+            }
+        }
+
+        bool recordingLoss() { return loss_log.is_open() || !loss_reference.empty(); }
+
+        // 決定的に学習するときに、メインスレッドがまとめて読み出した1 mini batch分の局面
+        std::vector<PackedSfenValue> batch;
+
+        // mini batchの区切りで進捗を表示する。
+        void printProgress(uint64_t read_count)
+        {
+            static uint64_t sfens_output_count = 0;
+
+            if ((sfens_output_count++ % LEARN_RMSE_OUTPUT_INTERVAL) == 0)
+            {
+                // 経過時間のうち、重みの更新に使った時間と、勾配計算が止まっていた時間の割合
+                auto elapsed = std::max(now() - learn_start, (TimePoint)1);
+                std::ostringstream ss;
+                ss << std::fixed << std::setprecision(1) << " (" << read_count * 1000 / elapsed << " sfens/s)"
+                   << " , update = " << 100.0 * update_time / elapsed
+                   << "% (" << update_time / std::max(epoch, (uint64_t)1) << "ms/batch) , stall = "
+                   << 100.0 * update_stall / elapsed << "%";
+#if defined EVAL_KPPT
+                if (Eval::compact_learner || Eval::deterministic_learner)
+                    ss << " , grad buffer = " << Eval::gradBufferBytes() / (1024 * 1024) << "MB";
+#endif
+                std::cout << std::endl << read_count << " sfens" << ss.str() << " , at " << localTime();
             }
+            else
+                std::cout << '.';
+        }
 
-            auto rmse = std::sqrt(sum_error / sfen_for_mse.size());
-            auto ame = sum_error2 / sfen_for_mse.size();
-            std::cout << std::endl << "rmse = " << rmse << " , mean_error = " << ame << std::endl;
+        void reportValidation()
+        {
+            auto rmse = finishValidation();
+
+            if (recordingLoss())
+                recordLoss(rmse);
+        }
+
+        // 重みを更新した後に、評価関数の保存とrmseの計算を行う。
+        void afterUpdate(Board& b, uint64_t read_count)
+        {
+            static uint64_t rmse_output_count = 0;
+            static uint64_t save_count = 0;
+
+            if (++save_count >= 100000000 / mini_batch_size)
+            {
+                waitUpdate();
+                save_count = 0;
+                Eval::GlobalEvaluater->save(std::to_string(read_count / (uint64_t)EVAL_FILE_NAME_CHANGE_INTERVAL));
+            }
+
+            if (recordingLoss() || (rmse_output_count++ % LEARN_RMSE_OUTPUT_INTERVAL) == 0)
+            {
+                waitUpdate();
+                startValidation();
+
+                // 決定的に学習するときは、次のmini batchの前に全スレッドで手分けして計算し、その次の区切りで表示する。
+                if (!deterministic)
+                {
+                    helpValidate(b, 0, Threads.size());
+
+                    while (val_done < val_chunks.size())
+                        std::this_thread::yield();
+
+                    reportValidation();
+                }
+            }
         }
 
         struct LearnThread : public WorkerThread
         {
             virtual void search()
+            {
+                if (deterministic)
+                    searchDeterministic();
+                else
+                    searchShared();
+
+                if (isMain())
+                {
+                    waitUpdate();
+
+                    if (use_stream)
+                        sr.finalizeReader();
+                    else
+                        mr.close();
+
+                    if (!loss_reference.empty())
+                    {
+                        auto n = std::min(epoch, (uint64_t)loss_reference.size());
+                        SYNC_COUT << "validate : " << n << " batches , max diff = " << loss_diff_max
+                                  << " , mean diff = " << loss_diff_sum / std::max(n, (uint64_t)1) << SYNC_ENDL;
+                    }
+
+                    loss_log.close();
+                    Eval::GlobalEvaluater->save("finish");
+                    SYNC_COUT << "learn end" << SYNC_ENDL;
+                }
+            }
+
+            // 各スレッドがsfenを読み出しながら、共有の勾配配列に加算していく。
+            void searchShared()
             {
                 Board& b = root_board;
                 uint64_t next_update_weights = mini_batch_size;
 
                 while (!Threads.stop)
                 {
-                    if (isMain() && next_update_weights <= sr.readCount())
+                    if (isMain() && next_update_weights <= readCount())
                     {
-                        static uint64_t sfens_output_count = 0;
-                        static uint64_t rmse_output_count = 0;
-                        static uint64_t save_count = 0;
-                        uint64_t read_count = sr.readCount();
-
-                        if ((sfens_output_count++ % LEARN_RMSE_OUTPUT_INTERVAL) == 0)
-                            std::cout << std::endl << read_count << " sfens , at " << localTime();
-                        else
-                            std::cout << '.';
-                        
+                        uint64_t read_count = readCount();
+                        printProgress(read_count);
+
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+                        // 前回の更新が終わってから勾配配列を入れ替え、さっきまでの勾配を裏で反映させる。
+                        // workerはその間も入れ替えた側の勾配配列に加算を続ける。
+                        waitUpdate();
+                        Eval::Weight::flipGrad();
+                        update_thread = std::thread(updateWeights);
+#else
+                        auto stall_start = now();
                         updating = true;
 
                         for (auto th : Threads.slaves)
                             th->join();
 
-                        Eval::updateWeights(++epoch);
+                        updateWeights();
 
                         updating = false;
 
                         for (auto t : Threads.slaves)
                             t->startSearching();
 
-                        if (++save_count >= 100000000 / mini_batch_size)
-                        {
-                            save_count = 0;
-                            Eval::GlobalEvaluater->save(std::to_string(read_count / (uint64_t)EVAL_FILE_NAME_CHANGE_INTERVAL));
-                        }
-
-                        if ((rmse_output_count++ % LEARN_RMSE_OUTPUT_INTERVAL) == 0)
-                            calcRmse(b);
-
+                        update_stall += now() - stall_start;
+#endif
+                        afterUpdate(b, read_count);
                         next_update_weights = std::max(read_count + mini_batch_size, read_count);
                     }
 
+                    // メインスレッドが損失を計算し始めたら手伝う。
+                    if (validationPending())
+                        helpValidate(b, idx, Threads.size());
+
                     // バッファからsfenを一つ受け取る。
                     PackedSfenValue ps;
 
-                    if (!sr.read(idx, ps))
+                    if (!readSfen(idx, ps))
                         break;
 
-                    // 深い探索の評価値
-                    auto deep_value = Score(ps.deep);
+                    learnSfen(ps);
+                }
+            }
 
-                    if ((deep_value >= EVAL_LIMIT && ps.win) || (deep_value <= -EVAL_LIMIT && !ps.win))
-                        continue;
+            // メインスレッドが1 mini batch分の局面をまとめて読み出し、各スレッドは番号で決まった範囲を受け持つ。
+            // 全スレッドが受け持ちを終えてから、スレッドの番号順に勾配を足し合わせて更新するので、
+            // スレッド数が同じなら何度やっても同じ結果になる。
+            void searchDeterministic()
+            {
+                Board& b = root_board;
 
-                    b.setFromPackedSfen(ps.data);
-                    auto root_turn = b.turn();
-                    auto r = Learn::qsearch(b);
-                    auto shallow_value = r.first;
-#if 0
-                    SYNC_COUT << b
-                        << "shallow = " << shallow_value
-                        << " deep = " << deep_value
-                        << " win = " << ps.win
-                        << " move = " << pretty(ps.m) << SYNC_ENDL;
+                // 置換表を共有すると、ほかのスレッドの書き込みで静止探索の結果が変わってしまうので、スレッドごとに持つ。
+                // 静止探索でしか使わないので小さくてよい。
+                tt = new TranspositionTable;
+                tt->resize(4);
+                tt->clear();
+                Eval::bindGradThread((int)idx);
+
+                while (true)
+                {
+                    if (isMain())
+                    {
+                        // 全スレッドが受け持ちを終えるのを待って、前のmini batchの分を反映させる。
+                        for (auto th : Threads.slaves)
+                            th->join();
+
+                        if (validating)
+                            reportValidation();
+
+                        if (batch.size())
+                        {
+                            auto read_count = readCount();
+                            printProgress(read_count);
+                            auto stall_start = now();
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+                            Eval::Weight::flipGrad();
 #endif
-                    // update中なので、addGradする前にメインスレッドがupdateを終えるのを待つ。
-                    while (updating)
+                            updateWeights();
+                            update_stall += now() - stall_start;
+                            afterUpdate(b, read_count);
+                        }
+
+                        batch.clear();
+                        PackedSfenValue ps;
+
+                        while (!Threads.stop && batch.size() < mini_batch_size && readSfen(0, ps))
+                            batch.push_back(ps);
+
+                        for (auto th : Threads.slaves)
+                            th->startSearching();
+                    }
+                    else
                     {
+                        // メインスレッドが次のmini batchを用意するのを待つ。
                         searching = false;
                         startSearching(true);
                         wait(searching);
                     }
 
-                    // 現在、leaf nodeで出現している特徴ベクトルに対する勾配(∂J/∂Wj)として、dj_dwを加算する。
-                    double dj_dw = calcGrad(deep_value, shallow_value, ps.win, Progress::evaluate(b));
+                    const size_t n = Threads.size();
 
-                    if (dj_dw == 0.0)
-                        continue;
+                    if (validating)
+                        helpValidate(b, idx, n);
 
-                    int ply = 0;
-                    StateInfo state[MAX_PLY];
-
-                    for (auto m : r.second)
-                        b.doMove(m, state[ply++]);
+                    if (batch.empty())
+                        break;
 
-                    Eval::addGrad(b, root_turn, dj_dw);
+                    for (size_t i = batch.size() * idx / n; i < batch.size() * (idx + 1) / n; i++)
+                        learnSfen(batch[i]);
                 }
 
+                // 最後のmini batchの後に計算した損失を表示する。
                 if (isMain())
                 {
-                    sr.finalizeReader();
-                    Eval::GlobalEvaluater->save("finish");
-                    SYNC_COUT << "learn end" << SYNC_ENDL;
+                    for (auto th : Threads.slaves)
+                        th->join();
+
+                    if (validating)
+                        reportValidation();
+                }
+
+                delete tt;
+                tt = &GlobalTT;
+            }
+
+            // 1局面分の勾配を加算する。
+            void learnSfen(PackedSfenValue& ps)
+            {
+                Board& b = root_board;
+
+                // 深い探索の評価値
+                auto deep_value = Score(ps.deep);
+
+                if ((deep_value >= EVAL_LIMIT && ps.win) || (deep_value <= -EVAL_LIMIT && !ps.win))
+                    return;
+
+                b.setFromPackedSfen(ps.data);
+                auto root_turn = b.turn();
+                auto r = Learn::qsearch(b);
+                auto shallow_value = r.first;
+#if 0
+                SYNC_COUT << b
+                    << "shallow = " << shallow_value
+                    << " deep = " << deep_value
+                    << " win = " << ps.win
+                    << " move = " << pretty(ps.m) << SYNC_ENDL;
+#endif
+                // update中なので、addGradする前にメインスレッドがupdateを終えるのを待つ。
+                while (updating)
+                {
+                    searching = false;
+                    startSearching(true);
+                    wait(searching);
                 }
+
+                // 現在、leaf nodeで出現している特徴ベクトルに対する勾配(∂J/∂Wj)として、dj_dwを加算する。
+                double dj_dw = calcGrad(deep_value, shallow_value, ps.win, Progress::evaluate(b));
+
+                if (dj_dw == 0.0)
+                    return;
+
+                int ply = 0;
+                StateInfo state[MAX_PLY];
+
+                for (auto m : r.second)
+                    b.doMove(m, state[ply++]);
+
+                Eval::addGrad(b, root_turn, dj_dw);
             }
         };
     } // namespace LearnSpace
@@ -251,6 +599,22 @@ namespace Learn
         int mini_batch_size = 1000000;
         int loop = 100;
 
+        // 前回のlearnで指定したオプションが残らないように、学習のモードをすべて既定値に戻す。
+#if defined EVAL_KPPT
+        Eval::compact_learner = false;
+        Eval::deterministic_learner = false;
+#endif
+        LearnSpace::deterministic = false;
+        LearnSpace::use_stream = false;
+        LearnSpace::val_file = "";
+        LearnSpace::val_size = 10000;
+        LearnSpace::loss_reference.clear();
+
+        if (LearnSpace::loss_log.is_open())
+            LearnSpace::loss_log.close();
+
+        LearnSpace::loss_log.clear();
+
         while (true)
         {
             std::string option;
@@ -262,6 +626,44 @@ namespace Learn
                 is >> mini_batch_size;
             else if (option == "loop")
                 is >> loop;
+#if defined EVAL_KPPT
+            else if (option == "compact")
+                Eval::compact_learner = true;
+            else if (option == "deterministic")
+            {
+                Eval::deterministic_learner = true;
+                LearnSpace::deterministic = true;
+            }
+#endif
+            else if (option == "stream")
+                LearnSpace::use_stream = true;
+            else if (option == "val_file")
+                is >> LearnSpace::val_file;
+            else if (option == "val_size")
+                is >> LearnSpace::val_size;
+            else if (option == "loss_log")
+            {
+                std::string file;
+                is >> file;
+                LearnSpace::loss_log.open(file);
+            }
+            else if (option == "validate")
+            {
+                std::string file;
+                is >> file;
+                std::ifstream ifs(file);
+                uint64_t e;
+                double rmse;
+
+                while (ifs >> e >> rmse)
+                    LearnSpace::loss_reference.push_back(rmse);
+
+                if (LearnSpace::loss_reference.empty())
+                {
+                    std::cout << "Error! can't read " << file << std::endl;
+                    return;
+                }
+            }
             else
                 filenames.push_back(option);
         }
@@ -282,6 +684,7 @@ namespace Learn
         std::cout << "\nLoss Function   : " << "cross entoropy";
         std::cout << "\nmini-batch size : " << mini_batch_size;
         std::cout << "\neta             : " << Eval::Weight::eta;
+        std::cout << "\ndeterministic   : " << LearnSpace::deterministic;
         std::cout << "\ninit..";
 
         // 評価関数パラメーターの読み込み
@@ -289,18 +692,35 @@ namespace Learn
 
         // 評価関数パラメーターの勾配配列の初期化
         Eval::initGrad();
+        Eval::Weight::update_thread_num = thread_num;
 
-        // 局面ファイルをバックグラウンドで読み込むスレッドを起動
-        LearnSpace::sr.initReader(thread_num, files);
-        LearnSpace::sr.startReader();
+        if (LearnSpace::use_stream)
+        {
+            // 局面ファイルをバックグラウンドで読み込むスレッドを起動
+            LearnSpace::sr.initReader(thread_num, files);
+            LearnSpace::sr.startReader();
+        }
+        else if (!LearnSpace::mr.open(thread_num, filenames, loop))
+        {
+            std::cout << "Error! no sfens to read." << std::endl;
+            return;
+        }
+        else
+            std::cout << "reader          : mmap , " << LearnSpace::mr.size() << " sfens x " << loop << std::endl;
         LearnSpace::mini_batch_size = mini_batch_size;
 
-        // mse計算用にデータ1万件ほど取得しておく。
+        // 損失の計算に使う局面を取得しておく。
         if (!LearnSpace::initMse())
             return;
 
+        std::cout << "validation      : " << (LearnSpace::val_file != "" ? LearnSpace::val_file : "head of train")
+                  << " , " << LearnSpace::val_sfens.size() << " sfens" << std::endl;
+
         std::cout << "init done." << std::endl;
 
+        LearnSpace::learn_start = now();
+        LearnSpace::update_time = LearnSpace::update_stall = 0;
+        LearnSpace::loss_diff_max = LearnSpace::loss_diff_sum = 0.0;
         Threads.startWorkers<LearnSpace::LearnThread>(thread_num);
     }
 
@@ -623,6 +1043,10 @@ namespace Learn
                                 SYNC_COUT << "rmse:" << std::sqrt(rmse / rmse_count) << " count:" << rmse_count << SYNC_ENDL;
                                 rmse = 0.0;
                                 rmse_count = 0;
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+                                // こちらは全スレッドを止めて更新するので、入れ替えてから直前までの勾配を反映させる。
+                                Eval::Weight::flipGrad();
+#endif
                                 Eval::updateWeights(++epoch);
                                 training_th->clear();
                                 gen_sfen = true;
@@ -721,6 +1145,47 @@ namespace Learn
         // sfenの書き出し器
         AsyncSfenRW sw;
 
+        // 教師生成時の1回の探索のノード数の目安。0なら深さ固定。
+        uint64_t search_nodes;
+
+        // 1時間あたりの生成局面数の目標。0なら目標なし。指定するとスレッドごとにノード数を調整する。
+        double target_pph;
+
+        // スレッドごとの統計を表示する間隔(秒)
+        int stats_interval;
+
+        // gensfenのスレッドごとの統計。メインスレッドが表示のために読むのでatomicにしておく。
+        struct GenStats
+        {
+            std::atomic<uint64_t> sfens, searches, nodes, depth, nodes_budget;
+        };
+
+        std::unique_ptr<GenStats[]> gen_stats;
+        TimePoint gen_start;
+
+        void printGenStats()
+        {
+            auto elapsed = std::max(now() - gen_start, (TimePoint)1);
+            uint64_t total = 0;
+            std::ostringstream ss;
+            ss << std::fixed << std::setprecision(1);
+
+            for (size_t i = 0; i < Threads.size(); i++)
+            {
+                auto& g = gen_stats[i];
+                auto searches = std::max(g.searches.load(), (uint64_t)1);
+                total += g.sfens;
+                ss << "\nthread " << i << " : " << g.sfens * 1000.0 / elapsed << " sfens/s , "
+                   << g.nodes / searches << " nodes/search , depth " << (double)g.depth / searches / ONE_PLY;
+
+                if (search_nodes)
+                    ss << " , budget " << g.nodes_budget << " nodes";
+            }
+
+            SYNC_COUT << ss.str() << "\ntotal : " << total << " sfens , "
+                      << (uint64_t)(total * 3600000.0 / elapsed) << " sfens/hour , at " << localTime() << SYNC_ENDL;
+        }
+
         struct GenSfenThread : public WorkerThread
         {
             virtual void search()
@@ -733,6 +1198,14 @@ namespace Learn
                 tt->resize(USI::Options["Hash"]);
                 tt->clear();
 
+                auto& stats = gen_stats[idx];
+                uint64_t nodes_budget = search_nodes;
+                stats.nodes_budget = nodes_budget;
+
+                // 目標に合わせてノード数を調整するときの、前回の調整からの時間と局面数
+                TimePoint adjust_start = now(), last_print = now();
+                uint64_t adjust_sfens = 0;
+
                 while (!Threads.stop)
                 {
                 LOOP_BEGIN:
@@ -753,8 +1226,12 @@ namespace Learn
                         if (multi_pv || ply >= move_count)
                         {
                             auto r = ply < move_count ? rand(multi_pv) + 1 : 1;
-                            auto pv_value1 = Learn::search(b, search_depth * ONE_PLY, r, multi_pv_range);
+                            auto start_nodes = nodes.load(std::memory_order_relaxed);
+                            auto pv_value1 = Learn::search(b, search_depth * ONE_PLY, r, multi_pv_range, nodes_budget);
                             psv[gameply].deep = pv_value1.first;
+                            stats.searches++;
+                            stats.nodes += nodes - start_nodes;
+                            stats.depth += std::min(root_depth, Depth(search_depth * ONE_PLY));
 
                             if (abs(psv[gameply].deep) >= SCORE_MATE_IN_MAX_PLY
                                 || psv[gameply].deep <= limit_score)
@@ -807,13 +1284,39 @@ namespace Learn
                         psv[i].win = t == winner;
                         sw.write(idx, psv[i]);
                     }
+
+                    stats.sfens += gameply;
+                    adjust_sfens += gameply;
+
+                    // 探索時間はノード数にほぼ比例するので、このスレッドの分担の目標との比でノード数を増減させる。
+                    // 1回で大きく動かしすぎないように、10秒以上たまってから半分～倍の範囲で調整する。
+                    if (target_pph > 0.0 && now() - adjust_start >= 10000)
+                    {
+                        double rate = adjust_sfens * 1000.0 / (now() - adjust_start);
+                        double target = target_pph / 3600.0 / Threads.size();
+                        double ratio = std::min(std::max(rate / target, 0.5), 2.0);
+                        nodes_budget = std::max((uint64_t)(nodes_budget * ratio), (uint64_t)1000);
+                        stats.nodes_budget = nodes_budget;
+                        adjust_start = now();
+                        adjust_sfens = 0;
+                    }
+
+                    if (isMain() && stats_interval > 0 && now() - last_print >= stats_interval * 1000)
+                    {
+                        printGenStats();
+                        last_print = now();
+                    }
                 }
 
                 sw.finalizeWriter(idx);
 
                 if (isMain())
                 {
+                    for (auto th : Threads.slaves)
+                        th->join();
+
                     sw.terminate();
+                    printGenStats();
                     SYNC_COUT << "gensfen end." << SYNC_ENDL;
                 }
 
@@ -920,6 +1423,10 @@ namespace Learn
         Threads.startWorkers<OnlineSpace::OnlineLearnThread>(thread_num);
     }
 
+    // gensfen [depth D] [nodes N] [pph P] [stats S] [max_records R] [loop L] [file F] [dir D] [thread T]
+    //         [multi_pv M] [multi_pv_range R] [limit_score S]
+    // nodesを指定すると深さではなくノード数で探索を打ち切り、pphを指定すると1時間あたりの生成局面数がそれに近づくように
+    // ノード数を調整する。S秒ごとにスレッドごとの統計を表示し、max_recordsを指定するとその局面数ごとにファイルを分ける。
     void genSfen(Board& b, std::istringstream& is)
     {
         int thread_num = USI::Options["Threads"];
@@ -928,6 +1435,11 @@ namespace Learn
         int multi_pv = 0;
         int multi_pv_range = 200;
         int limit_score = -2000;
+        uint64_t search_nodes = 0;
+        uint64_t max_records = 0;
+        double target_pph = 0.0;
+        int stats_interval = 60;
+        bool depth_given = false;
 
         std::string dir = "";
         std::string file_name = "generated_kifu_" + timeStamp() + ".bin";
@@ -941,7 +1453,18 @@ namespace Learn
             if (token == "")
                 break;
             else if (token == "depth")
+            {
                 is >> search_depth;
+                depth_given = true;
+            }
+            else if (token == "nodes")
+                is >> search_nodes;
+            else if (token == "pph")
+                is >> target_pph;
+            else if (token == "stats")
+                is >> stats_interval;
+            else if (token == "max_records")
+                is >> max_records;
             else if (token == "loop")
                 is >> loop_max;
             else if (token == "file")
@@ -964,11 +1487,22 @@ namespace Learn
             return;
         }
 
+        // 目標の生成速度はノード数を調整して合わせるので、ノード数の指定がなければ適当な値から始める。
+        if (target_pph > 0.0 && !search_nodes)
+            search_nodes = 100000;
+
+        // ノード数で探索を打ち切るときは、深さは上限としてだけ使う。
+        if (search_nodes && !depth_given)
+            search_depth = 32;
+
         const double P = 0.1 / 1000000.0;
         int move_count = multi_pv ? std::ceil(log(loop_max / (search_depth * P)) / log(multi_pv)) : 30;
         file_name = path(dir, file_name);
 
         std::cout << "\ndepth           : " << search_depth;
+        std::cout << "\nnodes           : " << search_nodes;
+        std::cout << "\ntarget          : " << target_pph << " sfens/hour";
+        std::cout << "\nmax records     : " << max_records;
         std::cout << "\nmultipv count   : " << move_count;
         std::cout << "\nmultipv         : " << multi_pv;
         std::cout << "\nmultipv range   : " << multi_pv_range;
@@ -985,7 +1519,12 @@ namespace Learn
         OnlineSpace::move_count = move_count;
         OnlineSpace::multi_pv_range = (Score)multi_pv_range;
         OnlineSpace::limit_score = (Score)limit_score;
-        OnlineSpace::sw.initWriter(thread_num, file_name);
+        OnlineSpace::search_nodes = search_nodes;
+        OnlineSpace::target_pph = target_pph;
+        OnlineSpace::stats_interval = stats_interval;
+        OnlineSpace::gen_stats.reset(new OnlineSpace::GenStats[thread_num]());
+        OnlineSpace::gen_start = now();
+        OnlineSpace::sw.initWriter(thread_num, file_name, max_records);
         OnlineSpace::sw.startWriter();
         OnlineSpace::GenSfenThread::reseed();
         std::cout << "init done." << std::endl;
@@ -1080,6 +1619,575 @@ namespace Learn
 
         SYNC_COUT << "sfen_count = " << sfen_count << " reverse = " << reverse_eval << " end" << SYNC_ENDL;
     }
+
+    // 教師局面のファイルを圧縮形式に変換する。
+    // compress_sfen 入力ファイル 出力ファイル
+    void compressSfen(std::istringstream& is)
+    {
+        std::string in, out;
+        is >> in >> out;
+        std::ifstream ifs(in, std::ios::binary);
+        std::ofstream ofs(out, std::ios::binary);
+
+        if (!ifs || !ofs)
+        {
+            std::cout << "Error! can't open " << (ifs ? out : in) << std::endl;
+            return;
+        }
+
+        const SfenCodec::FileHeader fh = { SfenCodec::MAGIC, SfenCodec::VERSION, SfenCodec::BLOCK_SFENS, 0 };
+        ofs.write((const char*)&fh, sizeof(fh));
+
+        SfenVector sfens(SfenCodec::BLOCK_SFENS), check(SfenCodec::BLOCK_SFENS);
+        std::vector<uint8_t> packed;
+        uint64_t sfen_count = 0, out_bytes = sizeof(fh);
+        TimePoint encode_time = 0, decode_time = 0;
+
+        while (true)
+        {
+            ifs.read((char*)sfens.data(), sizeof(PackedSfenValue) * sfens.size());
+            const auto n = uint32_t(ifs.gcount() / sizeof(PackedSfenValue));
+
+            if (n == 0)
+                break;
+
+            packed.clear();
+            auto start = now();
+            SfenCodec::encode(sfens.data(), n, packed);
+            encode_time += now() - start;
+
+            // 元に戻ることを確かめる。詰め物のbyteは保存しないので比べない。
+            start = now();
+            const auto body = packed.data() + sizeof(SfenCodec::BlockHeader);
+
+            if (!SfenCodec::decode(body, packed.size() - sizeof(SfenCodec::BlockHeader), n, check.data()))
+            {
+                std::cout << "Error! decode failed." << std::endl;
+                return;
+            }
+
+            decode_time += now() - start;
+
+            for (uint32_t i = 0; i < n; i++)
+                if (memcmp(sfens[i].data, check[i].data, sizeof(sfens[i].data))
+                    || sfens[i].deep != check[i].deep || sfens[i].win != check[i].win || sfens[i].m != check[i].m)
+                {
+                    std::cout << "Error! mismatch at " << sfen_count + i << std::endl;
+                    return;
+                }
+
+            ofs.write((const char*)packed.data(), packed.size());
+            sfen_count += n;
+            out_bytes += packed.size();
+
+            if ((sfen_count / SfenCodec::BLOCK_SFENS) % 100 == 0)
+                std::cout << '.';
+        }
+
+        const uint64_t in_bytes = sfen_count * sizeof(PackedSfenValue);
+        std::cout << std::endl << sfen_count << " sfens , " << in_bytes << " bytes -> " << out_bytes << " bytes"
+                  << " (ratio " << (double)in_bytes / std::max(out_bytes, (uint64_t)1)
+                  << " , " << (double)out_bytes / std::max(sfen_count, (uint64_t)1) << " bytes/sfen)"
+                  << std::endl << "encode " << sfen_count * 1000 / std::max(encode_time, (TimePoint)1) << " sfens/s"
+                  << " , decode " << sfen_count * 1000 / std::max(decode_time, (TimePoint)1) << " sfens/s" << std::endl;
+    }
+
+    // 圧縮形式のファイルを元の形式に戻す。
+    // decompress_sfen 入力ファイル 出力ファイル
+    void decompressSfen(std::istringstream& is)
+    {
+        std::string in, out;
+        is >> in >> out;
+        std::ifstream ifs(in, std::ios::binary);
+        std::ofstream ofs(out, std::ios::binary);
+        SfenCodec::FileHeader fh;
+
+        if (!ifs || !ofs || !ifs.read((char*)&fh, sizeof(fh)) || !SfenCodec::isCompressed(&fh, sizeof(fh)))
+        {
+            std::cout << "Error! can't open " << in << " as compressed sfen , or can't open " << out << std::endl;
+            return;
+        }
+
+        SfenVector sfens(fh.block_sfens);
+        std::vector<uint8_t> packed;
+        SfenCodec::BlockHeader h;
+        uint64_t sfen_count = 0;
+        TimePoint decode_time = 0;
+
+        while (ifs.read((char*)&h, sizeof(h)))
+        {
+            packed.resize(h.bytes);
+            auto start = now();
+
+            if (h.count == 0 || h.count > fh.block_sfens || !ifs.read((char*)packed.data(), h.bytes)
+                || !SfenCodec::decode(packed.data(), h.bytes, h.count, sfens.data()))
+            {
+                std::cout << "Error! broken block after " << sfen_count << " sfens." << std::endl;
+                break;
+            }
+
+            decode_time += now() - start;
+            ofs.write((const char*)sfens.data(), sizeof(PackedSfenValue) * h.count);
+            sfen_count += h.count;
+        }
+
+        std::cout << sfen_count << " sfens , decode " << sfen_count * 1000 / std::max(decode_time, (TimePoint)1)
+                  << " sfens/s" << std::endl;
+    }
+
+    // 教師局面の重複除去と絞り込みを行い、学習用と検証用に分けてシャッフルしたファイルに書き出す。
+    // メモリに載らない量でも扱えるように、入力はメモリマップで読み、出力はいったんシャードに振り分けてから
+    // シャードごとにメモリに読み込んでシャッフルする。
+    namespace SfenToolSpace
+    {
+        // 重複判定用のBloom filter。局面のハッシュキーからHASHES個のbitを立て、全部立っていたら既出とみなす。
+        // 一度見た局面は必ず既出と判定されるが、まれに初見の局面も既出と判定されて捨てられる。
+        struct BloomFilter
+        {
+            static const int HASHES = 4;
+
+            void init(size_t mb)
+            {
+                bit_count = size_t(1) << bsr64(std::max(mb, (size_t)1) * 1024 * 1024 * 8);
+                words.reset(new std::atomic<uint64_t>[bit_count / 64]());
+            }
+
+            // キーを追加して、すでに入っていたかを返す。複数のスレッドから同時に呼び出してよい。
+            bool testAndSet(Key key)
+            {
+                const uint64_t h1 = key;
+                const uint64_t h2 = ((key >> 32) | (key << 32)) * 0x9e3779b97f4a7c15ULL | 1;
+                bool found = true;
+
+                for (int i = 0; i < HASHES; i++)
+                {
+                    const uint64_t bit = (h1 + i * h2) & (bit_count - 1);
+                    const uint64_t mask = 1ULL << (bit & 63);
+
+                    if (!(words[bit / 64].fetch_or(mask, std::memory_order_relaxed) & mask))
+                        found = false;
+                }
+
+                return found;
+            }
+
+            // n個のキーを入れたときに、初見の局面を既出と判定してしまう確率
+            double falsePositiveRate(uint64_t n) const
+            {
+                return std::pow(1.0 - std::exp(-(double)HASHES * n / bit_count), HASHES);
+            }
+
+            size_t bit_count = 0;
+            std::unique_ptr<std::atomic<uint64_t>[]> words;
+        };
+
+        // 出力先のファイル。スレッドごとにためておいて、まとめて書き込む。
+        struct Shard
+        {
+            std::string name;
+            std::fstream fs;
+            Mutex mutex;
+            uint64_t count = 0;
+        };
+
+        const size_t SHARD_BUFFER_SIZE = 1024;
+
+        MappedSfenReader reader;
+        BloomFilter bloom;
+        std::vector<std::unique_ptr<Shard>> shards;
+
+        // 絞り込みの条件
+        bool dedup = true;
+        bool skip_check = false;
+        int eval_limit = 32000;
+        double min_progress = 0.0, max_progress = 1.0;
+        double val_rate = 0.0;
+
+        std::atomic<uint64_t> read_count, kept_count, dup_count, score_count, check_count, progress_count;
+        TimePoint start_time;
+
+        void flush(size_t i, SfenVector& buf)
+        {
+            if (buf.empty())
+                return;
+
+            auto& shard = *shards[i];
+            std::unique_lock<Mutex> lk(shard.mutex);
+            shard.fs.write((const char*)buf.data(), sizeof(PackedSfenValue) * buf.size());
+            shard.count += buf.size();
+            buf.clear();
+        }
+
+        // シャードを1つメモリに読み込んでシャッフルし、書き戻す。
+        void shuffle(size_t i, PRNG& prng)
+        {
+            auto& shard = *shards[i];
+            SfenVector v(shard.count);
+            shard.fs.seekg(0);
+            shard.fs.read((char*)v.data(), sizeof(PackedSfenValue) * v.size());
+
+            for (size_t j = 0, size = v.size(); j < size; ++j)
+                std::swap(v[j], v[prng.rand(size - j) + j]);
+
+            shard.fs.seekp(0);
+            shard.fs.write((const char*)v.data(), sizeof(PackedSfenValue) * v.size());
+            shard.fs.close();
+        }
+
+        void printStats()
+        {
+            std::cout << std::endl << "read " << read_count << " , kept " << kept_count
+                      << " , duplicated " << dup_count << " , score " << score_count
+                      << " , in check " << check_count << " , progress " << progress_count
+                      << " (" << read_count * 1000 / std::max(now() - start_time, (TimePoint)1) << " sfens/s)" << std::endl;
+        }
+
+        struct SfenToolThread : public WorkerThread
+        {
+            virtual void search()
+            {
+                Board& b = root_board;
+                PRNG prng(20170101 + idx);
+                std::vector<SfenVector> buf(shards.size());
+                const size_t train_shards = shards.size() - 1;
+                const bool check_progress = min_progress > 0.0 || max_progress < 1.0;
+                PackedSfenValue ps;
+
+                while (!Threads.stop && reader.read(idx, ps))
+                {
+                    if ((++read_count % 1000000) == 0)
+                        std::cout << '.';
+
+                    if (abs(ps.deep) > eval_limit)
+                    {
+                        ++score_count;
+                        continue;
+                    }
+
+                    b.setFromPackedSfen(ps.data);
+
+                    if (skip_check && b.inCheck())
+                    {
+                        ++check_count;
+                        continue;
+                    }
+
+                    if (check_progress)
+                    {
+                        auto p = Progress::evaluate(b);
+
+                        if (p < min_progress || p > max_progress)
+                        {
+                            ++progress_count;
+                            continue;
+                        }
+                    }
+
+                    if (dedup && bloom.testAndSet(b.key()))
+                    {
+                        ++dup_count;
+                        continue;
+                    }
+
+                    // 最後のシャードが検証用
+                    auto i = prng.rand(1000000) < val_rate * 1000000 ? train_shards : prng.rand(train_shards);
+                    buf[i].push_back(ps);
+                    ++kept_count;
+
+                    if (buf[i].size() >= SHARD_BUFFER_SIZE)
+                        flush(i, buf[i]);
+                }
+
+                for (size_t i = 0; i < buf.size(); i++)
+                    flush(i, buf[i]);
+
+                // 全スレッドが書き終えてから、スレッドごとにシャードを受け持ってシャッフルする。
+                // シャッフル中は、スレッドごとにシャード1つ分のメモリを使う。
+                if (isMain())
+                {
+                    for (auto th : Threads.slaves)
+                        th->join();
+
+                    printStats();
+
+                    for (auto& shard : shards)
+                        shard->fs.flush();
+
+                    for (auto th : Threads.slaves)
+                        th->startSearching();
+                }
+                else
+                {
+                    searching = false;
+                    startSearching(true);
+                    wait(searching);
+                }
+
+                for (size_t i = idx; i < shards.size(); i += Threads.size())
+                    shuffle(i, prng);
+
+                if (isMain())
+                {
+                    for (auto th : Threads.slaves)
+                        th->join();
+
+                    for (auto& shard : shards)
+                        std::cout << shard->name << " : " << shard->count << " sfens" << std::endl;
+
+                    // フィルタに入れたのは重複と判定されずに残した局面だけなので、その数で見積もる。
+                    if (dedup)
+                        std::cout << "estimated false positive rate of dedup : " << bloom.falsePositiveRate(kept_count) << std::endl;
+
+                    reader.close();
+                    shards.clear();
+                    SYNC_COUT << "sfen_tool end" << SYNC_ENDL;
+                }
+            }
+        };
+    } // namespace SfenToolSpace
+
+    // sfen_tool 入力ファイル... [output 出力名] [shards N] [val_rate R] [eval_limit E]
+    //           [min_progress P] [max_progress P] [skip_check] [no_dedup] [bloom_mb M]
+    void sfenTool(Board& b, std::istringstream& is)
+    {
+        using namespace SfenToolSpace;
+        auto thread_num = (int)USI::Options["Threads"];
+        std::vector<std::string> filenames;
+        std::string output = "sfen_tool" + timeStamp();
+        int shard_num = 16;
+        size_t bloom_mb = 1024;
+        dedup = true;
+        skip_check = false;
+        eval_limit = 32000;
+        min_progress = 0.0;
+        max_progress = 1.0;
+        val_rate = 0.0;
+
+        while (true)
+        {
+            std::string option;
+            is >> option;
+
+            if (option == "")
+                break;
+            else if (option == "output")
+                is >> output;
+            else if (option == "shards")
+                is >> shard_num;
+            else if (option == "val_rate")
+                is >> val_rate;
+            else if (option == "eval_limit")
+                is >> eval_limit;
+            else if (option == "min_progress")
+                is >> min_progress;
+            else if (option == "max_progress")
+                is >> max_progress;
+            else if (option == "skip_check")
+                skip_check = true;
+            else if (option == "no_dedup")
+                dedup = false;
+            else if (option == "bloom_mb")
+                is >> bloom_mb;
+            else
+                filenames.push_back(option);
+        }
+
+        // 進行度を使うので評価関数などを読み込んでおく。
+        USI::isready();
+
+        if (!reader.open(thread_num, filenames, 1))
+        {
+            std::cout << "Error! no sfens to read." << std::endl;
+            return;
+        }
+
+        shards.clear();
+        shard_num = std::max(shard_num, 1);
+
+        for (int i = 0; i <= shard_num; i++)
+        {
+            shards.emplace_back(new Shard);
+            auto& shard = *shards.back();
+            shard.name = i < shard_num ? output + "_train_" + std::to_string(i) + ".bin" : output + "_val.bin";
+            shard.fs.open(shard.name, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+
+            if (!shard.fs)
+            {
+                std::cout << "Error! can't open " << shard.name << std::endl;
+                shards.clear();
+                return;
+            }
+        }
+
+        if (dedup)
+            bloom.init(bloom_mb);
+
+        read_count = kept_count = dup_count = score_count = check_count = progress_count = 0;
+        start_time = now();
+
+        std::cout << "sfen_tool : " << reader.size() << " sfens , " << shard_num << " shards , val_rate " << val_rate
+                  << " , eval_limit " << eval_limit << " , progress [" << min_progress << " , " << max_progress << "]"
+                  << " , skip_check " << skip_check << " , dedup " << dedup;
+
+        if (dedup)
+            std::cout << " (bloom filter " << bloom.bit_count / (8 * 1024 * 1024) << "MB)";
+
+        std::cout << std::endl;
+        Threads.startWorkers<SfenToolThread>(thread_num);
+    }
+    // 学習の1局面あたりの処理(局面の復元、静止探索、勾配の加算)の速度をスレッドごとに測る。
+    namespace BenchLearnSpace
+    {
+        std::vector<PackedSfenValue> sfens;
+
+        // スレッドごとの局面数と、処理ごとにかかった時間(ns)
+        struct BenchStats
+        {
+            uint64_t count = 0, unpack = 0, qsearch = 0, add_grad = 0, elapsed = 0;
+        };
+
+        std::vector<BenchStats> stats;
+
+        // compactを指定して測ったあと、学習のモードを元に戻すために呼び出し前の値を覚えておく。
+        bool saved_compact = false;
+
+        // 前回呼び出したときからの経過時間(ns)を返す。
+        uint64_t lap(std::chrono::steady_clock::time_point& t)
+        {
+            auto n = std::chrono::steady_clock::now();
+            auto d = std::chrono::duration_cast<std::chrono::nanoseconds>(n - t).count();
+            t = n;
+            return d;
+        }
+
+        void printStats(const std::string& name, const BenchStats& s)
+        {
+            auto c = std::max(s.count, (uint64_t)1);
+            std::cout << name << " : " << s.count << " sfens , " << s.count * 1000000000 / std::max(s.elapsed, (uint64_t)1)
+                      << " sfens/s (unpack " << s.unpack / c << "ns , qsearch " << s.qsearch / c
+                      << "ns , addGrad " << s.add_grad / c << "ns per sfen)" << std::endl;
+        }
+
+        struct BenchLearnThread : public WorkerThread
+        {
+            virtual void search()
+            {
+                Board& b = root_board;
+                const size_t n = Threads.size();
+                BenchStats s;
+                auto start = std::chrono::steady_clock::now();
+                auto t = start;
+
+                for (size_t i = sfens.size() * idx / n; i < sfens.size() * (idx + 1) / n; i++)
+                {
+                    auto& ps = sfens[i];
+                    b.setFromPackedSfen(ps.data);
+                    s.unpack += lap(t);
+
+                    auto root_turn = b.turn();
+                    auto r = Learn::qsearch(b);
+                    double dj_dw = calcGrad(Score(ps.deep), r.first, ps.win, Progress::evaluate(b));
+                    s.qsearch += lap(t);
+
+                    int ply = 0;
+                    StateInfo state[MAX_PLY];
+
+                    for (auto m : r.second)
+                        b.doMove(m, state[ply++]);
+
+                    Eval::addGrad(b, root_turn, dj_dw);
+                    s.add_grad += lap(t);
+                    s.count++;
+                }
+
+                s.elapsed = lap(start);
+                stats[idx] = s;
+
+                if (isMain())
+                {
+                    for (auto th : Threads.slaves)
+                        th->join();
+
+                    // 全体の速度は、一番遅かったスレッドの時間で割る。
+                    BenchStats total;
+
+                    for (size_t i = 0; i < stats.size(); i++)
+                    {
+                        printStats("thread " + std::to_string(i), stats[i]);
+                        total.count += stats[i].count;
+                        total.unpack += stats[i].unpack;
+                        total.qsearch += stats[i].qsearch;
+                        total.add_grad += stats[i].add_grad;
+                        total.elapsed = std::max(total.elapsed, stats[i].elapsed);
+                    }
+
+                    printStats("total", total);
+                    sfens.clear();
+#if defined EVAL_KPPT
+                    Eval::compact_learner = saved_compact;
+#endif
+                    SYNC_COUT << "bench_learn end" << SYNC_ENDL;
+                }
+            }
+        };
+    } // namespace BenchLearnSpace
+
+    // bench_learn 入力ファイル [count N] [compact]
+    void benchLearn(Board& b, std::istringstream& is)
+    {
+        using namespace BenchLearnSpace;
+        auto thread_num = (int)USI::Options["Threads"];
+        std::string file;
+        uint64_t count = 100000;
+#if defined EVAL_KPPT
+        saved_compact = Eval::compact_learner;
+        Eval::compact_learner = false;
+#endif
+
+        while (true)
+        {
+            std::string option;
+            is >> option;
+
+            if (option == "")
+                break;
+            else if (option == "count")
+                is >> count;
+#if defined EVAL_KPPT
+            else if (option == "compact")
+                Eval::compact_learner = true;
+#endif
+            else
+                file = option;
+        }
+
+        USI::isready();
+        MappedSfenReader reader;
+
+        if (!reader.open(1, { file }, 1))
+        {
+#if defined EVAL_KPPT
+            Eval::compact_learner = saved_compact;
+#endif
+            std::cout << "Error! can't read " << file << std::endl;
+            return;
+        }
+
+        // 学習と同じく、勾配を計算しない局面は除いておく。
+        sfens.clear();
+        PackedSfenValue ps;
+
+        while (sfens.size() < count && reader.read(0, ps))
+            if (!((ps.deep >= EVAL_LIMIT && ps.win) || (ps.deep <= -EVAL_LIMIT && !ps.win)))
+                sfens.push_back(ps);
+
+        reader.close();
+        Eval::initGrad();
+        stats.assign(thread_num, BenchStats());
+        std::cout << std::endl << "bench_learn : " << sfens.size() << " sfens , " << thread_num << " threads" << std::endl;
+        Threads.startWorkers<BenchLearnThread>(thread_num);
+    }
+
 #ifdef EVAL_KPPT
     // 評価関数をブレンドする。
     void blend(Board& b, std::istringstream& is)
@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #pragma once
+#include <atomic>
 #include <cmath>
 
 #include "config.h"
@@ -43,6 +44,17 @@ namespace Learn
 
 #define WEIGHTTYPE_FLOAT
 
+// 勾配配列を二重化し、重みの更新をバックグラウンドで行う。
+// workerは更新中も裏側の勾配配列に加算を続けるので、mini batchごとに全スレッドが止まらなくて済む。
+// その代わり、勾配配列ひとつ分メモリを多く使う。
+#if defined EVAL_KPPT
+//#define USE_DOUBLE_BUFFERED_GRAD
+
+// 勾配が加算されたパラメーターをスレッドごとにビット列で覚えておき、updateWeightsではそこだけを更新する。
+// 1 mini batchで勾配が加算されるのはパラメーター全体のごく一部なので、全体を舐めるより速い。
+#define USE_SPARSE_GRAD
+#endif
+
 // 一度に学習させるパラメータの個数
 const int PARAMS_CNT = 8;
 
@@ -79,6 +91,22 @@ namespace Eval
     void addGrad(Board& b, Turn root_turn, double delta_grad);
     void updateWeights(uint64_t epoch);
 
+#if defined EVAL_KPPT
+    // 省メモリ版の学習器を使うかどうか。initGradを呼ぶ前に設定する。
+    // 重みの端数とg2だけをパラメーターごとに持ち、勾配はスレッドごとの疎なバッファに置く。
+    extern bool compact_learner;
+
+    // float版の学習器でも、勾配を共有の勾配配列ではなくスレッドごとのバッファに置き、
+    // 更新時にスレッドの番号順に足し合わせる。書き込みが衝突して勾配が失われることがなく、結果が再現する。
+    extern bool deterministic_learner;
+
+    // 呼び出したスレッドが勾配を足し合わせるときの順番を設定する。
+    void bindGradThread(int id);
+
+    // スレッドごとの勾配バッファが確保しているメモリの合計(byte)
+    size_t gradBufferBytes();
+#endif
+
 #if defined EVAL_PPTP
     struct WeightValue
     {
@@ -175,8 +203,22 @@ namespace Eval
         static LearnFloatType eta;
         static int skip_count;
 
+        // updateWeightsを何スレッドで行うか。
+        static int update_thread_num;
+
         WeightValue g2;
 
+#ifdef USE_DOUBLE_BUFFERED_GRAD
+        // g_back : 重みの更新中にworkerが勾配を加算していく裏側の勾配配列
+        WeightValue g_back;
+
+        // addGradでどちら側の勾配配列に加算するか。0ならg、1ならg_back。
+        static std::atomic_int grad_side;
+
+        // 加算先の勾配配列を入れ替える。入れ替えた後、updateWeightsは表に出ていない側を反映させる。
+        static void flipGrad() { grad_side = grad_side ^ 1; }
+#endif
+
         void addGrad(WeightValue& delta);
         bool update(bool skip_update);
     };
@@ -23,6 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "tt.h"
 #include "usi.h"
+#include "mate.h"
 #include "thread.h"
 
 // bitboardのセッティング
@@ -40,9 +41,15 @@ int main(int argc, char** argv)
     Zobrist::init();    
     USI::Options.init();
     Threads.init();
+#ifdef USE_DFPN
+    Mate::init();
+#endif
     GlobalTT.resize(USI::Options["Hash"]);
     Search::init();
     USI::loop(argc, argv);
+#ifdef USE_DFPN
+    Mate::exit();
+#endif
     Threads.exit();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,551 @@
+﻿/*
+読み太（yomita）, a USI shogi (Japanese chess) playing engine derived from
+Stockfish 7 & YaneuraOu mid 2016 V3.57
+Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Motohiro Isozaki(YaneuraOu author)
+Copyright (C) 2016-2017 Ryuzo Tukamoto
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "mate.h"
+
+#ifdef USE_DFPN
+
+#include "usi.h"
+#include "trace.h"
+#include "thread.h"
+
+namespace Mate
+{
+    void DfpnTable::resize(size_t mb_size)
+    {
+        size_t new_cluster_count = size_t(1) << bsr64((mb_size * 1024 * 1024) / sizeof(Cluster));
+
+        if (new_cluster_count == cluster_count_)
+            return;
+
+        cluster_count_ = new_cluster_count;
+        free(mem_);
+        mem_ = calloc(cluster_count_ * sizeof(Cluster) + CACHE_LINE_SIZE - 1, 1);
+
+        if (!mem_)
+        {
+            std::cerr << "Failed to allocate " << mb_size << "MB for mate table." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        table_ = (Cluster*)((uintptr_t(mem_) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+    }
+
+    void DfpnTable::clear()
+    {
+        memset(table_, 0, cluster_count_ * sizeof(Cluster));
+        generation8_ = 0;
+    }
+
+    const DfpnEntry* DfpnTable::find(Key key) const
+    {
+        const DfpnEntry* tte = firstEntry(key);
+        const uint32_t key32 = key >> 32;
+
+        // 詰みの証明は千日手の扱いに左右されないので、以前の探索のものでも使える。
+        for (int i = 0; i < CLUSTER_SIZE; ++i)
+            if (tte[i].key32 == key32)
+                return (tte[i].generation8 == generation8_ || tte[i].pn == 0) ? &tte[i] : nullptr;
+
+        return nullptr;
+    }
+
+    void DfpnTable::store(Key key, uint32_t pn, uint32_t dn, uint16_t mate_len, uint64_t searched)
+    {
+        DfpnEntry* tte = firstEntry(key);
+        const uint32_t key32 = key >> 32;
+
+        // 置き換えの優先度。空 < 以前の探索の証明されていないもの < 今回の探索のもの(探索量の少ない順) < 詰みの証明
+        auto worth = [&](const DfpnEntry& e)
+        {
+            return !e.key32 ? 0
+                : e.pn == 0 ? 512 + e.searched8
+                : e.generation8 != generation8_ ? 1
+                : 256 + e.searched8;
+        };
+
+        DfpnEntry* replace = tte;
+
+        for (int i = 0; i < CLUSTER_SIZE; ++i)
+        {
+            if (tte[i].key32 == key32)
+            {
+                replace = &tte[i];
+                break;
+            }
+
+            if (worth(tte[i]) < worth(*replace))
+                replace = &tte[i];
+        }
+
+        replace->key32 = key32;
+        replace->pn = pn;
+        replace->dn = dn;
+        replace->mate_len = mate_len;
+        replace->generation8 = generation8_;
+        replace->searched8 = (uint8_t)bsr64(searched | 1);
+    }
+
+    bool Dfpn::checkStop()
+    {
+        if (!stopped && (nodes_ & 1023) == 0)
+            stopped = *stop_flag || (deadline && now() >= deadline);
+
+        return stopped;
+    }
+
+    // 証明数、反証数がしきい値thpn, thdnのどちらかに達するまで、bを根とする木を探索する。
+    // 結果は置換表に書き込む。
+    void Dfpn::mid(Board& b, uint32_t thpn, uint32_t thdn, int ply)
+    {
+        const Key key = tableKey(b.key());
+        const bool or_node = b.turn() == attacker;
+        const uint64_t nodes_start = nodes_++;
+
+        if (checkStop())
+            return;
+
+        // 1手詰めなら王手を生成するまでもない。
+        if (or_node && !b.inCheck() && b.mate1ply() != MOVE_NONE)
+        {
+            table.store(key, 0, PN_INFINITE, 1, 1);
+            return;
+        }
+
+        MoveStack* first = &move_buf[buf_used];
+        MoveStack* last = or_node ? generateCheckMoves(b, first) : generateLegalEvasions(b, first);
+
+        // 根の王手をスレッドで分け合う。
+        if (ply == 0 && split_count > 1)
+        {
+            MoveStack* it = first;
+
+            for (size_t i = 0; first + i != last; i++)
+                if (i % split_count == split_index)
+                    *it++ = first[i];
+
+            last = it;
+        }
+
+        const size_t n = last - first;
+        Key* keys = &key_buf[buf_used];
+
+        for (size_t i = 0; i < n; i++)
+            keys[i] = tableKey(b.afterKey(first[i]));
+
+        buf_used += n;
+        path[ply] = key;
+
+        // 子ノードの証明数、反証数を返す。手番側から見ると、このノードの証明数は子ノードの証明数の最小値、
+        // 反証数は子ノードの反証数の和になる。以下、phi, deltaは手番側から見た証明数、反証数を表す。
+        auto child = [&](size_t i, uint32_t& cpn, uint32_t& cdn, uint16_t& clen)
+        {
+            clen = 0;
+
+            // 手数の上限に達したか、王手の連続で同じ局面に戻るなら不詰み
+            if (ply + 1 >= MAX_MATE_PLY || std::find(path, path + ply + 1, keys[i]) != path + ply + 1)
+            {
+                cpn = PN_INFINITE;
+                cdn = 0;
+                return;
+            }
+
+            const DfpnEntry* e = table.find(keys[i]);
+
+            if (e)
+            {
+                cpn = e->pn;
+                cdn = e->dn;
+                clen = e->mate_len;
+            }
+            else
+                cpn = cdn = 1;
+        };
+
+        const uint32_t thphi = or_node ? thpn : thdn;
+        const uint32_t thdelta = or_node ? thdn : thpn;
+        uint32_t phi, delta;
+        uint16_t len;
+        StateInfo st;
+
+        while (true)
+        {
+            size_t best = 0;
+            uint32_t best_delta = 0, phi2 = PN_INFINITE;
+            int min_len = MAX_MATE_PLY, max_len = 0;
+            phi = PN_INFINITE;
+            delta = 0;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                uint32_t cpn, cdn;
+                uint16_t clen;
+                child(i, cpn, cdn, clen);
+
+                const uint32_t a = or_node ? cpn : cdn;
+                const uint32_t d = or_node ? cdn : cpn;
+
+                if (a < phi)
+                {
+                    phi2 = phi;
+                    phi = a;
+                    best = i;
+                    best_delta = d;
+                }
+                else if (a < phi2)
+                    phi2 = a;
+
+                delta = std::min(delta + d, PN_INFINITE);
+
+                if (cpn == 0)
+                {
+                    min_len = std::min(min_len, (int)clen);
+                    max_len = std::max(max_len, (int)clen);
+                }
+            }
+
+            if (phi == 0)
+                delta = PN_INFINITE;
+
+            else if (delta == 0)
+                phi = PN_INFINITE;
+
+            if (phi >= thphi || delta >= thdelta || stopped)
+            {
+                // 受け方に指し手がなければ、ここで詰んでいる。
+                len = (uint16_t)(or_node ? min_len + 1 : n ? max_len + 1 : 0);
+                break;
+            }
+
+            const uint32_t cth_a = std::min(thphi, phi2 + 1);
+            const uint32_t cth_d = std::min(thdelta - delta + best_delta, PN_INFINITE);
+
+            b.doMove(first[best], st);
+            mid(b, or_node ? cth_a : cth_d, or_node ? cth_d : cth_a, ply + 1);
+            b.undoMove(first[best]);
+        }
+
+        buf_used -= n;
+
+        if (!stopped)
+        {
+            const uint32_t pn = or_node ? phi : delta;
+            const uint32_t dn = or_node ? delta : phi;
+            table.store(key, pn, dn, pn == 0 ? len : 0, nodes_ - nodes_start);
+        }
+    }
+
+    // 置換表をたどって詰み手順を取り出す。攻め方は最短の、受け方は最長の手順を選ぶ。
+    // 途中の局面の証明が置換表から消えていたら、その局面を探索し直す。詰みの局面までたどれたらtrueを返す。
+    bool Dfpn::extractPv(Board& b, std::vector<Move>& pv, int ply, bool retry)
+    {
+        if (ply >= MAX_MATE_PLY || stopped)
+            return false;
+
+        const bool or_node = b.turn() == attacker;
+        Move best = MOVE_NONE;
+        path[ply] = tableKey(b.key());
+
+        if (or_node && !b.inCheck())
+            best = b.mate1ply();
+
+        if (best == MOVE_NONE)
+        {
+            MoveStack* first = &move_buf[buf_used];
+            MoveStack* last = or_node ? generateCheckMoves(b, first) : generateLegalEvasions(b, first);
+
+            // 受け方に指し手がなければ詰み
+            if (!or_node && first == last)
+                return true;
+
+            int best_len = or_node ? INT_MAX : -1;
+            bool complete = true;
+
+            for (MoveStack* it = first; it != last; ++it)
+            {
+                const Key k = tableKey(b.afterKey(*it));
+                const DfpnEntry* e = table.find(k);
+
+                if (std::find(path, path + ply + 1, k) != path + ply + 1 || !e || e->pn != 0)
+                {
+                    complete = false;
+                    continue;
+                }
+
+                if (or_node ? e->mate_len < best_len : e->mate_len > best_len)
+                {
+                    best_len = e->mate_len;
+                    best = *it;
+                }
+            }
+
+            // 受け方の応手はすべて詰んでいなければならない。
+            if (!or_node && !complete)
+                best = MOVE_NONE;
+        }
+
+        if (best == MOVE_NONE)
+        {
+            if (!retry)
+                return false;
+
+            mid(b, PN_INFINITE, PN_INFINITE, ply);
+            return extractPv(b, pv, ply, false);
+        }
+
+        StateInfo st;
+        pv.push_back(best);
+        b.doMove(best, st);
+        const bool mated = extractPv(b, pv, ply + 1);
+        b.undoMove(best);
+        return mated;
+    }
+
+    Dfpn::Result Dfpn::solve(Board& b, size_t split_index_, size_t split_count_, const std::atomic_bool& stop,
+                             TimePoint deadline_, std::vector<Move>& pv)
+    {
+        attacker = b.turn();
+        split_index = split_index_;
+        split_count = split_count_;
+        stop_flag = &stop;
+        deadline = deadline_;
+        nodes_ = 0;
+        buf_used = 0;
+        stopped = false;
+        pv.clear();
+        table.newSearch();
+
+        mid(b, PN_INFINITE, PN_INFINITE, 0);
+
+        const DfpnEntry* e = table.find(tableKey(b.key()));
+
+        if (!e || (e->pn != 0 && e->dn != 0))
+            return UNKNOWN;
+
+        if (e->dn == 0)
+            return NO_MATE;
+
+        // 根は分担した王手だけを調べているので、詰み手順を取り出すときはすべての王手を見る。
+        split_count = 1;
+
+        // 途中で止められて手順を取り出せなかった。
+        if (!extractPv(b, pv, 0))
+        {
+            pv.clear();
+            return UNKNOWN;
+        }
+
+        return MATE;
+    }
+
+    namespace
+    {
+        struct MateThread final : public Thread
+        {
+            virtual void search();
+
+            Dfpn dfpn;
+            Dfpn::Result result;
+            std::vector<Move> pv;
+            size_t split_index;
+        };
+
+        std::vector<MateThread*> MateThreads;
+
+        // 探索を始めたスレッドの数
+        size_t Started;
+
+        // 探索中のスレッドの数。0になったら"go mate"の結果を返す。
+        std::atomic<size_t> Running;
+
+        // "go mate"による探索中か。
+        bool GoMate;
+        TimePoint Deadline;
+
+        // go中の詰み探索を止めるフラグ。"go mate"ではThreads.stopで止める。
+        std::atomic_bool Stop;
+
+        Mutex ResultMutex;
+
+        // 見つかった詰み手順の中で最短のものを返す。
+        bool bestMate(std::vector<Move>& pv)
+        {
+            pv.clear();
+
+            for (size_t i = 0; i < Started; i++)
+                if (MateThreads[i]->result == Dfpn::MATE
+                    && (pv.empty() || MateThreads[i]->pv.size() < pv.size()))
+                    pv = MateThreads[i]->pv;
+
+            return !pv.empty();
+        }
+
+        void MateThread::search()
+        {
+            std::vector<Move> mate_pv;
+            Dfpn::Result r = dfpn.solve(root_board, split_index, Started, GoMate ? Threads.stop : Stop, Deadline, mate_pv);
+
+            std::unique_lock<Mutex> lk(ResultMutex);
+            result = r;
+            pv = mate_pv;
+
+            if (r == Dfpn::MATE)
+            {
+                Trace::record(Trace::MATE_SLOT, Trace::MATE_FOUND, int(mate_pv.size()));
+
+                // 他の詰み探索スレッドを止める。
+                if (GoMate)
+                    Threads.stop = true;
+                else
+                {
+                    Stop = true;
+
+                    // 通常の探索も止めて詰み手順を返す。ponder中ならponderhitで止まるようにし、検討中なら止めない。
+                    if (USI::Limits.ponder)
+                        Threads.stop_on_ponderhit = true;
+
+                    else if (!USI::Limits.infinite)
+                        Threads.stop = true;
+                }
+            }
+
+            if (GoMate && --Running == 0)
+            {
+                bool no_mate = true;
+
+                for (size_t i = 0; i < Started; i++)
+                    no_mate &= MateThreads[i]->result == Dfpn::NO_MATE;
+
+                std::vector<Move> best;
+                SYNC_COUT << "checkmate";
+
+                if (bestMate(best))
+                    for (auto m : best)
+                        std::cout << " " << toUSI(m);
+                else
+                    std::cout << (no_mate ? " nomate" : " timeout");
+
+                std::cout << SYNC_ENDL;
+
+                // 次のgoで、この結果を通常の探索の詰みとして扱わないようにする。
+                Started = 0;
+            }
+        }
+
+        void joinAll()
+        {
+            for (auto th : MateThreads)
+                th->join();
+        }
+
+        void start(const Board& b, size_t thread_num)
+        {
+            Started = thread_num;
+            Running = thread_num;
+
+            for (size_t i = 0; i < thread_num; i++)
+            {
+                MateThread* th = MateThreads[i];
+                th->setPosition(Board(b, th));
+                th->split_index = i;
+                th->result = Dfpn::UNKNOWN;
+                th->pv.clear();
+            }
+
+            for (size_t i = 0; i < thread_num; i++)
+                MateThreads[i]->startSearching();
+        }
+    } // namespace
+
+    void init()
+    {
+        readUsiOptions();
+    }
+
+    void exit()
+    {
+        Stop = true;
+        joinAll();
+
+        while (MateThreads.size())
+            delete MateThreads.back(), MateThreads.pop_back();
+    }
+
+    // MateThreadsが0でも"go mate"のために1スレッドは用意しておく。
+    void readUsiOptions()
+    {
+        const size_t requested = std::max((int)USI::Options["MateThreads"], 1);
+
+        joinAll();
+
+        while (MateThreads.size() < requested)
+            MateThreads.push_back(new MateThread());
+
+        while (MateThreads.size() > requested)
+            delete MateThreads.back(), MateThreads.pop_back();
+
+        for (auto th : MateThreads)
+            th->dfpn.resize(USI::Options["MateHash"]);
+    }
+
+    void clear()
+    {
+        joinAll();
+
+        for (auto th : MateThreads)
+            th->dfpn.clear();
+    }
+
+    void startThinking(const Board& b)
+    {
+        joinAll();
+        Stop = false;
+        GoMate = false;
+        Deadline = 0;
+        start(b, (int)USI::Options["MateThreads"]);
+    }
+
+    bool stopThinking(std::vector<Move>& pv)
+    {
+        Stop = true;
+        joinAll();
+
+        // 次のgoで探索しなかったときに、今回の結果を返さないようにする。
+        const bool found = bestMate(pv);
+        Started = 0;
+        return found;
+    }
+
+    void goMate(const Board& b, int time_limit)
+    {
+        Threads.main()->join();
+        joinAll();
+        Threads.stop = false;
+        GoMate = true;
+        Deadline = time_limit ? now() + time_limit : 0;
+        start(b, MateThreads.size());
+    }
+} // namespace Mate
+
+#endif
@@ -0,0 +1,148 @@
+﻿/*
+読み太（yomita）, a USI shogi (Japanese chess) playing engine derived from
+Stockfish 7 & YaneuraOu mid 2016 V3.57
+Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Motohiro Isozaki(YaneuraOu author)
+Copyright (C) 2016-2017 Ryuzo Tukamoto
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "config.h"
+
+#ifdef USE_DFPN
+
+#include <atomic>
+#include <vector>
+
+#include "move.h"
+#include "board.h"
+
+// df-pn(depth-first proof-number search)による詰み探索
+namespace Mate
+{
+    // 詰み探索で読む最大の手数
+    const int MAX_MATE_PLY = 256;
+
+    // 証明数、反証数の無限大。証明数が0なら詰み、反証数が0なら不詰みが証明されている。
+    const uint32_t PN_INFINITE = 100000000;
+
+    // 証明数、反証数は攻め方から見た値で持つ。
+    struct DfpnEntry
+    {
+        uint32_t key32;
+        uint32_t pn, dn;
+
+        // 詰みが証明されたときの、この局面からの詰み手数
+        uint16_t mate_len;
+
+        uint8_t generation8;
+
+        // この局面以下で探索したノード数のlog2。置き換えるときに小さいものから捨てる。
+        uint8_t searched8;
+    };
+
+    class DfpnTable
+    {
+        static const int CACHE_LINE_SIZE = 64;
+        static const int CLUSTER_SIZE = 4;
+
+        struct Cluster { DfpnEntry entry[CLUSTER_SIZE]; };
+
+        static_assert(sizeof(Cluster) == CACHE_LINE_SIZE, "Cluster size incorrect");
+
+    public:
+        ~DfpnTable() { free(mem_); }
+        void newSearch() { generation8_++; }
+        void resize(size_t mb_size);
+        void clear();
+
+        // keyの局面のエントリーを返す。以前の探索で書かれたエントリーは、詰みが証明されているものだけを返す。
+        const DfpnEntry* find(Key key) const;
+
+        // keyの局面の結果を書き込む。
+        void store(Key key, uint32_t pn, uint32_t dn, uint16_t mate_len, uint64_t searched);
+
+    private:
+        DfpnEntry* firstEntry(const Key key) const { return &table_[(size_t)key & (cluster_count_ - 1)].entry[0]; }
+
+        void* mem_ = nullptr;
+        Cluster* table_ = nullptr;
+        uint8_t generation8_ = 0;
+        size_t cluster_count_ = 0;
+    };
+
+    // 1つの局面に対する詰み探索。探索用のバッファを持つので、スレッドごとに用意する。
+    class Dfpn
+    {
+    public:
+        enum Result { MATE, NO_MATE, UNKNOWN };
+
+        Dfpn() : move_buf((MAX_MATE_PLY + 2) * MAX_MOVES), key_buf((MAX_MATE_PLY + 2) * MAX_MOVES) {}
+        void resize(size_t mb_size) { table.resize(mb_size); }
+        void clear() { table.clear(); }
+
+        // 局面bの手番側が相手玉を詰ませられるかを調べる。根の王手は、生成順でi % split_count == split_indexのものだけを調べる。
+        // 詰みならpvに詰み手順を入れてMATEを返す。stopがtrueになるか、deadline(0なら無制限)を過ぎると打ち切ってUNKNOWNを返す。
+        Result solve(Board& b, size_t split_index, size_t split_count, const std::atomic_bool& stop, TimePoint deadline,
+                     std::vector<Move>& pv);
+
+        uint64_t nodes() const { return nodes_; }
+
+    private:
+        void mid(Board& b, uint32_t thpn, uint32_t thdn, int ply);
+        bool extractPv(Board& b, std::vector<Move>& pv, int ply, bool retry = true);
+        Key tableKey(Key k) const { return attacker == BLACK ? k : k ^ 0x9e3779b97f4a7c15ULL; }
+        bool checkStop();
+
+        DfpnTable table;
+
+        // 各ノードの子ノードの指し手と、指した後の局面のハッシュキー。深さ優先なので、スタックのように使う。
+        std::vector<MoveStack> move_buf;
+        std::vector<Key> key_buf;
+        size_t buf_used;
+
+        // 根から現在のノードまでの局面のハッシュキー。千日手の検出に使う。
+        Key path[MAX_MATE_PLY + 1];
+
+        size_t split_index, split_count;
+        const std::atomic_bool* stop_flag;
+        TimePoint deadline;
+        Turn attacker;
+        uint64_t nodes_;
+        bool stopped;
+    };
+
+    // 詰み探索用のスレッドを用意する。
+    void init();
+    void exit();
+    void readUsiOptions();
+    void clear();
+
+    // go中に、詰み探索用のスレッドで局面bの詰みを探し始める。
+    void startThinking(const Board& b);
+
+    // 詰み探索用のスレッドを止め、終了を待つ。詰みが見つかっていればtrueを返し、pvに詰み手順を入れる。
+    bool stopThinking(std::vector<Move>& pv);
+
+    // "go mate"の処理。time_limit[ms]まで詰みを探し、"checkmate"で結果を返す。0なら時間無制限。
+    void goMate(const Board& b, int time_limit);
+} // namespace Mate
+
+#endif
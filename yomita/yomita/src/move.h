@@ -158,6 +158,16 @@ inline Turn turnOf(const Move m) { return Turn(!!(m & TURN_MASK)); }
 // NULLMOVEやNONEでないかの確認
 inline bool isOK(const Move m) { return m != MOVE_NONE && m != MOVE_NULL; }
 
+// 盤面を左右反転した局面での指し手を返す。駒の情報はそのまま。
+inline Move mirror(const Move m)
+{
+    if (!isOK(m))
+        return m;
+
+    const Move sq = toToMove(mirror(toSq(m))) | (isDrop(m) ? MOVE_NONE : fromToMove(mirror(fromSq(m))));
+    return Move(m & ~(TO_MASK | FROM_MASK)) | sq;
+}
+
 // USI変換用
 std::string toUSI(const Move m);
 std::string toCSA(const Move m);
@@ -230,6 +240,12 @@ inline Move* generate(Move* mlist, const Board& b)
 template <MoveType MT> MoveStack* generate(MoveStack* mlist, const Board& b);
 template <MoveType MT> MoveStack* generate(MoveStack* mlist, const Board& b, const Square to);
 
+// 詰み探索用。王手になる合法手を生成する。歩、角、飛の不成と、香の2段目への不成は生成しない。
+MoveStack* generateCheckMoves(const Board& b, MoveStack* mlist);
+
+// 詰み探索用。王手を回避する合法手を生成する。歩、角、飛の不成は生成しない。
+MoveStack* generateLegalEvasions(const Board& b, MoveStack* mlist);
+
 #if defined USE_BITBOARD
 // MoveStackTypeに応じたMoveStackStackのリストを作るクラス
 template <MoveType MT> class MoveList
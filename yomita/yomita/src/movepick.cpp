@@ -24,8 +24,35 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "thread.h"
 #include "movepick.h"
 #include <string>
+
+// AVX2のgatherを使って指し手のスコアリングとソートを行う。
+// 指し手の並びは非SIMD版と完全に一致させているので、探索結果(ノード数)は変わらない。
+#ifdef HAVE_BMI2
+#define USE_GATHER
+#endif
+
 namespace
 {
+#ifdef USE_GATHER
+    // MoveStack4個分を読み込み、Moveを下位128bitに、scoreを上位128bitに寄せる。
+    inline __m256i loadMoveStack4(const MoveStack* p)
+    {
+        return _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)p), _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+    }
+
+    // MoveStack8個分のMoveを取り出す。
+    inline __m256i loadMoves8(const MoveStack* p)
+    {
+        return _mm256_permute2x128_si256(loadMoveStack4(p), loadMoveStack4(p + 4), 0x20);
+    }
+
+    // MoveStack8個分のscoreを取り出す。
+    inline __m256i loadScores8(const MoveStack* p)
+    {
+        return _mm256_permute2x128_si256(loadMoveStack4(p), loadMoveStack4(p + 4), 0x31);
+    }
+#endif
+
     enum Stages
     {
         MAIN_SEARCH, CAPTURES_INIT, GOOD_CAPTURES, KILLERS, COUNTERMOVE,
@@ -42,6 +69,38 @@ namespace
     // To keep the implementation simple, *begin is always included in the list of sorted moves.
     void partial_insertion_sort(MoveStack* begin, MoveStack* end, int limit)
     {
+#ifdef USE_GATHER
+        // pより後ろの要素はpを処理するまで書き換わらないので、8手分のscore >= limitの判定をまとめて行い、
+        // 該当する手だけを挿入する。挿入の順序は非SIMD版と同じ。
+        MoveStack* sortedEnd = begin;
+        const __m256i lim = _mm256_set1_epi32(limit - 1);
+
+        for (MoveStack* base = begin + 1; base < end; base += 8)
+        {
+            uint32_t mask;
+
+            if (end - base >= 8)
+                mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(loadScores8(base), lim)));
+
+            else
+            {
+                mask = 0;
+
+                for (int i = 0; i < end - base; i++)
+                    mask |= (base[i].score >= limit) << i;
+            }
+
+            while (mask)
+            {
+                MoveStack* p = base + bsf64(mask), tmp = *p, *q;
+                mask &= mask - 1;
+                *p = *++sortedEnd;
+                for (q = sortedEnd; q != begin && *(q - 1) < tmp; --q)
+                    *q = *(q - 1);
+                *q = tmp;
+            }
+        }
+#else
         for (MoveStack *sortedEnd = begin, *p = begin + 1; p < end; ++p)
             if (p->score >= limit)
             {
@@ -51,6 +110,7 @@ namespace
                     *q = *(q - 1);
                 *q = tmp;
             }
+#endif
     }
 
     // pick_best() finds the best move in the range (begin, end) and moves it to
@@ -58,10 +118,97 @@ namespace
     // are few moves, e.g., the possible captures.
     Move pickBest(MoveStack* begin, MoveStack* end)
     {
+#ifdef USE_GATHER
+        // 8手以上あるなら最大値をSIMDで求めてから、その値を持つ最初の手を探す。
+        // std::max_elementと同じく、同点なら先頭に近い手が選ばれる。
+        if (end - begin >= 8)
+        {
+            __m256i best = _mm256_set1_epi32(INT32_MIN);
+            MoveStack* p = begin;
+
+            for (; end - p >= 8; p += 8)
+                best = _mm256_max_epi32(best, loadScores8(p));
+
+            __m128i m = _mm_max_epi32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+            m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+            int max_score = _mm_cvtsi128_si32(m);
+
+            for (; p < end; ++p)
+                max_score = std::max(max_score, p->score);
+
+            p = begin;
+
+            while (p->score != max_score)
+                ++p;
+
+            std::swap(*begin, *p);
+            return *begin;
+        }
+#endif
         std::swap(*begin, *std::max_element(begin, end));
         return *begin;
     }
 
+#ifdef USE_GATHER
+    // [begin, end)の指し手に、counter move history 3つとhistoryの合計点をつける。
+    // 8手ずつMoveを取り出して表引きのindexを計算し、gatherで一気に引く。
+    void scoreQuietsGather(MoveStack* begin, MoveStack* end, const CounterMoveStats* cm, const CounterMoveStats* fm,
+        const CounterMoveStats* f2, const HistoryStats& history, Turn t)
+    {
+        const int* cmt = cm->refer();
+        const int* fmt = fm->refer();
+        const int* f2t = f2->refer();
+        const int* ht = (const int*)history.refer();
+
+        const __m256i sq_max = _mm256_set1_epi32(SQ_MAX);
+        const __m256i pt_max = _mm256_set1_epi32(PRO_SILVER);
+        const __m256i hturn = _mm256_set1_epi32((int)t * SQ_MAX * (int)SQ_MAX);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i mask7f = _mm256_set1_epi32(0x7f);
+        const __m256i mask0f = _mm256_set1_epi32(0x0f);
+        const __m256i mask08 = _mm256_set1_epi32(0x08);
+
+        MoveStack* p = begin;
+
+        for (; end - p >= 8; p += 8)
+        {
+            __m256i m = loadMoves8(p);
+            __m256i to = _mm256_and_si256(m, mask7f);
+            __m256i from = _mm256_and_si256(_mm256_srli_epi32(m, FROM_SHIFT), mask7f);
+            __m256i drop = _mm256_and_si256(_mm256_srli_epi32(m, DROP_SHIFT), one);
+            __m256i turn = _mm256_and_si256(_mm256_srli_epi32(m, PIECE_SHIFT + 4), one);
+
+            // movedPieceTypeTo(m) - 1 : 成る手ならPROMOTEDのbitを立てる。
+            __m256i pt = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(m, PIECE_SHIFT), mask0f),
+                _mm256_and_si256(_mm256_srli_epi32(m, PROMOTE_SHIFT - 3), mask08));
+            pt = _mm256_sub_epi32(pt, one);
+
+            // Stats : table[is_drop][turn][piecetype][square]
+            __m256i sidx = _mm256_add_epi32(_mm256_add_epi32(drop, drop), turn);
+            sidx = _mm256_add_epi32(_mm256_mullo_epi32(sidx, pt_max), pt);
+            sidx = _mm256_add_epi32(_mm256_mullo_epi32(sidx, sq_max), to);
+
+            // HistoryStats : table[turn][drop ? to : from][to]
+            __m256i hfrom = _mm256_blendv_epi8(from, to, _mm256_cmpeq_epi32(drop, one));
+            __m256i hidx = _mm256_add_epi32(_mm256_add_epi32(hturn, _mm256_mullo_epi32(hfrom, sq_max)), to);
+
+            __m256i score = _mm256_i32gather_epi32(cmt, sidx, 4);
+            score = _mm256_add_epi32(score, _mm256_i32gather_epi32(fmt, sidx, 4));
+            score = _mm256_add_epi32(score, _mm256_i32gather_epi32(f2t, sidx, 4));
+            score = _mm256_add_epi32(score, _mm256_i32gather_epi32(ht, hidx, 4));
+
+            // MoveStackの並びに戻して書き込む。
+            __m256i lo = _mm256_unpacklo_epi32(m, score);
+            __m256i hi = _mm256_unpackhi_epi32(m, score);
+            _mm256_storeu_si256((__m256i*)p, _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(p + 4), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+
+        for (; p < end; ++p)
+            p->score = cm->value(*p) + fm->value(*p) + f2->value(*p) + history.get(t, *p);
+    }
+#endif
 } // namespace
 
   // 通常探索から呼び出されるとき用。
@@ -220,7 +367,9 @@ void MovePicker::scoreQuiets()
             Piece p = board.piece(fromSq(tm));
             Move m = move16ToMove(tm, p, EMPTY);
             end_moves->move = m;
+#ifndef USE_GATHER
             end_moves->score = cm->value(m) + fm->value(m) + f2->value(m) + history.get(t, m);
+#endif
             end_moves++;
         }
     }
@@ -232,10 +381,16 @@ void MovePicker::scoreQuiets()
     {
         Move m = *mp;
         end_moves->move = m;
+#ifndef USE_GATHER
         end_moves->score = cm->value(m) + fm->value(m) + f2->value(m) + history.get(t, m);
+#endif
         end_moves++;
     }
 
+#ifdef USE_GATHER
+    scoreQuietsGather(cur, end_moves, cm, fm, f2, history, t);
+#endif
+
     assert(inRange(cur));
     assert(inRange(end_moves));
     assert(inRange(end_bads));
@@ -504,8 +659,12 @@ void MovePicker::scoreQuiets()
     const HistoryStats& history = board.thisThread()->history;
     Turn t = board.turn();
 
+#ifdef USE_GATHER
+    scoreQuietsGather(cur, end_moves, cm, fm, f2, history, t);
+#else
     for (auto& m : *this)
         m.score = cm->value(m) + fm->value(m) + f2->value(m) + history.get(t, m);
+#endif
 }
 
 void MovePicker::scoreEvasions()
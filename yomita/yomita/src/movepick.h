@@ -32,6 +32,7 @@ struct HistoryStats
     static const int Max = 1 << 28;
 
     int get(Turn t, Move m) const { return table[t][isDrop(m) ? toSq(m) : fromSq(m)][toSq(m)]; }
+    const Score* refer() const { return (const Score*)table; }
     void clear() { std::memset(table, 0, sizeof(table)); }
     void update(Turn t, Move m, int s)
     {
@@ -63,6 +64,7 @@ struct Stats
 
     // drop, turn, piecetype, toを呼び出し側で計算するより隠蔽してMoveで渡してもらったほうが実装が楽。
     T* refer() { return (T*)table; }
+    const T* refer() const { return (const T*)table; }
     T* refer(const Move m)       { return &table[isDrop(m)][turnOf(m)][movedPieceTypeTo(m) - 1][toSq(m)]; }
     T  value(const Move m) const { return  table[isDrop(m)][turnOf(m)][movedPieceTypeTo(m) - 1][toSq(m)]; }
     void update(const Move m, Move sm)  {  table[isDrop(m)][turnOf(m)][movedPieceTypeTo(m) - 1][toSq(m)] = sm; }
@@ -22,14 +22,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <sstream>
+#include <iomanip>
 #include <math.h>
 
 #include "tt.h"
 #include "usi.h"
 #include "book.h"
+#include "mate.h"
 #include "search.h"
 #include "thread.h"
 #include "timeman.h"
+#include "trace.h"
 #include "evaluate.h"
 #include "movepick.h"
 
@@ -41,6 +44,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define EXTENSION
 #define REDUCTION
 #endif
+
+// 探索の統計を数える。USE_SEARCH_STATSを定義しないときは何もしない。
+#ifdef USE_SEARCH_STATS
+#define STATS_INC(th, c) (th)->search_stats.inc(Search::Statistics::c)
+#define STATS_TT(th, d, hit) (th)->search_stats.ttProbe(d, hit)
+#else
+#define STATS_INC(th, c) (void)0
+#define STATS_TT(th, d, hit) (void)0
+#endif
 using namespace Eval;
 using namespace USI;
 using namespace Search;
@@ -130,6 +142,9 @@ namespace
     Turn RootTurn;
     Score DrawScore;
 
+    // 探索中の詰みチェックで読む手数(1, 3, 5)
+    int MatePly;
+
     template <NodeType NT>
     Score search(Board& b, Stack* ss, Score alpha, Score beta, Depth depth, bool cut_node, bool skip_early_pruning = false);
 
@@ -148,6 +163,7 @@ namespace
 void Search::init()
 {
     DrawScore = Score((int)Options["DrawScore"]);
+    MatePly = Options["MatePly"];
 
     for (int imp = 0; imp <= 1; ++imp)
         for (int d = 1; d < 64; ++d)
@@ -180,17 +196,24 @@ void Search::clear()
     for (Thread* th : Threads)
         th->clear();
 
+#ifdef USE_DFPN
+    Mate::clear();
+#endif
+
     Threads.main()->calls_cnt = 0;
     Threads.main()->previous_score = SCORE_INFINITE;
     DrawScore = Score((int)Options["DrawScore"]);
+    MatePly = Options["MatePly"];
 }
 
 void MainThread::search()
 {
     bool declare_win = false, book_hit = false;
     Turn t = RootTurn = root_board.turn();
+    Trace::record(idx, Trace::SEARCH_BEGIN);
     Time.init(Limits, t, root_board.ply());
     GlobalTT.newSearch();
+    iterations.clear();
 
     SYNC_COUT << "info string optimumTime = " << Time.optimum()
         << " maximumTime = " << Time.maximum() << SYNC_ENDL;
@@ -215,7 +238,9 @@ void MainThread::search()
         if (Options["UseBook"] && !Limits.infinite)
         {
             // 定跡手を取得
-            const Move m = Book.probe(root_board);
+            Move ponder;
+            Book.setPolicy(Options["BookPolicy"], Options["BookTemperature"], Options["BookScoreWindow"]);
+            const Move m = Book.probe(root_board, &ponder);
 
             // 定跡にヒット
             if (m != MOVE_NONE)
@@ -226,6 +251,19 @@ void MainThread::search()
                 {
                     std::swap(root_moves[0], *it_move);
                     book_hit = true;
+
+                    // 定跡に予想手が書かれていて、それが合法手ならponderとして返す。
+                    if (ponder != MOVE_NONE)
+                    {
+                        StateInfo st;
+                        root_board.doMove(m, st);
+                        ponder = completeMove(root_board, ponder);
+
+                        if (MoveList<LEGAL>(root_board).contains(ponder))
+                            root_moves[0].pv.push_back(ponder);
+
+                        root_board.undoMove(m);
+                    }
                 }
             }
         }
@@ -242,6 +280,10 @@ void MainThread::search()
             }
             else
             {
+#ifdef USE_DFPN
+                // 詰み探索用のスレッドで詰みを探す。詰みが見つかれば探索を止める。
+                Mate::startThinking(root_board);
+#endif
                 // slaveスレッドの探索を開始させる
                 for (auto th : Threads.slaves)
                     th->startSearching();
@@ -261,8 +303,17 @@ void MainThread::search()
     Threads.stop = true;
 
     // slaveスレッドの探索がすべて終了するのを待つ
+    Trace::record(idx, Trace::JOIN_BEGIN);
+
+    int slave_idx = 1;
+
     for (auto th : Threads.slaves)
+    {
         th->join();
+        Trace::record(idx, Trace::SLAVE_JOINED, slave_idx++);
+    }
+
+    Trace::record(idx, Trace::JOIN_END);
 
     Thread* best_thread = this;
 
@@ -282,12 +333,43 @@ void MainThread::search()
         }
     }
 
+#ifdef USE_DFPN
+    // 詰み探索が詰みを見つけていて、通常の探索より短い詰みならそれを指す。
+    std::vector<Move> mate_pv;
+
+    if (Mate::stopThinking(mate_pv)
+        && best_thread->root_moves[0].score < mateIn((int)mate_pv.size() + 1))
+    {
+        auto it_move = std::find(best_thread->root_moves.begin(), best_thread->root_moves.end(), mate_pv[0]);
+
+        if (it_move != best_thread->root_moves.end())
+        {
+            std::swap(best_thread->root_moves[0], *it_move);
+            best_thread->root_moves[0].pv = mate_pv;
+            best_thread->root_moves[0].score = mateIn((int)mate_pv.size() + 1);
+            SYNC_COUT << USI::pv(best_thread, std::max(best_thread->completed_depth, ONE_PLY), -SCORE_INFINITE, SCORE_INFINITE) << SYNC_ENDL;
+        }
+    }
+#endif
     previous_score = best_thread->root_moves[0].score;
+    iterations.push_back({ best_thread->completed_depth, Time.elapsed(), Threads.nodeSearched(),
+                           best_thread->root_moves[0].pv[0], best_thread->root_moves[0].score });
 
     // もし必要なら新たなpvを表示しておく
     if (best_thread != this)
         SYNC_COUT << USI::pv(best_thread, best_thread->completed_depth, -SCORE_INFINITE, SCORE_INFINITE) << SYNC_ENDL;
 
+#ifdef USE_SEARCH_STATS
+    Statistics stats;
+    stats.clear();
+
+    for (Thread* th : Threads)
+        stats += th->search_stats;
+
+    SYNC_COUT << stats.toUSI() << SYNC_ENDL;
+#endif
+    Trace::record(idx, Trace::BESTMOVE_BEGIN);
+
     // 宣言勝ちできるなら勝ち
     if (declare_win)
         SYNC_COUT << "bestmove win" << SYNC_ENDL;
@@ -311,6 +393,9 @@ void MainThread::search()
 
         std::cout << SYNC_ENDL;
     }
+
+    Trace::record(idx, Trace::BESTMOVE_END);
+    Trace::record(idx, Trace::SEARCH_END);
 }
 
 void Thread::search()
@@ -356,6 +441,8 @@ void Thread::search()
                 continue;
         }
 
+        Trace::record(idx, Trace::ITERATION_BEGIN, root_depth / ONE_PLY);
+
         // PV変動率を計算する
         if (main_thread)
             main_thread->best_move_changes *= 0.505, main_thread->failed_low = false;
@@ -387,6 +474,7 @@ void Thread::search()
                     SYNC_COUT << USI::pv(this, root_depth, alpha, beta) << SYNC_ENDL;
                     completed_depth = DEPTH_MAX;
                     Threads.stop = true;
+                    Trace::record(idx, Trace::STOP_MATE);
                 }
 
                 if (Threads.stop)
@@ -442,9 +530,14 @@ void Thread::search()
         if (!Threads.stop)
             completed_depth = root_depth;
 
+        Trace::record(idx, Trace::ITERATION_END, root_depth / ONE_PLY);
+
         if (!main_thread)
             continue;
 
+        main_thread->iterations.push_back({ root_depth, Time.elapsed(), Threads.nodeSearched(),
+                                            root_moves[0].pv[0], root_moves[0].score });
+
         if (main_thread->root_moves[0].pv.size() > 1)
             WeakPonder = main_thread->root_moves[0].pv[1];
 
@@ -469,7 +562,10 @@ void Thread::search()
                     if (Limits.ponder)
                         Threads.stop_on_ponderhit = true;
                     else
+                    {
                         Threads.stop = true;
+                        Trace::record(idx, Trace::STOP_ITERATION, Time.elapsed());
+                    }
                 }
             }
 
@@ -519,6 +615,8 @@ namespace
         if (this_thread == Threads.main())
             static_cast<MainThread*>(this_thread)->checkTime();
 
+        STATS_INC(this_thread, SEARCH_NODES);
+
         // GUIへselDepth(現在、選択的に読んでいる手の探索深さ)情報を送信するために使用
         if (PvNode && this_thread->max_ply < ss->ply)
             this_thread->max_ply = ss->ply;
@@ -573,6 +671,7 @@ namespace
 
         const Key key = b.key() ^ Key(excluded_move << 1);
         const bool tt_hit = tt->probe(key, tte);
+        STATS_TT(this_thread, depth / ONE_PLY, tt_hit);
 
         if (tt_hit)
         {
@@ -632,14 +731,17 @@ namespace
             && depth > ONE_PLY
             && !in_check)
         {
-            best_move = b.mate1ply();
+            int mate_ply = 1;
+            best_move = MatePly >= 5 ? b.mateNply<5>(&mate_ply)
+                      : MatePly >= 3 ? b.mateNply<3>(&mate_ply)
+                      : b.mate1ply();
 
             if (best_move != MOVE_NONE)
             {
-                best_score = mateIn(ss->ply + 1);
+                best_score = mateIn(ss->ply + mate_ply);
 
-                // staticEvalはなんでもいい
-                tte->save(key, scoreToTT(best_score, ss->ply), BOUND_EXACT,
+                // 3手以上の詰みは最短とは限らないので下限値として登録する。staticEvalはなんでもいい
+                tte->save(key, scoreToTT(best_score, ss->ply), mate_ply == 1 ? BOUND_EXACT : BOUND_LOWER,
                     DEPTH_MAX, best_move, best_score, tt->generation());
 
                 return best_score;
@@ -690,13 +792,19 @@ namespace
             && eval + razor_margin[depth / ONE_PLY] <= alpha)
         {
             if (depth <= ONE_PLY)
+            {
+                STATS_INC(this_thread, RAZORING);
                 return qsearch<NO_PV, false>(b, ss, alpha, beta);
+            }
 
             Score ralpha = alpha - razor_margin[depth / ONE_PLY];
             Score s = qsearch<NO_PV, false>(b, ss, ralpha, ralpha + 1);
 
             if (s <= ralpha)
+            {
+                STATS_INC(this_thread, RAZORING);
                 return s;
+            }
         }
 
         // Step 7. Futility pruning : child node (skipped when in check)
@@ -706,7 +814,10 @@ namespace
             && depth < 7 * ONE_PLY
             && eval - futilityMargin(depth, progress) >= beta
             && eval < SCORE_KNOWN_WIN)
+        {
+            STATS_INC(this_thread, FUTILITY);
             return eval;
+        }
 
         // Step 8. Null move search with verification search (is omitted in PV nodes)
         // 現局面でbetaを超えているなら探索深さを減らしてパスをしてみて、
@@ -725,6 +836,7 @@ namespace
             // 深さとスコアに基づいて、動的に減らす探索深さを決める
             // 16bitをオーバーフローするのでONE_PLYで割るのは先にやる必要がある。
             Depth R = ((823 + 67 * (depth / ONE_PLY)) / 256 + std::min((eval - beta) / PAWN_SCORE, 3)) * ONE_PLY;
+            STATS_INC(this_thread, NULL_MOVE);
             b.doNullMove(st);
             Score null_score = depth - R < ONE_PLY ? -qsearch<NO_PV, false>(b, ss + 1, -beta, -beta + 1)
                                                    : - search<NO_PV       >(b, ss + 1, -beta, -beta + 1, depth - R, !cut_node, true);
@@ -736,7 +848,10 @@ namespace
                     null_score = beta;
 
                 if (depth < 12 * ONE_PLY && abs(beta) < SCORE_KNOWN_WIN)
+                {
+                    STATS_INC(this_thread, NULL_MOVE_CUT);
                     return null_score;
+                }
 
                 // あまり早い段階での枝刈りは乱暴かもしれないので、Nullwindowで探索して、それでもbetaを超えているなら
                 // 今度こそスキップする
@@ -744,7 +859,10 @@ namespace
                                               :  search<NO_PV       >(b, ss, beta - 1, beta, depth - R, false, true);
 
                 if (s >= beta)
+                {
+                    STATS_INC(this_thread, NULL_MOVE_CUT);
                     return null_score;
+                }
             }
         }
 
@@ -771,12 +889,16 @@ namespace
                     assert(!isDrop(move));
                     ss->current_move = move;
                     ss->counter_moves = this_thread->counter_move_history.refer(move);
+                    STATS_INC(this_thread, PROBCUT);
                     b.doMove(move, st, b.givesCheck(move));
                     score = -search<NO_PV>(b, ss + 1, -rbeta, -rbeta + 1, depth - 4 * ONE_PLY, !cut_node);
                     b.undoMove(move);
 
                     if (score >= rbeta)
+                    {
+                        STATS_INC(this_thread, PROBCUT_CUT);
                         return score;
+                    }
                 }
         }
 #endif
@@ -884,7 +1006,10 @@ namespace
                 if (!capture_or_pawn_promotion && !gives_check)
                 {
                     if (move_count_pruning)
+                    {
+                        STATS_INC(this_thread, MOVE_COUNT_PRUNING);
                         continue;
+                    }
 
                     int lmr_depth = std::max(new_depth - reduction<PvNode>(improving, depth, move_count), DEPTH_ZERO) / ONE_PLY;
 
@@ -893,22 +1018,34 @@ namespace
                     if (lmr_depth < 3
                         && (cmh->value(move) < CounterMovePruneThreshold)
                         && (fmh->value(move) < CounterMovePruneThreshold))
+                    {
+                        STATS_INC(this_thread, HISTORY_PRUNING);
                         continue;
+                    }
 
                     if (lmr_depth < 7
                         && !in_check
                         && ss->static_eval + 256 + 200 * lmr_depth <= alpha)
+                    {
+                        STATS_INC(this_thread, FUTILITY_MOVE_PRUNING);
                         continue;
+                    }
 
                     if  (lmr_depth < 8
                         && !b.seeGe(move, Score(-35 * lmr_depth * lmr_depth)))
+                    {
+                        STATS_INC(this_thread, SEE_PRUNING);
                         continue;
+                    }
                 }
 
                 // とても浅い残り探索深さにおける王手や駒をとる手のSEE値が負なら枝刈してしまう。
                 else if (depth < 3 * ONE_PLY &&
                     (mp.seeSign() < 0 || (!mp.seeSign() && !b.seeGe(move, SCORE_ZERO))))
+                {
+                    STATS_INC(this_thread, SEE_PRUNING);
                     continue;
+                }
             }
 #endif
             // 指し手が本当に合法かどうかのチェック(ルートならチェック済みなので要らない)
@@ -971,6 +1108,15 @@ namespace
                 Depth d = std::max(new_depth - r, ONE_PLY);
                 score = -search<NO_PV>(b, ss + 1, -(alpha + 1), -alpha, d, true);
                 do_full_depth_search = (score > alpha && d != new_depth);
+#ifdef USE_SEARCH_STATS
+                if (d != new_depth)
+                {
+                    STATS_INC(this_thread, LMR);
+
+                    if (do_full_depth_search)
+                        STATS_INC(this_thread, LMR_RESEARCH);
+                }
+#endif
             }
             else
 #endif
@@ -1047,6 +1193,11 @@ namespace
                     else
                     {
                         assert(score >= beta); // Fail high
+                        STATS_INC(this_thread, FAIL_HIGH);
+
+                        if (move_count == 1)
+                            STATS_INC(this_thread, FAIL_HIGH_FIRST);
+
                         break;
                     }
                 }
@@ -1113,6 +1264,7 @@ namespace
         ss->current_move = best_move = MOVE_NONE;
         ss->ply = (ss - 1)->ply + 1;
         int move_count = 0;
+        STATS_INC(b.thisThread(), QSEARCH_NODES);
 
         if (PvNode)
         {
@@ -1154,6 +1306,9 @@ namespace
         const Key key = b.key();
         const bool tt_hit = TTProbe ? tt->probe(key, tte) : false;
 
+        if (TTProbe)
+            STATS_TT(b.thisThread(), 0, tt_hit);
+
         if (TTProbe && tt_hit)
         {
             tt_move = tte->move();
@@ -1445,7 +1600,12 @@ void MainThread::checkTime()
     if ((!Limits.move_time && Limits.useTimeManagement() && elapsed > Time.maximum())
         || (Limits.move_time && elapsed >= Limits.move_time)
         || (Limits.nodes && Threads.nodeSearched() >= Limits.nodes))
+    {
+        if (!Threads.stop)
+            Trace::record(idx, Trace::STOP_TIME, elapsed);
+
         Threads.stop = true;
+    }
 }
 
   // ponder moveを何も考えていないときに探索終了要求がきたらなんとかしてGlobalTTからponder moveを返すように努力する
@@ -1468,6 +1628,88 @@ bool Search::RootMove::extractPonderFromTT(Board & b, Move weak_ponder)
     return contains;
 }
 
+#ifdef USE_SEARCH_STATS
+namespace
+{
+    // 割合を百分率で表示する。
+    std::string percent(uint64_t a, uint64_t b)
+    {
+        std::stringstream ss;
+        ss << std::fixed << std::setprecision(1) << (b ? 100.0 * a / b : 0.0) << "%";
+        return ss.str();
+    }
+
+    const char* const CounterNames[Statistics::COUNTER_NB] =
+    {
+        "search_nodes", "qsearch_nodes", "razoring", "futility", "null_move", "null_move_cut", "probcut", "probcut_cut",
+        "move_count_pruning", "history_pruning", "futility_move_pruning", "see_pruning",
+        "lmr", "lmr_research", "fail_high", "fail_high_first",
+    };
+}
+
+Statistics& Statistics::operator += (const Statistics& s)
+{
+    for (int i = 0; i < COUNTER_NB; i++)
+        count[i] += s.count[i];
+
+    for (int d = 0; d < DEPTH_NB; d++)
+        tt_probe[d] += s.tt_probe[d], tt_hit[d] += s.tt_hit[d];
+
+    return *this;
+}
+
+std::string Statistics::toUSI() const
+{
+    const uint64_t* c = count;
+    uint64_t probe = 0, hit = 0;
+    std::stringstream ss;
+
+    for (int d = 0; d < DEPTH_NB; d++)
+        probe += tt_probe[d], hit += tt_hit[d];
+
+    ss << "info string stats nodes search " << c[SEARCH_NODES] << " qsearch " << c[QSEARCH_NODES]
+       << " (qsearch " << percent(c[QSEARCH_NODES], c[SEARCH_NODES] + c[QSEARCH_NODES]) << ")"
+       << "\ninfo string stats tt hit " << percent(hit, probe) << " by depth";
+
+    for (int d = 0; d < DEPTH_NB; d++)
+        if (tt_probe[d])
+            ss << " " << (d ? std::to_string(d) : "qs") << (d == DEPTH_NB - 1 ? "+" : "") << ":" << percent(tt_hit[d], tt_probe[d]);
+
+    ss << "\ninfo string stats null move " << c[NULL_MOVE] << " cut " << percent(c[NULL_MOVE_CUT], c[NULL_MOVE])
+       << " probcut " << c[PROBCUT] << " cut " << percent(c[PROBCUT_CUT], c[PROBCUT])
+       << " lmr " << c[LMR] << " research " << percent(c[LMR_RESEARCH], c[LMR])
+       << " fail high " << c[FAIL_HIGH] << " first move " << percent(c[FAIL_HIGH_FIRST], c[FAIL_HIGH])
+       << "\ninfo string stats pruned razoring " << c[RAZORING] << " futility " << c[FUTILITY]
+       << " move count " << c[MOVE_COUNT_PRUNING] << " history " << c[HISTORY_PRUNING]
+       << " futility(move) " << c[FUTILITY_MOVE_PRUNING] << " see " << c[SEE_PRUNING];
+
+    return ss.str();
+}
+
+std::string Statistics::toJSON() const
+{
+    std::stringstream ss;
+    ss << "{";
+
+    for (int i = 0; i < COUNTER_NB; i++)
+        ss << " \"" << CounterNames[i] << "\": " << count[i] << ",";
+
+    ss << " \"tt_probe\": [";
+
+    for (int d = 0; d < DEPTH_NB; d++)
+        ss << (d ? ", " : "") << tt_probe[d];
+
+    ss << "], \"tt_hit\": [";
+
+    for (int d = 0; d < DEPTH_NB; d++)
+        ss << (d ? ", " : "") << tt_hit[d];
+
+    ss << "] }";
+
+    return ss.str();
+}
+#endif
+
 // GUIにpvやスコアを表示する
 std::string USI::pv(const Thread* th, Depth depth, Score alpha, Score beta)
 {
@@ -1516,7 +1758,9 @@ std::string USI::pv(const Thread* th, Depth depth, Score alpha, Score beta)
 #if defined LEARN
 namespace Learn
 {
-    void initLearn(Board& b)
+    // 静止探索はroot_movesを見ないので、学習で局面ごとに呼ばれるqsearch()からはgen_root_moves = falseで呼び、
+    // 合法手の生成とRootMoveの確保を省く。
+    void initLearn(Board& b, bool gen_root_moves = true)
     {
         auto& limits = USI::Limits;
         limits.infinite = true;
@@ -1527,13 +1771,16 @@ namespace Learn
         auto& root_moves = th->root_moves;
         root_moves.clear();
 
+        if (!gen_root_moves)
+            return;
+
         for (auto m : MoveList<LEGAL>(b))
             root_moves.push_back(Search::RootMove(m));
 
         assert(root_moves.size());
     }
 
-    std::pair<Score, std::vector<Move>> search(Board& b, Depth depth, size_t multi_pv, Score multi_pv_range)
+    std::pair<Score, std::vector<Move>> search(Board& b, Depth depth, size_t multi_pv, Score multi_pv_range, uint64_t nodes_limit)
     {
         // (ss - 4) and (ss + 2)という参照を許すため
         Stack stack[MAX_PLY + 7], *ss = stack + 4;
@@ -1549,6 +1796,7 @@ namespace Learn
         auto& root_depth = th->root_depth;
         multi_pv = std::min(multi_pv, root_moves.size());
         Score alpha = -SCORE_INFINITE, beta = SCORE_INFINITE;
+        const uint64_t start_nodes = th->nodes;
 
         while ((root_depth += ONE_PLY) <= depth && !Threads.stop)
         {
@@ -1565,6 +1813,12 @@ namespace Learn
                     break;
                 }
             }
+
+            // 途中で打ち切った探索の結果は使えないので、深さを1つ終えるごとに確認する。
+            // 次の深さにはそれまでの合計と同じくらいかかるので、上限の半分を使った時点でやめておくと上限前後に収まる。
+            // 抜けた後のroot_depthは最後に終えた深さになる。
+            if (nodes_limit && (th->nodes - start_nodes) * 2 >= nodes_limit)
+                break;
         }
 
         std::vector<Move> pvs;
@@ -1587,7 +1841,7 @@ namespace Learn
         memset(ss - 5, 0, 8 * sizeof(Stack));
         Move pv[MAX_PLY + 1];
         ss->pv = pv;
-        initLearn(b);
+        initLearn(b, false);
         auto th = b.thisThread();
         const bool in_check = b.inCheck();
         Score best_score = in_check ? ::qsearch<PV, true,  false>(b, ss, alpha, beta, DEPTH_ZERO)
@@ -27,6 +27,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <vector>
 #include <memory>
 #include <utility>
+#include <string>
+#include <cstring>
+#include <algorithm>
 
 #include "move.h"
 #include "board.h"
@@ -91,6 +94,48 @@ namespace Search
 
     typedef std::vector<RootMove> RootMoves;
 
+#ifdef USE_SEARCH_STATS
+    // 探索の統計。スレッドごとに数え、bestmoveを返すときに全スレッド分を足し合わせて出力する。
+    struct Statistics
+    {
+        enum Counter
+        {
+            SEARCH_NODES, QSEARCH_NODES,          // search()、qsearch()が呼ばれた回数
+            RAZORING, FUTILITY,                   // Step 6, 7で枝刈りした回数
+            NULL_MOVE, NULL_MOVE_CUT,             // null moveを試した回数、それで枝刈りした回数
+            PROBCUT, PROBCUT_CUT,                 // ProbCutの探索をした手の数、それで枝刈りした回数
+            MOVE_COUNT_PRUNING, HISTORY_PRUNING,  // Step 13で枝刈りした手の数
+            FUTILITY_MOVE_PRUNING, SEE_PRUNING,
+            LMR, LMR_RESEARCH,                    // LMRで探索深さを減らした回数、fail highして再探索した回数
+            FAIL_HIGH, FAIL_HIGH_FIRST,           // beta cutした回数、そのうち1手目でcutした回数
+            COUNTER_NB
+        };
+
+        // 置換表の統計を取る残り深さの区分。最後の区分はそれ以上の深さをまとめる。0はqsearch。
+        static const int DEPTH_NB = 20;
+
+        uint64_t count[COUNTER_NB];
+        uint64_t tt_probe[DEPTH_NB], tt_hit[DEPTH_NB];
+
+        void clear() { std::memset(this, 0, sizeof(*this)); }
+        void inc(Counter c) { count[c]++; }
+        void ttProbe(int depth, bool hit)
+        {
+            depth = std::max(0, std::min(depth, DEPTH_NB - 1));
+            tt_probe[depth]++;
+            tt_hit[depth] += hit;
+        }
+
+        Statistics& operator += (const Statistics& s);
+
+        // "info string stats ..."の形式で出力する。
+        std::string toUSI() const;
+
+        // benchのJSONに埋め込むオブジェクト。
+        std::string toJSON() const;
+    };
+#endif
+
     void init();
     void clear();
 
@@ -101,6 +146,11 @@ namespace Search
 namespace Learn
 {
     std::pair<Score, std::vector<Move>> qsearch(Board& b);
-    std::pair<Score, std::vector<Move>>  search(Board& b, Depth depth, size_t multi_pv = 1, Score multi_pv_range = SCORE_ZERO);
+
+    // nodes_limitを指定すると、深さを1つ終えるごとに探索ノード数を確かめ、nodes_limitの半分以上を使っていれば
+    // 次の深さに進まない。depthは上限として扱う。探索中には打ち切らないので上限は目安で、最後の深さの分だけ
+    // nodes_limitを超えることがある。(実測で2倍程度まで)
+    std::pair<Score, std::vector<Move>>  search(Board& b, Depth depth, size_t multi_pv = 1, Score multi_pv_range = SCORE_ZERO,
+                                                uint64_t nodes_limit = 0);
 } // namespace Learn
 #endif
\ No newline at end of file
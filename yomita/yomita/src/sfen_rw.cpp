@@ -25,6 +25,324 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #ifdef LEARN
 
+#include <memory>
+#include <cstring>
+#include <cstdio>
+
+namespace
+{
+    // LZMAと同じ形の二値レンジコーダー。確率は11bitで持ち、符号化するたびに1/32ずつ寄せる。
+    const int PROB_BITS = 11;
+    const uint16_t PROB_INIT = 1 << (PROB_BITS - 1);
+    const int PROB_MOVE = 5;
+    const uint32_t RANGE_TOP = 1 << 24;
+
+    struct RangeEncoder
+    {
+        RangeEncoder(std::vector<uint8_t>& o) : out(o) {}
+
+        void encode(uint16_t& prob, int bit)
+        {
+            const uint32_t bound = (range >> PROB_BITS) * prob;
+
+            if (!bit)
+            {
+                range = bound;
+                prob += ((1 << PROB_BITS) - prob) >> PROB_MOVE;
+            }
+            else
+            {
+                low += bound;
+                range -= bound;
+                prob -= prob >> PROB_MOVE;
+            }
+
+            while (range < RANGE_TOP)
+            {
+                range <<= 8;
+                shiftLow();
+            }
+        }
+
+        void flush()
+        {
+            for (int i = 0; i < 5; i++)
+                shiftLow();
+        }
+
+    private:
+        // 桁上がりが確定するまで0xffの並びを保留しておく。
+        void shiftLow()
+        {
+            if ((uint32_t)low < 0xff000000 || (low >> 32) != 0)
+            {
+                const uint8_t carry = uint8_t(low >> 32);
+                uint8_t temp = cache;
+
+                do {
+                    out.push_back(uint8_t(temp + carry));
+                    temp = 0xff;
+                } while (--cache_size);
+
+                cache = uint8_t(low >> 24);
+            }
+
+            cache_size++;
+            low = (low & 0x00ffffff) << 8;
+        }
+
+        std::vector<uint8_t>& out;
+        uint64_t low = 0;
+        uint32_t range = 0xffffffff;
+        uint8_t cache = 0;
+        uint64_t cache_size = 1;
+    };
+
+    struct RangeDecoder
+    {
+        RangeDecoder(const uint8_t* b, const uint8_t* e) : p(b), end(e)
+        {
+            for (int i = 0; i < 5; i++)
+                code = (code << 8) | next();
+        }
+
+        int decode(uint16_t& prob)
+        {
+            const uint32_t bound = (range >> PROB_BITS) * prob;
+            int bit;
+
+            if (code < bound)
+            {
+                range = bound;
+                prob += ((1 << PROB_BITS) - prob) >> PROB_MOVE;
+                bit = 0;
+            }
+            else
+            {
+                code -= bound;
+                range -= bound;
+                prob -= prob >> PROB_MOVE;
+                bit = 1;
+            }
+
+            if (range < RANGE_TOP)
+            {
+                range <<= 8;
+                code = (code << 8) | next();
+            }
+
+            return bit;
+        }
+
+        // 末尾を越えて読もうとしたか。壊れたブロックの検出に使う。
+        bool overrun() const { return p > end + 1; }
+
+    private:
+        uint8_t next() { return p < end ? *p++ : (p++, 0); }
+
+        const uint8_t* p;
+        const uint8_t* end;
+        uint32_t range = 0xffffffff, code = 0;
+    };
+
+    // 1ブロック分の確率モデル。ブロックごとに初期化するので、ブロック単位で独立に復号できる。
+    struct SfenModel
+    {
+        SfenModel()
+        {
+            uint16_t* p = (uint16_t*)this;
+            std::fill(p, p + sizeof(*this) / sizeof(uint16_t), PROB_INIT);
+        }
+
+        // 盤面のxorの各byteが0かどうか。[byteの位置][1つ前のbyteが0だったか]
+        uint16_t board_zero[32][2];
+
+        // 0でなかったbyteの値を上位bitから決める木。[byteの位置][木のノード]
+        uint16_t board_byte[32][256];
+
+        // 評価値の差分をzigzag変換した値のbit長と、最上位以外のbit。[bit長][bitの位置]
+        uint16_t deep_len[32];
+        uint16_t deep_bits[32][32];
+
+        // 勝敗。[1つ前の局面の勝敗]
+        uint16_t win[2];
+
+        // 指し手は局面ごとに相関がないので、byteごとの出現頻度だけで符号化する。
+        uint16_t move_byte[4][256];
+    };
+
+    template <typename T>
+    void codeTree(RangeEncoder& enc, uint16_t* tree, int bits, T& value)
+    {
+        for (int i = bits - 1, m = 1; i >= 0; i--)
+        {
+            const int bit = (value >> i) & 1;
+            enc.encode(tree[m], bit);
+            m = m * 2 + bit;
+        }
+    }
+
+    template <typename T>
+    void codeTree(RangeDecoder& dec, uint16_t* tree, int bits, T& value)
+    {
+        int m = 1;
+
+        for (int i = 0; i < bits; i++)
+            m = m * 2 + dec.decode(tree[m]);
+
+        value = T(m - (1 << bits));
+    }
+
+    uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+    int32_t unzigzag(uint32_t z) { return int32_t(z >> 1) ^ -int32_t(z & 1); }
+
+    int bitLength(uint32_t v)
+    {
+        int n = 0;
+
+        while (v)
+            v >>= 1, n++;
+
+        return n;
+    }
+
+    // 評価値の差分。bit長を木で、その下のbitをbit長と位置ごとのモデルで符号化する。
+    void codeDeep(RangeEncoder& enc, SfenModel& model, int32_t diff)
+    {
+        const uint32_t z = zigzag(diff);
+        int len = bitLength(z);
+        codeTree(enc, model.deep_len, 5, len);
+
+        for (int i = len - 2; i >= 0; i--)
+            enc.encode(model.deep_bits[len][i], (z >> i) & 1);
+    }
+
+    int32_t codeDeep(RangeDecoder& dec, SfenModel& model)
+    {
+        int len;
+        codeTree(dec, model.deep_len, 5, len);
+
+        if (len == 0)
+            return 0;
+
+        uint32_t z = 1;
+
+        for (int i = len - 2; i >= 0; i--)
+            z = (z << 1) | dec.decode(model.deep_bits[len][i]);
+
+        return unzigzag(z);
+    }
+
+    // 2つ前の局面は手番が同じなので、評価値の差分が小さくなりやすい。
+    int32_t predictDeep(const Learn::PackedSfenValue* sfens, uint32_t i)
+    {
+        return i >= 2 ? sfens[i - 2].deep : 0;
+    }
+}
+
+bool Learn::SfenCodec::isCompressed(const void* head, size_t size)
+{
+    if (size < sizeof(FileHeader))
+        return false;
+
+    const FileHeader* h = (const FileHeader*)head;
+    return h->magic == MAGIC && h->version == VERSION && h->block_sfens > 0;
+}
+
+void Learn::SfenCodec::encode(const PackedSfenValue* sfens, uint32_t count, std::vector<uint8_t>& out)
+{
+    const size_t head = out.size();
+    out.resize(head + sizeof(BlockHeader));
+
+    std::unique_ptr<SfenModel> model(new SfenModel);
+    RangeEncoder enc(out);
+
+    // 盤面の列
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int prev_zero = 1;
+
+        for (int j = 0; j < 32; j++)
+        {
+            uint8_t x = sfens[i].data[j] ^ (i ? sfens[i - 1].data[j] : 0);
+            enc.encode(model->board_zero[j][prev_zero], x != 0);
+
+            if (x)
+                codeTree(enc, model->board_byte[j], 8, x);
+
+            prev_zero = x == 0;
+        }
+    }
+
+    // 評価値の列
+    for (uint32_t i = 0; i < count; i++)
+        codeDeep(enc, *model, sfens[i].deep - predictDeep(sfens, i));
+
+    // 勝敗の列
+    for (uint32_t i = 0; i < count; i++)
+        enc.encode(model->win[i ? sfens[i - 1].win : 0], sfens[i].win);
+
+    // 指し手の列
+    for (uint32_t i = 0; i < count; i++)
+        for (int j = 0; j < 4; j++)
+        {
+            uint8_t b = uint8_t(sfens[i].m >> (j * 8));
+            codeTree(enc, model->move_byte[j], 8, b);
+        }
+
+    enc.flush();
+
+    BlockHeader h = { uint32_t(out.size() - head - sizeof(BlockHeader)), count };
+    memcpy(&out[head], &h, sizeof(h));
+}
+
+bool Learn::SfenCodec::decode(const uint8_t* body, size_t bytes, uint32_t count, PackedSfenValue* out)
+{
+    std::unique_ptr<SfenModel> model(new SfenModel);
+    RangeDecoder dec(body, body + bytes);
+
+    // 詰め物のbyteは保存していないので0にしておく。
+    memset(out, 0, sizeof(PackedSfenValue) * count);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int prev_zero = 1;
+
+        for (int j = 0; j < 32; j++)
+        {
+            uint8_t x = 0;
+
+            if (dec.decode(model->board_zero[j][prev_zero]))
+                codeTree(dec, model->board_byte[j], 8, x);
+
+            out[i].data[j] = x ^ (i ? out[i - 1].data[j] : 0);
+            prev_zero = x == 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        out[i].deep = int16_t(codeDeep(dec, *model) + predictDeep(out, i));
+
+    for (uint32_t i = 0; i < count; i++)
+        out[i].win = dec.decode(model->win[i ? out[i - 1].win : 0]) != 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t m = 0;
+
+        for (int j = 0; j < 4; j++)
+        {
+            uint8_t b;
+            codeTree(dec, model->move_byte[j], 8, b);
+            m |= uint32_t(b) << (j * 8);
+        }
+
+        out[i].m = Move(m);
+    }
+
+    return !dec.overrun();
+}
+
 // Readerとしての初期化。
 void Learn::AsyncSfenRW::initReader(int thread_num, const std::vector<std::string>& files)
 {
@@ -55,10 +373,11 @@ bool Learn::AsyncSfenRW::read(size_t thread_id, PackedSfenValue& ps)
             {
                 std::unique_lock<Mutex> lk(mutex);
 
+                // 読み込んだ順に渡す。後ろから取ると、workerが補充するタイミングによって順番が変わってしまう。
                 if (buffers_pool.size())
                 {
-                    p = buffers_pool.back();
-                    buffers_pool.pop_back();
+                    p = buffers_pool.front();
+                    buffers_pool.erase(buffers_pool.begin());
                     rw_count += THREAD_BUFFER_SIZE;
                     break;
                 }
@@ -96,6 +415,48 @@ bool Learn::AsyncSfenRW::open()
             std::cout << std::endl << "open filename = " << file << std::endl;
     } while (!fs);
 
+    // 圧縮形式かどうかを先頭で判定する。違ったら先頭に戻す。
+    SfenCodec::FileHeader h;
+    compressed = fs.read((char*)&h, sizeof(h)) && SfenCodec::isCompressed(&h, sizeof(h));
+    block_sfens = compressed ? h.block_sfens : 0;
+    decoded.clear();
+    decoded_pos = 0;
+
+    if (!compressed)
+    {
+        fs.clear();
+        fs.seekg(0);
+    }
+
+    return true;
+}
+
+// 開いているファイルから1局面読み出す。圧縮形式ならブロックごとに復号しておいて、そこから取り出す。
+bool Learn::AsyncSfenRW::readRecord(PackedSfenValue& p)
+{
+    if (!compressed)
+        return (bool)fs.read((char*)&p, sizeof(PackedSfenValue));
+
+    if (decoded_pos == decoded.size())
+    {
+        SfenCodec::BlockHeader h;
+
+        if (!fs.read((char*)&h, sizeof(h)) || h.count == 0 || h.count > block_sfens)
+            return false;
+
+        packed.resize(h.bytes);
+        decoded.resize(h.count);
+        decoded_pos = 0;
+
+        if (!fs.read((char*)packed.data(), h.bytes) || !SfenCodec::decode(packed.data(), h.bytes, h.count, decoded.data()))
+        {
+            std::cout << std::endl << "decode error!" << std::endl;
+            decoded.clear();
+            return false;
+        }
+    }
+
+    p = decoded[decoded_pos++];
     return true;
 }
 
@@ -114,7 +475,7 @@ void Learn::AsyncSfenRW::workReader()
         {
             PackedSfenValue p;
 
-            if (fs.read((char*)&p, sizeof(PackedSfenValue)))
+            if (readRecord(p))
                 v.push_back(p);
 
             else if (!open())
@@ -147,7 +508,7 @@ void Learn::AsyncSfenRW::workReader()
 }
 
 // Writerとしての初期化
-void Learn::AsyncSfenRW::initWriter(int thread_num, std::string filename)
+void Learn::AsyncSfenRW::initWriter(int thread_num, std::string filename, uint64_t max_records_)
 {
     rw_count = 0;
     time_stamp_count = 0;
@@ -156,26 +517,90 @@ void Learn::AsyncSfenRW::initWriter(int thread_num, std::string filename)
     for (auto& v : buffers)
         v = nullptr;
 
-    fs.open(filename, std::ios::out | std::ios::binary | std::ios::app);
+    writer_name = filename;
+    max_records = max_records_;
+    file_index = file_records = 0;
+    openWriterFile();
     finished = false;
 }
 
+void Learn::AsyncSfenRW::openWriterFile()
+{
+    if (!max_records)
+    {
+        writer_file = writer_name;
+        fs.open(writer_file, std::ios::out | std::ios::binary | std::ios::app);
+        return;
+    }
+
+    // 拡張子の前に番号を入れる。
+    auto dot = writer_name.find_last_of('.');
+    auto sep = writer_name.find_last_of("/\\");
+
+    if (dot == std::string::npos || (sep != std::string::npos && dot < sep))
+        dot = writer_name.size();
+
+    writer_file = writer_name.substr(0, dot) + "_" + std::to_string(file_index++) + writer_name.substr(dot);
+    fs.open(writer_file + ".tmp", std::ios::out | std::ios::binary | std::ios::trunc);
+    file_records = 0;
+}
+
+void Learn::AsyncSfenRW::closeWriterFile()
+{
+    fs.close();
+
+    if (!max_records)
+        return;
+
+    if (file_records)
+        std::rename((writer_file + ".tmp").c_str(), writer_file.c_str());
+    else
+        std::remove((writer_file + ".tmp").c_str());
+}
+
+void Learn::AsyncSfenRW::writeRecords(const PackedSfenValue* p, size_t n)
+{
+    while (n)
+    {
+        size_t m = max_records ? (size_t)std::min((uint64_t)n, max_records - file_records) : n;
+        fs.write((const char*)p, sizeof(PackedSfenValue) * m);
+        p += m;
+        n -= m;
+        rw_count += m;
+        file_records += m;
+
+        if (max_records && file_records >= max_records)
+        {
+            closeWriterFile();
+            std::cout << std::endl << writer_file << " : " << file_records << " sfens";
+            openWriterFile();
+        }
+    }
+}
+
 void Learn::AsyncSfenRW::finalizeWriter(size_t thread_id)
 {
     auto& buf = buffers[thread_id];
 
+    if (buf == nullptr)
+        return;
+
     if (buf->size() != 0)
     {
         std::unique_lock<Mutex> lk(mutex);
         buffers_pool.push_back(buf);
     }
+    else
+        delete buf;
+
+    buf = nullptr;
 }
 
 void Learn::AsyncSfenRW::terminate()
 {
     finished = true;
     worker.join();
-    fs.close();
+    closeWriterFile();
 }
 
 void Learn::AsyncSfenRW::write(size_t thread_id, const PackedSfenValue& ps)
@@ -227,8 +652,7 @@ void Learn::AsyncSfenRW::workWriter()
         {
             for (auto ptr : buf)
             {
-                fs.write((const char*)ptr->data(), sizeof(PackedSfenValue) * ptr->size());
-                rw_count += ptr->size();
+                writeRecords(ptr->data(), ptr->size());
                 std::cout << ".";
                 delete ptr;
 
@@ -241,4 +665,174 @@ void Learn::AsyncSfenRW::workWriter()
     output_status();
 }
 
+namespace
+{
+    uint64_t gcd(uint64_t a, uint64_t b)
+    {
+        while (b)
+        {
+            uint64_t t = a % b;
+            a = b;
+            b = t;
+        }
+
+        return a;
+    }
+
+    // nと互いに素な[1, n)の数を乱数で選ぶ。これを巡回の歩幅に使えば[0, n)をちょうど一周できる。
+    uint64_t coprimeStride(PRNG& prng, uint64_t n)
+    {
+        if (n <= 2)
+            return 1;
+
+        uint64_t s = prng.rand(n - 1) + 1;
+
+        while (gcd(s, n) != 1)
+            s = s % (n - 1) + 1;
+
+        return s;
+    }
+}
+
+// ファイルを一つマップする。
+void Learn::MappedSfenReader::map(const std::string& file)
+{
+    std::unique_ptr<FileMapping> mapping(new FileMapping);
+
+    if (!mapping->map(file))
+    {
+        std::cout << std::endl << "open error! filename = " << file << std::endl;
+        return;
+    }
+
+    const uint8_t* data = mapping->data();
+    const size_t bytes = mapping->size();
+    maps.push_back(std::move(mapping));
+
+    uint64_t n = 0;
+
+    if (SfenCodec::isCompressed(data, bytes))
+    {
+        // 圧縮形式なら、ブロックのヘッダーをたどって本体の位置を覚えておく。
+        const auto& fh = *(const SfenCodec::FileHeader*)data;
+        const uint8_t* p = data + sizeof(SfenCodec::FileHeader);
+        const uint8_t* end = data + bytes;
+
+        while (p + sizeof(SfenCodec::BlockHeader) <= end)
+        {
+            SfenCodec::BlockHeader h;
+            memcpy(&h, p, sizeof(h));
+            p += sizeof(h);
+
+            if (h.count == 0 || h.count > fh.block_sfens || h.bytes > size_t(end - p))
+            {
+                std::cout << std::endl << "broken block! filename = " << file << std::endl;
+                break;
+            }
+
+            blocks.push_back({ nullptr, h.count, h.bytes, p });
+            max_block_size = std::max(max_block_size, h.count);
+            n += h.count;
+            p += h.bytes;
+        }
+    }
+    else
+    {
+        const auto sfens = (const PackedSfenValue*)data;
+        n = bytes / sizeof(PackedSfenValue);
+
+        for (uint64_t i = 0; i < n; i += BLOCK_SIZE)
+            blocks.push_back({ sfens + i, (uint32_t)std::min<uint64_t>(BLOCK_SIZE, n - i), 0, nullptr });
+    }
+
+    sfen_count += n;
+    std::cout << std::endl << "open filename = " << file << " , " << n << " sfens" << std::endl;
+}
+
+bool Learn::MappedSfenReader::open(int thread_num, const std::vector<std::string>& files, int loop)
+{
+    close();
+
+    for (auto& f : files)
+        map(f);
+
+    if (blocks.empty())
+        return false;
+
+    // ファイルをまたいでブロックの順番をシャッフルする。
+    PRNG prng(20160720);
+
+    for (size_t i = 0, size = blocks.size(); i < size; ++i)
+        std::swap(blocks[i], blocks[prng.rand(size - i) + i]);
+
+    cursors.assign(thread_num, Cursor());
+    decoded.assign(max_block_size ? thread_num : 0, SfenVector(max_block_size));
+    total_blocks = (uint64_t)blocks.size() * loop;
+    next_block = 0;
+    rw_count = 0;
+    return true;
+}
+
+void Learn::MappedSfenReader::close()
+{
+    maps.clear();
+    blocks.clear();
+    cursors.clear();
+    decoded.clear();
+    total_blocks = sfen_count = 0;
+    max_block_size = 0;
+}
+
+// データを一つ読みだす。
+bool Learn::MappedSfenReader::read(size_t thread_id, PackedSfenValue& ps)
+{
+    auto& c = cursors[thread_id];
+
+    // 受け持ちのブロックを読み終わったら次のブロックをもらう。
+    while (c.count == c.size)
+    {
+        const uint64_t k = next_block.fetch_add(1, std::memory_order_relaxed);
+
+        if (k >= total_blocks)
+            return false;
+
+        // 通し番号から乱数を作るので、どのスレッドが受け取っても同じ順番で読み出される。
+        // 2周目以降は周回ごとに選んだ歩幅でブロックの並びも変える。
+        const uint64_t n = blocks.size();
+        const uint64_t lap = k / n;
+        PRNG lap_prng(lap * 0x9e3779b97f4a7c15ULL + 1);
+        const uint64_t a = lap ? coprimeStride(lap_prng, n) : 1;
+        const uint64_t offset = lap ? lap_prng.rand(n) : 0;
+        const Block& block = blocks[(k % n * a + offset) % n];
+
+        c.data = block.data;
+        c.size = c.count = 0;
+
+        if (block.packed)
+        {
+            auto& buf = decoded[thread_id];
+
+            // 壊れたブロックは読み飛ばす。
+            if (!SfenCodec::decode(block.packed, block.packed_bytes, block.size, buf.data()))
+            {
+                std::cout << std::endl << "decode error! block = " << k % n << std::endl;
+                continue;
+            }
+
+            c.data = buf.data();
+        }
+
+        PRNG prng(k * 0xbf58476d1ce4e5b9ULL + 1);
+        c.size = block.size;
+        c.stride = (uint32_t)coprimeStride(prng, c.size);
+        c.pos = (uint32_t)prng.rand(c.size);
+        rw_count += c.size;
+    }
+
+    ps = c.data[c.pos];
+    c.pos = (c.pos + c.stride) % c.size;
+    c.count++;
+    return true;
+}
+
 #endif
\ No newline at end of file
@@ -25,6 +25,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <string>
 #include <fstream>
+#include <atomic>
+#include <memory>
 
 #include "config.h"
 #include "thread.h"
@@ -43,6 +45,30 @@ namespace Learn
     typedef std::vector<PackedSfenValue> SfenVector;
 
 #ifdef LEARN
+    // 教師局面の圧縮形式。ファイルの先頭にFileHeader、その後にブロックが並ぶ。
+    // 各ブロックはBlockHeaderとレンジコーダーで符号化した本体からなり、ほかのブロックと関係なく復号できる。
+    // 本体はフィールドごとに列を分けて符号化する。盤面は直前の局面とのxor、評価値は2つ前(同じ手番)の局面との差分をとる。
+    namespace SfenCodec
+    {
+        const uint32_t MAGIC = 0x5a465359; // "YSFZ"
+        const uint32_t VERSION = 1;
+
+        // 1ブロックあたりの局面数
+        const uint32_t BLOCK_SFENS = 4096;
+
+        struct FileHeader { uint32_t magic, version, block_sfens, reserved; };
+        struct BlockHeader { uint32_t bytes, count; };
+
+        // ファイルの先頭を見て、圧縮形式かどうかを判定する。
+        bool isCompressed(const void* head, size_t size);
+
+        // count個の局面を1ブロックに符号化してoutの末尾に追加する。BlockHeaderも含む。
+        void encode(const PackedSfenValue* sfens, uint32_t count, std::vector<uint8_t>& out);
+
+        // BlockHeaderの後ろの本体を復号する。outにはcount個分の領域が必要。
+        bool decode(const uint8_t* body, size_t bytes, uint32_t count, PackedSfenValue* out);
+    }
+
     // 非同期にファイルからread/writeするためのクラス
     struct AsyncSfenRW 
     {
@@ -57,15 +83,22 @@ namespace Learn
         uint64_t readCount() const { return rw_count; }
 
         // Writerとして使う場合
-        void initWriter(int thread_num, std::string filename);
+        // max_recordsを指定すると、その局面数ごとに"名前_番号.拡張子"のファイルに切り替えて書き出す。
+        // 書き込み中のファイルは末尾に".tmp"を付けておき、書き終えてから名前を変えるので、
+        // 生成を続けながら書き終えたファイルから読み始めることができる。
+        void initWriter(int thread_num, std::string filename, uint64_t max_records = 0);
         void finalizeWriter(size_t thread_id);
         void startWriter() { worker = std::thread([&] { workWriter(); }); }
         void write(size_t thread_id, const PackedSfenValue& p);
 
     private: 
         bool open();
+        bool readRecord(PackedSfenValue& p);
         void workReader();
         void workWriter();
+        void writeRecords(const PackedSfenValue* p, size_t n);
+        void openWriterFile();
+        void closeWriterFile();
 
         static const uint64_t FILE_WRITE_INTERVAL = 5000;
         static const size_t THREAD_BUFFER_SIZE = 10 * 1000;
@@ -93,7 +126,74 @@ namespace Learn
         // Readするファイル名
         std::vector<std::string> filenames;
 
+        // Writeするファイル名と、ファイルを切り替える局面数、今のファイルの番号と局面数
+        std::string writer_name, writer_file;
+        uint64_t max_records = 0, file_index = 0, file_records = 0;
+
+        // 開いているファイルが圧縮形式のとき、復号したブロックとその読み出し位置
+        bool compressed = false;
+        uint32_t block_sfens = 0;
+        SfenVector decoded;
+        size_t decoded_pos = 0;
+        std::vector<uint8_t> packed;
+
         PRNG prng;
     };
+
+    // 教師局面のファイルをすべてメモリマップして読み出すクラス。
+    // 全ファイルをBLOCK_SIZE局面ずつのブロックに分けてファイルをまたいでブロックの順番をシャッフルし、
+    // ブロックの中は受け取ったスレッドがブロックごとに決まるランダムな歩幅で巡回する。
+    // ブロックの受け渡しはatomicなカウンターを進めるだけなので、ロックもsleepもなく、コピーも発生しない。
+    // 圧縮形式のファイルは圧縮時のブロックをそのまま使い、受け取ったスレッドがそれぞれ復号する。
+    struct MappedSfenReader
+    {
+        ~MappedSfenReader() { close(); }
+
+        // ファイルをマップしてブロックの順番を決める。loopは全ファイルを何周するか。
+        bool open(int thread_num, const std::vector<std::string>& files, int loop);
+        void close();
+        bool read(size_t thread_id, PackedSfenValue& ps);
+        uint64_t readCount() const { return rw_count; }
+
+        // 1周分の局面数
+        uint64_t size() const { return sfen_count; }
+
+    private:
+        static const uint32_t BLOCK_SIZE = 256;
+
+        // 圧縮形式のブロックはpackedに本体を指し、dataはnullptrにしておく。
+        struct Block
+        {
+            const PackedSfenValue* data;
+            uint32_t size;
+            uint32_t packed_bytes;
+            const uint8_t* packed;
+        };
+
+        // スレッドごとの読み出し位置。隣のスレッドと同じキャッシュラインに乗らないように詰め物をしておく。
+        struct Cursor
+        {
+            const PackedSfenValue* data = nullptr;
+            uint32_t size = 0, count = 0, pos = 0, stride = 1;
+            uint8_t padding[40];
+        };
+
+        void map(const std::string& file);
+
+        std::vector<std::unique_ptr<FileMapping>> maps;
+        std::vector<Block> blocks;
+        std::vector<Cursor> cursors;
+
+        // スレッドごとの、圧縮されたブロックを復号する先
+        std::vector<SfenVector> decoded;
+
+        // 次に渡すブロックの通し番号と、これまでに渡した局面数
+        std::atomic<uint64_t> next_block;
+        std::atomic<uint64_t> rw_count;
+
+        uint64_t total_blocks = 0;
+        uint64_t sfen_count = 0;
+        uint32_t max_block_size = 0;
+    };
 #endif
 } // namespace Learn
\ No newline at end of file
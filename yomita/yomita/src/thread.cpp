@@ -154,6 +154,9 @@ void ThreadPool::startThinking(const Board& b, const LimitsType& limits)
         th->setPosition(Board(b, th));
         th->max_ply = 0;
         th->nodes = 0;
+#ifdef USE_SEARCH_STATS
+        th->search_stats.clear();
+#endif
         th->root_depth = th->completed_depth = DEPTH_ZERO;
         th->root_moves = root_moves;
     }
@@ -35,7 +35,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "search.h"
 #include "movepick.h"
 
-const int MAX_THREADS = 64;
+// 探索スレッド数の上限。"Threads"オプションの最大値にも使う。
+const int MAX_THREADS = 128;
 
 typedef std::mutex Mutex;
 typedef std::condition_variable ConditionVariable;
@@ -84,6 +85,11 @@ struct Thread
     int max_ply;
     std::atomic<uint64_t> nodes;
 
+#ifdef USE_SEARCH_STATS
+    // 探索の統計
+    Search::Statistics search_stats;
+#endif
+
     // ある指し手に対する指し手を保存しておく配列
     MoveStats counter_moves;
 
@@ -113,6 +119,19 @@ struct MainThread : public Thread
     double best_move_changes;
     Score previous_score;
     int calls_cnt = 0;
+
+    // 反復深化の1反復ごとの結果。
+    struct Iteration
+    {
+        Depth depth;
+        int time;
+        uint64_t nodes;
+        Move best_move;
+        Score score;
+    };
+
+    // 今回の探索の各反復の結果。最後の要素はbestmoveとして返した指し手。bench suiteで正解にたどり着いた時点を調べるのに使う。
+    std::vector<Iteration> iterations;
 };
 
 // MainThreadを除くループをまわすためのもの
@@ -175,8 +194,12 @@ inline void ThreadPool::startWorkers(size_t thread_num)
     exit();
 
     for (int i = 0; i < (int)thread_num; i++)
-    {
         push_back(new T());
-        back()->startSearching();
-    }
+
+    // 全スレッドを作り終えてから動かす。メインスレッドがslavesを参照している最中にpush_backされると壊れる。
+    // メインスレッドは最後に動かして、slavesがすでに動き出していることを保証する。
+    for (auto th : slaves)
+        th->startSearching();
+
+    main()->startSearching();
 }
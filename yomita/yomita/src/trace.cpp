@@ -0,0 +1,151 @@
+﻿/*
+読み太（yomita）, a USI shogi (Japanese chess) playing engine derived from
+Stockfish 7 & YaneuraOu mid 2016 V3.57
+Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Motohiro Isozaki(YaneuraOu author)
+Copyright (C) 2016-2017 Ryuzo Tukamoto
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.h"
+
+#ifdef USE_TRACE
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+namespace Trace
+{
+    namespace
+    {
+        // 1つの記録先に残すイベントの数。2のべき乗。
+        const uint64_t RING_SIZE = 4096;
+
+        struct Event
+        {
+            int64_t time; // [us]
+            int32_t arg;
+            EventType type;
+        };
+
+        static_assert(sizeof(Event) == 16, "");
+
+        // 書き込むのは1スレッドだけなので、書き込み位置を進めるだけでよい。
+        struct Ring
+        {
+            Event events[RING_SIZE];
+            std::atomic<uint64_t> head;
+        };
+
+        Ring Rings[SLOT_NB];
+
+        const auto Epoch = std::chrono::steady_clock::now();
+
+        int64_t nowMicros()
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Epoch).count();
+        }
+
+        // イベントの名前、trace eventのphase(B : 開始, E : 終了, i : 瞬間)、argの名前
+        const struct { const char* name; char phase; const char* arg; } EventInfo[EVENT_NB] =
+        {
+            { "go",                     'i', nullptr },
+            { "stop command",           'i', nullptr },
+            { "ponderhit",              'i', nullptr },
+            { "gameover",               'i', nullptr },
+            { "search",                 'B', nullptr },
+            { "search",                 'E', nullptr },
+            { "iteration",              'B', "depth" },
+            { "iteration",              'E', "depth" },
+            { "stop (checkTime)",       'i', "elapsed" },
+            { "stop (time management)", 'i', "elapsed" },
+            { "stop (mate)",            'i', nullptr },
+            { "mate found",             'i', "plies" },
+            { "join slaves",            'B', nullptr },
+            { "join slaves",            'E', nullptr },
+            { "slave joined",           'i', "thread" },
+            { "bestmove",               'B', nullptr },
+            { "bestmove",               'E', nullptr },
+        };
+    }
+
+    void record(int slot, EventType type, int arg)
+    {
+        // 範囲外の記録先には書かない。ほかのスレッドの記録先やRingsの外を壊さないように
+        if (slot < 0 || slot >= SLOT_NB)
+            return;
+
+        Ring& r = Rings[slot];
+        const uint64_t h = r.head.load(std::memory_order_relaxed);
+        r.events[h & (RING_SIZE - 1)] = { nowMicros(), arg, type };
+        r.head.store(h + 1, std::memory_order_release);
+    }
+
+    void dump(const std::string& file_name)
+    {
+        std::ofstream ofs(file_name);
+
+        if (!ofs)
+        {
+            std::cout << "info string can't open " << file_name << std::endl;
+            return;
+        }
+
+        size_t count = 0;
+        ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        for (int slot = 0; slot < SLOT_NB; slot++)
+        {
+            const Ring& r = Rings[slot];
+            const uint64_t head = r.head.load(std::memory_order_acquire);
+
+            if (!head)
+                continue;
+
+            const std::string name = slot == USI_SLOT  ? "usi"
+                                   : slot == MATE_SLOT ? "mate"
+                                   : slot == 0         ? "main"
+                                   :                     "thread " + std::to_string(slot);
+
+            ofs << (count++ ? ",\n" : "\n")
+                << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << slot
+                << ",\"args\":{\"name\":\"" << name << "\"}}";
+
+            for (uint64_t i = head > RING_SIZE ? head - RING_SIZE : 0; i < head; i++)
+            {
+                const Event& e = r.events[i & (RING_SIZE - 1)];
+                const auto& info = EventInfo[e.type];
+
+                ofs << ",\n{\"name\":\"" << info.name << "\",\"ph\":\"" << info.phase << "\""
+                    << (info.phase == 'i' ? ",\"s\":\"t\"" : "")
+                    << ",\"ts\":" << e.time << ",\"pid\":1,\"tid\":" << slot;
+
+                if (info.arg)
+                    ofs << ",\"args\":{\"" << info.arg << "\":" << e.arg << "}";
+
+                ofs << "}";
+                count++;
+            }
+        }
+
+        ofs << "\n]}" << std::endl;
+        std::cout << "info string trace " << count << " events > " << file_name << std::endl;
+    }
+} // namespace Trace
+
+#endif
@@ -0,0 +1,68 @@
+﻿/*
+読み太（yomita）, a USI shogi (Japanese chess) playing engine derived from
+Stockfish 7 & YaneuraOu mid 2016 V3.57
+Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad (Stockfish author)
+Copyright (C) 2015-2016 Motohiro Isozaki(YaneuraOu author)
+Copyright (C) 2016-2017 Ryuzo Tukamoto
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "config.h"
+#include "thread.h"
+
+// 探索とUSIの応答の遅れを調べるためのトレース。
+// スレッドごとのリングバッファに時刻つきのイベントを記録し、Chromeのtrace event形式(JSON)で書き出す。
+// chrome://tracingやPerfettoで開ける。
+namespace Trace
+{
+    enum EventType : uint8_t
+    {
+        GO,                              // "go"を受け取った
+        STOP_COMMAND,                    // "stop", "quit"で探索を止めた
+        PONDERHIT,                       // "ponderhit"を受け取った
+        GAMEOVER,                        // "gameover"を受け取った
+        SEARCH_BEGIN, SEARCH_END,        // MainThread::search()の開始、終了
+        ITERATION_BEGIN, ITERATION_END,  // 反復深化の1反復の開始、終了。argは深さ
+        STOP_TIME,                       // checkTime()が探索を止めた。argは経過時間(ms)
+        STOP_ITERATION,                  // 反復の終わりの時間制御で探索を止めた。argは経過時間(ms)
+        STOP_MATE,                       // 探索が詰みを見つけて止めた
+        MATE_FOUND,                      // 詰み探索スレッドが詰みを見つけた。argは手数
+        JOIN_BEGIN, JOIN_END,            // slaveスレッドの終了待ち
+        SLAVE_JOINED,                    // slaveスレッドが終了した。argはスレッド番号
+        BESTMOVE_BEGIN, BESTMOVE_END,    // bestmoveの出力
+        EVENT_NB
+    };
+
+    // 記録先。探索スレッドはスレッド番号を使い、USIのコマンドを受け取るスレッドと詰み探索スレッドはそれぞれ専用の場所を使う。
+    // 1つの記録先に同時に書き込むのは1スレッドだけにすること。(詰み探索スレッドは結果用のMutexを取ってから書く)
+    const int USI_SLOT = MAX_THREADS;
+    const int MATE_SLOT = MAX_THREADS + 1;
+    const int SLOT_NB = MAX_THREADS + 2;
+
+#ifdef USE_TRACE
+    // イベントを記録する。ロックは取らない。
+    void record(int slot, EventType type, int arg = 0);
+
+    // 記録されているイベントをファイルに書き出す。探索中に呼ぶと古いイベントが上書き途中のことがある。
+    void dump(const std::string& file_name);
+#else
+    inline void record(int slot, EventType type, int arg = 0) {}
+    inline void dump(const std::string& file_name) {}
+#endif
+} // namespace Trace
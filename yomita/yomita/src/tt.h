@@ -103,10 +103,11 @@ public:
     TTEntry* firstEntry(const Key key) const { return &table_[(size_t)key & (cluster_count_ - 1)].entry[0]; }
 
 private:
-    void* mem_;
-    Cluster* table_;
-    uint8_t generation8_;
-    size_t cluster_count_;	
+    // GlobalTT以外はnewで確保されるので、resize()が未確保の状態を判定できるように初期化しておく。
+    void* mem_ = nullptr;
+    Cluster* table_ = nullptr;
+    uint8_t generation8_ = 0;
+    size_t cluster_count_ = 0;
 };
 
 extern TranspositionTable GlobalTT;
@@ -28,8 +28,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "usi.h"
 #include "book.h"
+#include "mate.h"
 #include "board.h"
 #include "timeman.h" // for ponderhit 
+#include "trace.h"
 
 const std::string engine_name = "Yomita_" + std::string(EVAL_TYPE);
 const std::string version = "4.61";
@@ -61,6 +63,12 @@ namespace USI
     // 指し手生成の速度を計測
     void measureGenerateMoves(const Board& b, bool check);
 
+    // 飛び駒の利きテーブルのメモリ使用量と、引き方ごとの速度を計測
+    void measureSliderAttacks(const Board& b);
+
+    // doMove/undoMoveの速度を計測
+    void measureDoMove(Board& b);
+
     // usi文字列の指し手をMoveインスタンスに変換
     Move toMove(const Board& b, std::string str)
     {
@@ -80,6 +88,10 @@ namespace Learn
     void learnProgress(Board& b, std::istringstream& is);
     void onlineLearning(Board& b, std::istringstream& is);
     void blend(Board& b, std::istringstream& is);
+    void compressSfen(std::istringstream& is);
+    void decompressSfen(std::istringstream& is);
+    void sfenTool(Board& b, std::istringstream& is);
+    void benchLearn(Board& b, std::istringstream& is);
 #endif
 } // namespace Learn
 
@@ -156,9 +168,20 @@ void USI::go(const Board &b, std::istringstream& ss_cmd)
     std::string token;
     LimitsType limits; // コンストラクタで0クリアされる。
     limits.start_time = now();
+    Trace::record(Trace::USI_SLOT, Trace::GO);
 
     while (ss_cmd >> token) 
     {
+#ifdef USE_DFPN
+        // 詰み探索。"go mate <ms>"または"go mate infinite"
+        if (token == "mate")
+        {
+            std::string limit = "infinite";
+            ss_cmd >> limit;
+            Mate::goMate(b, limit == "infinite" ? 0 : std::max(atoi(limit.c_str()), 1));
+            return;
+        }
+#endif
         if (token == "searchmoves")
             while (ss_cmd >> token)
                 limits.search_moves.push_back(toMove(b, token));
@@ -268,8 +291,84 @@ void USI::measureGenerateMoves(const Board& b, bool check = false)
         std::cout << legal_moves[i].move << " ";
 
     std::cout << std::endl;
+
+    measureSliderAttacks(b);
+}
+
+// 飛び駒の利きテーブルのメモリ使用量と、pext, magicそれぞれで引いたときの1回あたりの時間を表示する。
+void USI::measureSliderAttacks(const Board& b)
+{
+    const size_t file_rank = sizeof(BB_FILE_ATTACKS) + sizeof(BB_RANK_ATTACKS);
+    const size_t bishop = sizeof(BISHOP_ATTACK) + sizeof(BISHOP_ATTACK_INDEX);
+    const size_t magic = sizeof(FILE_MAGIC) + sizeof(BISHOP_MAGIC) + sizeof(BISHOP_MAGIC_SHIFT);
+
+    std::cout << "slider attack tables = " << (file_rank + bishop + magic) / 1024 << " [KB]"
+              << " (file + rank = " << file_rank / 1024 << " [KB], bishop = " << bishop / 1024
+              << " [KB], magic = " << magic << " [bytes])" << std::endl;
+
+    // 現局面の駒をランダムに増減させた盤面を用意しておき、全升で角と飛車の利きを引く。
+    PRNG rng(20170725);
+    Bitboard occ[64];
+
+    for (auto& o : occ)
+        o = (b.bbOccupied() ^ Bitboard(rng.rand<uint64_t>() & rng.rand<uint64_t>(), rng.rand<uint64_t>() & rng.rand<uint64_t>())) & allOneMask();
+
+    const bool use_pext = UsePextSlider;
+    const uint64_t num = 20000;
+    const uint64_t lookups = num * 64 * (uint64_t)SQ_MAX * 2;
+
+    for (bool pext : { true, false })
+    {
+        setSliderIndexing(pext);
+        Bitboard dummy = allZeroMask();
+        TimePoint start = now();
+
+        for (uint64_t i = 0; i < num; i++)
+            for (auto& o : occ)
+                for (auto sq : Squares)
+                    dummy ^= bishopAttack(sq, o) ^ rookAttack(sq, o);
+
+        TimePoint end = now();
+
+        std::cout << (pext ? "pext " : "magic") << " : " << double(end - start) * 1000000 / lookups << " [ns/lookup]"
+                  << (pext == use_pext ? " (selected)" : "") << (dummy ? "" : " ") << std::endl;
+    }
+
+    setSliderIndexing(use_pext);
 }
 #endif
+
+// 現局面の合法手それぞれについてdoMoveとundoMoveを繰り返し、その速度を計測する。
+void USI::measureDoMove(Board& b)
+{
+    std::cout << b << std::endl;
+
+    MoveList<LEGAL> ml(b);
+    StateInfo st;
+    const uint64_t num = 100000;
+    uint64_t count = 0;
+    TimePoint start = now();
+
+    for (uint64_t i = 0; i < num; i++)
+    {
+        for (auto m : ml)
+        {
+            b.doMove(m, st, b.givesCheck(m));
+            b.undoMove(m);
+        }
+
+        count += ml.size();
+    }
+
+    TimePoint end = now();
+
+    std::cout << "sizeof(StateInfo) = " << sizeof(StateInfo) << " [bytes]" << std::endl;
+    std::cout << "elapsed = " << end - start << " [msec]" << std::endl;
+
+    if (end - start != 0)
+        std::cout << "times/s = " << count * 1000 / (end - start) << " [doMove+undoMove/sec]" << std::endl;
+}
+
 extern void measureBBGenerateMoves(const Board& b);
 extern void measure_module(const Board& b);
 
@@ -309,8 +408,18 @@ void USI::loop(int argc, char** argv)
             || (token == "ponderhit" && Threads.stop_on_ponderhit)
             || token == "gameover")
         {
+            Trace::record(Trace::USI_SLOT, token == "ponderhit" ? Trace::PONDERHIT
+                                         : token == "gameover"  ? Trace::GAMEOVER : Trace::STOP_COMMAND);
             Threads.stop = true;
             Threads.main()->startSearching(true);
+#ifdef USE_TRACE
+            // bestmoveを返し終わってから書き出す。
+            if (token == "gameover" && (std::string)Options["TraceFile"] != "none")
+            {
+                Threads.main()->join();
+                Trace::dump(Options["TraceFile"]);
+            }
+#endif
         }
 
         // USIエンジンとして認識されるために必要なコマンド
@@ -325,6 +434,7 @@ void USI::loop(int argc, char** argv)
         // ponderhitしたときのコマンド
         else if (token == "ponderhit") 
         { 
+            Trace::record(Trace::USI_SLOT, Trace::PONDERHIT);
             Limits.ponder = false;	
 
             if (Limits.byoyomi)
@@ -356,8 +466,38 @@ void USI::loop(int argc, char** argv)
         else if (token == "max") { isready(); board.init("R8/2K1S1SSk/4B4/9/9/9/9/9/1L1L1L3 b RBGSNLP3g3n17p 1"); std::cout << "max set." << std::endl; }
 
         // ベンチマーク。
-        else if (token == "b") { benchmark(board); }
+        else if (token == "b") { std::istringstream is; benchmark(board, is); }
+
+        // "bench [hash N] [threads N] [depth N | nodes N | movetime N] [file <path>] [json]"
+        // 正解付きの局面集を解かせるときは"bench suite <file> [depth N | nodes N | movetime N]"
+        else if (token == "bench")
+        {
+            std::string args;
+            std::getline(ss_cmd, args);
+            std::istringstream is(args);
 
+            if (is >> token && token == "suite")
+                benchmarkSuite(board, is);
+            else
+            {
+                is.clear();
+                is.str(args);
+                benchmark(board, is);
+            }
+        }
+
+#ifdef USE_TRACE
+        // トレースを書き出す。"trace [file]" fileを省略したときはTraceFile、それもnoneならtrace.json
+        else if (token == "trace")
+        {
+            std::string file_name = Options["TraceFile"];
+
+            if (!(ss_cmd >> file_name) && file_name == "none")
+                file_name = "trace.json";
+
+            Trace::dump(file_name);
+        }
+#endif
         // 現局面を表示させる。内部状態を見たいときに使う。
         else if (token == "p") { std::cout << board << std::endl; }
 #ifdef USE_BITBOARD
@@ -370,6 +510,9 @@ void USI::loop(int argc, char** argv)
         // この局面での王手生成速度チェック
         else if (token == "cs") { measureGenerateMoves(board, true); }
 #endif
+        // 現局面の合法手で100K回ずつdoMove/undoMoveして速度を量る。
+        else if (token == "dm") { measureDoMove(board); }
+
         // この局面の合法手をすべて表示する。
         else if (token == "legal") { std::cout << MoveList<LEGAL_ALL>(board) << std::endl; }
 
@@ -408,6 +551,9 @@ void USI::loop(int argc, char** argv)
                 Threads.stop = true;
         }
 
+        // 定跡の作成、変換
+        else if (token == "makebook") { makeBook(board, ss_cmd); }
+
         else if (token == "h") {
             Move m = Book.probe(board);
             std::cout << board << pretty(m) << std::endl;
@@ -428,6 +574,16 @@ void USI::loop(int argc, char** argv)
         else if (token == "learn") { Learn::learn(board, ss_cmd); }
 
         else if (token == "testsfen") { Learn::cleanSfen(board, ss_cmd); }
+
+        // 教師局面のファイルを圧縮形式に変換する/元に戻す。
+        else if (token == "compress_sfen") { Learn::compressSfen(ss_cmd); }
+        else if (token == "decompress_sfen") { Learn::decompressSfen(ss_cmd); }
+
+        // 教師局面の重複除去、絞り込み、分割、シャッフル
+        else if (token == "sfen_tool") { Learn::sfenTool(board, ss_cmd); }
+
+        // 学習の1局面あたりの処理速度を測る。
+        else if (token == "bench_learn") { Learn::benchLearn(board, ss_cmd); }
 #ifdef EVAL_KPPT
         else if (token == "blend") { Learn::blend(board, ss_cmd); }
 #endif
@@ -25,6 +25,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <map>
 #include <string>
+#include <sstream>
 
 #include "thread.h"
 #include "platform.h"
@@ -174,7 +175,8 @@ namespace USI
 
 void userTest();
 void perft(Board &b, int depth);
-void benchmark(Board& b);
+void benchmark(Board& b, std::istringstream& is);
+void benchmarkSuite(Board& b, std::istringstream& is);
 
 std::vector<std::string> evalFiles();
 std::string evalConfig(std::vector<std::string> eval_files);
@@ -36,6 +36,7 @@ namespace fs = std::experimental::filesystem;
 
 #include "tt.h"
 #include "usi.h"
+#include "mate.h"
 
 std::string evalDir() { return path("eval", std::string(EVAL_TYPE)); }
 std::string evalSaveDir() { return path("evalsave", std::string(EVAL_TYPE)); }
@@ -89,7 +90,7 @@ void OptionsMap::init()
 {
     const int MAX_MEMORY = Is64bit ? 65536 : 512;
     const int DEF_MEMORY = Is64bit ? 64 : 1;
-    const int MAX_THREAD = Is64bit ? 128 : 4;
+    const int MAX_THREAD = Is64bit ? MAX_THREADS : 4;
 
     (*this)["Hash"]                  = Option(DEF_MEMORY, 1, MAX_MEMORY, [](const Option& opt) { GlobalTT.resize(opt); });
     (*this)["USI_Ponder"]            = Option(true);
@@ -99,7 +100,29 @@ void OptionsMap::init()
     (*this)["MultiPV"]               = Option(1, 1, 500);
     (*this)["UseBook"]               = Option(true);
     (*this)["BookName"]              = Option("book.txt");
+    (*this)["BookPolicy"]            = Option({ "count", "score", "random" }, "count");
+    (*this)["BookTemperature"]       = Option(100, 0, 10000);
+    (*this)["BookScoreWindow"]       = Option(32000, 0, 32000);
     (*this)["ResignScore"]           = Option(-32000, -32000, 32000);
+    (*this)["MatePly"]               = Option(1, 1, 5);
+#ifdef USE_TRACE
+    // gameoverのときにトレースを書き出すファイル。noneなら書き出さない。
+    (*this)["TraceFile"]             = Option("none");
+#endif
+#ifdef USE_DFPN
+    // 詰み探索用のスレッド数と、スレッド1つあたりの詰み探索用の置換表のサイズ(MB)
+    // 詰み探索スレッドはThreadsとは別に動くので、既定では使わない。
+    (*this)["MateThreads"]           = Option(0, 0, MAX_THREAD, [](const Option&) { Mate::readUsiOptions(); });
+    (*this)["MateHash"]              = Option(16, 1, MAX_MEMORY, [](const Option&) { Mate::readUsiOptions(); });
+#endif
+#ifdef USE_BITBOARD
+    // 飛び駒の利きテーブルの引き方。autoならpextが遅いCPUではmagicを使う。
+    (*this)["SliderAttack"]          = Option({ "auto", "pext", "magic" }, "auto", [](const Option& opt)
+    {
+        const std::string s = opt;
+        setSliderIndexing(s == "pext" || (s == "auto" && !isPextSlow()));
+    });
+#endif
 #ifdef USE_PROGRESS
     (*this)["ProgressDir"]           = Option("progress/0.104809");
 #endif